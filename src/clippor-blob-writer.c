@@ -0,0 +1,273 @@
+#define _GNU_SOURCE // For sync_file_range()
+#include "clippor-blob-writer.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdint.h>
+#include <unistd.h>
+
+/*
+ * Writes data files in batches. Each file is first written to a temporary file
+ * in the same directory and its writeback is started right away. Once the batch
+ * is committed, every file is synced, renamed to its final name, and then the
+ * directory is synced once. The files of a batch are written to the disk
+ * together instead of each one waiting for the previous one to be durable.
+ */
+
+typedef struct
+{
+    char *name; // Final name of the file
+    char *tmp_path;
+    int fd;
+} StagedBlob;
+
+struct _ClipporBlobWriter
+{
+    char *dir;
+    GHashTable *staged; // Name -> StagedBlob
+};
+
+static void
+staged_blob_free(StagedBlob *blob)
+{
+    if (blob->fd != -1)
+        close(blob->fd);
+    g_free(blob->name);
+    g_free(blob->tmp_path);
+    g_free(blob);
+}
+
+ClipporBlobWriter *
+clippor_blob_writer_new(const char *dir)
+{
+    g_assert(dir != NULL);
+
+    ClipporBlobWriter *self = g_new0(ClipporBlobWriter, 1);
+
+    self->dir = g_strdup(dir);
+    self->staged = g_hash_table_new_full(
+        g_str_hash, g_str_equal, NULL, (GDestroyNotify)staged_blob_free
+    );
+
+    return self;
+}
+
+void
+clippor_blob_writer_free(ClipporBlobWriter *self)
+{
+    g_assert(self != NULL);
+
+    clippor_blob_writer_discard(self);
+
+    g_hash_table_unref(self->staged);
+    g_free(self->dir);
+    g_free(self);
+}
+
+static gboolean
+write_all(int fd, const uint8_t *data, size_t sz, GError **error)
+{
+    g_assert(data != NULL || sz == 0);
+    g_assert(error == NULL || *error == NULL);
+
+    size_t written = 0;
+
+    while (written < sz)
+    {
+        ssize_t r = write(fd, data + written, sz - written);
+
+        if (r == -1 && errno == EINTR)
+            continue;
+        else if (r == -1)
+        {
+            int saved_errno = errno;
+
+            g_set_error(
+                error, G_FILE_ERROR, g_file_error_from_errno(saved_errno),
+                "Failed writing file: %s", g_strerror(saved_errno)
+            );
+            return FALSE;
+        }
+        written += r;
+    }
+
+    return TRUE;
+}
+
+/*
+ * Write "bytes" to a temporary file that becomes "name" in the directory once
+ * the batch is committed. Does nothing if "name" already exists or is already
+ * staged, since names are derived from the data.
+ */
+gboolean
+clippor_blob_writer_stage(
+    ClipporBlobWriter *self, const char *name, GBytes *bytes, GError **error
+)
+{
+    g_assert(self != NULL);
+    g_assert(name != NULL);
+    g_assert(bytes != NULL);
+    g_assert(error == NULL || *error == NULL);
+
+    if (g_hash_table_contains(self->staged, name))
+        return TRUE;
+
+    g_autofree char *path = g_build_filename(self->dir, name, NULL);
+
+    if (g_file_test(path, G_FILE_TEST_EXISTS))
+        return TRUE;
+
+    StagedBlob *blob = g_new0(StagedBlob, 1);
+
+    blob->name = g_strdup(name);
+    blob->tmp_path = g_strdup_printf("%s/.%s-XXXXXX", self->dir, name);
+    blob->fd = g_mkstemp_full(blob->tmp_path, O_RDWR | O_CLOEXEC, 0644);
+
+    if (blob->fd == -1)
+    {
+        int saved_errno = errno;
+
+        g_set_error(
+            error, G_FILE_ERROR, g_file_error_from_errno(saved_errno),
+            "Failed creating temporary file for '%s': %s", name,
+            g_strerror(saved_errno)
+        );
+        staged_blob_free(blob);
+        return FALSE;
+    }
+
+    size_t sz;
+    const uint8_t *data = g_bytes_get_data(bytes, &sz);
+
+    if (!write_all(blob->fd, data, sz, error))
+    {
+        g_prefix_error(error, "Failed staging '%s': ", name);
+        g_unlink(blob->tmp_path);
+        staged_blob_free(blob);
+        return FALSE;
+    }
+
+#ifdef SYNC_FILE_RANGE_WRITE
+    // Start writing it to the disk now, so that the rest of the batch is
+    // queued alongside it instead of after it.
+    sync_file_range(blob->fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+#endif
+
+    g_hash_table_insert(self->staged, blob->name, blob);
+
+    return TRUE;
+}
+
+/*
+ * Make every staged file durable under its final name. If this fails, every
+ * staged file is discarded, though files that were already renamed are left
+ * for garbage collection to remove.
+ */
+gboolean
+clippor_blob_writer_commit(ClipporBlobWriter *self, GError **error)
+{
+    g_assert(self != NULL);
+    g_assert(error == NULL || *error == NULL);
+
+    if (g_hash_table_size(self->staged) == 0)
+        return TRUE;
+
+    GHashTableIter iter;
+    StagedBlob *blob;
+
+    // Writeback of every file has already been started, so this mostly waits
+    // for the batch as a whole.
+    g_hash_table_iter_init(&iter, self->staged);
+
+    while (g_hash_table_iter_next(&iter, NULL, (void **)&blob))
+    {
+        if (fdatasync(blob->fd) == -1)
+        {
+            int saved_errno = errno;
+
+            g_set_error(
+                error, G_FILE_ERROR, g_file_error_from_errno(saved_errno),
+                "Failed syncing '%s': %s", blob->name, g_strerror(saved_errno)
+            );
+            goto fail;
+        }
+    }
+
+    g_hash_table_iter_init(&iter, self->staged);
+
+    while (g_hash_table_iter_next(&iter, NULL, (void **)&blob))
+    {
+        g_autofree char *path = g_build_filename(self->dir, blob->name, NULL);
+
+        if (g_rename(blob->tmp_path, path) == -1)
+        {
+            int saved_errno = errno;
+
+            g_set_error(
+                error, G_FILE_ERROR, g_file_error_from_errno(saved_errno),
+                "Failed renaming '%s': %s", blob->name,
+                g_strerror(saved_errno)
+            );
+            goto fail;
+        }
+    }
+
+    // Make the new names durable as well
+    int dir_fd = open(self->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (dir_fd == -1 || fsync(dir_fd) == -1)
+    {
+        int saved_errno = errno;
+
+        if (dir_fd != -1)
+            close(dir_fd);
+
+        g_set_error(
+            error, G_FILE_ERROR, g_file_error_from_errno(saved_errno),
+            "Failed syncing directory '%s': %s", self->dir,
+            g_strerror(saved_errno)
+        );
+        goto fail;
+    }
+    close(dir_fd);
+
+    g_hash_table_remove_all(self->staged);
+
+    return TRUE;
+fail:
+    clippor_blob_writer_discard(self);
+    return FALSE;
+}
+
+/*
+ * Remove every staged file that hasn't been committed.
+ */
+void
+clippor_blob_writer_discard(ClipporBlobWriter *self)
+{
+    g_assert(self != NULL);
+
+    GHashTableIter iter;
+    StagedBlob *blob;
+
+    g_hash_table_iter_init(&iter, self->staged);
+
+    // Files that were already renamed don't exist under their temporary name
+    // anymore, so this is harmless for them.
+    while (g_hash_table_iter_next(&iter, NULL, (void **)&blob))
+        g_unlink(blob->tmp_path);
+
+    g_hash_table_remove_all(self->staged);
+}
+
+/*
+ * Returns the number of files staged since the last commit or discard.
+ */
+uint
+clippor_blob_writer_get_pending(ClipporBlobWriter *self)
+{
+    g_assert(self != NULL);
+
+    return g_hash_table_size(self->staged);
+}
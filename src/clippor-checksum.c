@@ -0,0 +1,271 @@
+#include "clippor-checksum.h"
+#include <glib.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Streaming content checksums used to create data ids. SHA1 is done using
+ * GChecksum, while XXH64 is implemented here since it is small and much faster
+ * than any cryptographic hash. XXH64 ids also include the size of the data, so
+ * that an accidental collision also needs the sizes to match.
+ */
+
+#define XXH_PRIME1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME3 0x165667B19E3779F9ULL
+#define XXH_PRIME4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME5 0x27D4EB2F165667C5ULL
+
+struct _ClipporChecksum
+{
+    ClipporChecksumType type;
+    uint64_t total_len;
+
+    GChecksum *sha1;
+
+    // XXH64 state
+    uint64_t acc[4];
+    uint8_t mem[32]; // Input that doesn't fill a whole stripe yet
+    size_t mem_len;
+};
+
+static inline uint64_t
+xxh64_rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t
+xxh64_read64(const uint8_t *p)
+{
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return GUINT64_FROM_LE(v);
+}
+
+static inline uint32_t
+xxh64_read32(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return GUINT32_FROM_LE(v);
+}
+
+static inline uint64_t
+xxh64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_PRIME2;
+    acc = xxh64_rotl(acc, 31);
+    return acc * XXH_PRIME1;
+}
+
+static inline uint64_t
+xxh64_merge_round(uint64_t acc, uint64_t val)
+{
+    acc ^= xxh64_round(0, val);
+    return acc * XXH_PRIME1 + XXH_PRIME4;
+}
+
+/*
+ * Consume a single 32 byte stripe
+ */
+static inline void
+xxh64_stripe(uint64_t *acc, const uint8_t *p)
+{
+    acc[0] = xxh64_round(acc[0], xxh64_read64(p));
+    acc[1] = xxh64_round(acc[1], xxh64_read64(p + 8));
+    acc[2] = xxh64_round(acc[2], xxh64_read64(p + 16));
+    acc[3] = xxh64_round(acc[3], xxh64_read64(p + 24));
+}
+
+static uint64_t
+xxh64_digest(ClipporChecksum *self)
+{
+    uint64_t h;
+
+    if (self->total_len >= 32)
+    {
+        uint64_t *acc = self->acc;
+
+        h = xxh64_rotl(acc[0], 1) + xxh64_rotl(acc[1], 7) +
+            xxh64_rotl(acc[2], 12) + xxh64_rotl(acc[3], 18);
+
+        for (int i = 0; i < 4; i++)
+            h = xxh64_merge_round(h, acc[i]);
+    }
+    else
+        h = XXH_PRIME5; // Seed is always zero
+
+    h += self->total_len;
+
+    const uint8_t *p = self->mem;
+    const uint8_t *end = p + self->mem_len;
+
+    for (; p + 8 <= end; p += 8)
+    {
+        h ^= xxh64_round(0, xxh64_read64(p));
+        h = xxh64_rotl(h, 27) * XXH_PRIME1 + XXH_PRIME4;
+    }
+    if (p + 4 <= end)
+    {
+        h ^= (uint64_t)xxh64_read32(p) * XXH_PRIME1;
+        h = xxh64_rotl(h, 23) * XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+    }
+    for (; p < end; p++)
+    {
+        h ^= *p * XXH_PRIME5;
+        h = xxh64_rotl(h, 11) * XXH_PRIME1;
+    }
+
+    // Avalanche
+    h ^= h >> 33;
+    h *= XXH_PRIME2;
+    h ^= h >> 29;
+    h *= XXH_PRIME3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+static void
+xxh64_update(ClipporChecksum *self, const uint8_t *data, size_t len)
+{
+    const uint8_t *p = data;
+    const uint8_t *end = data + len;
+
+    // Fill up the leftover stripe from the last update first
+    if (self->mem_len > 0)
+    {
+        size_t n = MIN(len, 32 - self->mem_len);
+
+        memcpy(self->mem + self->mem_len, p, n);
+        self->mem_len += n;
+        p += n;
+
+        if (self->mem_len < 32)
+            return;
+
+        xxh64_stripe(self->acc, self->mem);
+        self->mem_len = 0;
+    }
+
+    for (; p + 32 <= end; p += 32)
+        xxh64_stripe(self->acc, p);
+
+    if (p < end)
+    {
+        memcpy(self->mem, p, end - p);
+        self->mem_len = end - p;
+    }
+}
+
+ClipporChecksum *
+clippor_checksum_new(ClipporChecksumType type)
+{
+    ClipporChecksum *self = g_new0(ClipporChecksum, 1);
+
+    self->type = type;
+
+    if (type == CLIPPOR_CHECKSUM_SHA1)
+        self->sha1 = g_checksum_new(G_CHECKSUM_SHA1);
+
+    clippor_checksum_reset(self);
+
+    return self;
+}
+
+void
+clippor_checksum_free(ClipporChecksum *self)
+{
+    g_assert(self != NULL);
+
+    if (self->sha1 != NULL)
+        g_checksum_free(self->sha1);
+    g_free(self);
+}
+
+void
+clippor_checksum_reset(ClipporChecksum *self)
+{
+    g_assert(self != NULL);
+
+    self->total_len = 0;
+
+    if (self->type == CLIPPOR_CHECKSUM_SHA1)
+    {
+        g_checksum_reset(self->sha1);
+        return;
+    }
+
+    self->acc[0] = XXH_PRIME1 + XXH_PRIME2;
+    self->acc[1] = XXH_PRIME2;
+    self->acc[2] = 0;
+    self->acc[3] = -XXH_PRIME1;
+    self->mem_len = 0;
+}
+
+void
+clippor_checksum_update(
+    ClipporChecksum *self, const uint8_t *data, size_t len
+)
+{
+    g_assert(self != NULL);
+    g_assert(data != NULL || len == 0);
+
+    self->total_len += len;
+
+    if (self->type == CLIPPOR_CHECKSUM_SHA1)
+        g_checksum_update(self->sha1, data, len);
+    else
+        xxh64_update(self, data, len);
+}
+
+/*
+ * Returns the data id for everything that was passed to
+ * clippor_checksum_update(). No more data may be added afterwards until the
+ * checksum is reset.
+ */
+char *
+clippor_checksum_get_string(ClipporChecksum *self)
+{
+    g_assert(self != NULL);
+
+    if (self->type == CLIPPOR_CHECKSUM_SHA1)
+        return g_strdup(g_checksum_get_string(self->sha1));
+
+    return g_strdup_printf(
+        "%016" PRIx64 "%016" PRIx64, xxh64_digest(self), self->total_len
+    );
+}
+
+char *
+clippor_checksum_compute_for_bytes(ClipporChecksumType type, GBytes *bytes)
+{
+    g_assert(bytes != NULL);
+
+    g_autoptr(ClipporChecksum) checksum = clippor_checksum_new(type);
+    size_t sz;
+    const uint8_t *data = g_bytes_get_data(bytes, &sz);
+
+    clippor_checksum_update(checksum, data, sz);
+
+    return clippor_checksum_get_string(checksum);
+}
+
+/*
+ * Return the type of checksum that was used to create the given data id.
+ */
+ClipporChecksumType
+clippor_checksum_type_from_string(const char *checksum)
+{
+    g_assert(checksum != NULL);
+
+    // SHA1 ids are 40 characters, while XXH64 ids are 32
+    if (strlen(checksum) == 32)
+        return CLIPPOR_CHECKSUM_XXH64;
+    return CLIPPOR_CHECKSUM_SHA1;
+}
@@ -1,4 +1,5 @@
 #include "clippor-clipboard.h"
+#include "clippor-checksum.h"
 #include "clippor-database.h"
 #include "clippor-entry.h"
 #include "clippor-selection.h"
@@ -21,6 +22,11 @@ typedef struct
     GByteArray *data;
     uint index;
 
+    // Data id of the data being received, updated as each chunk arrives so the
+    // database doesn't need to read the data again. NULL if the clipboard has
+    // no database.
+    ClipporChecksum *checksum;
+
     GCancellable *cancellable; // Same as the one in the clipboard
 } ReceiveContext;
 
@@ -30,6 +36,10 @@ struct _ClipporClipboard
 
     char *label;
     int64_t max_entries;
+    int64_t max_bytes; // Zero means no limit
+    int64_t max_age; // Seconds, zero means no limit
+    int64_t sensitive_max_age; // Same as "max_age", but for sensitive entries
+    uint write_delay; // Milliseconds to wait before writing a new entry
 
     ClipporDatabase *db;
     GPtrArray *selections;
@@ -38,8 +48,23 @@ struct _ClipporClipboard
 
     ClipporEntry *entry; // Current entry that all selections are set to
 
+    // Timeout for writing the current entry to the database. Replaced each
+    // time a new entry is received, so that entries which are superseded
+    // before the write delay passes are never written.
+    GSource *write_source;
+
+    // Timeout for removing expired entries from the database, set to when the
+    // next entry expires.
+    GSource *expire_source;
+    int64_t expire_time; // Real time that "expire_source" is for
+
     GCancellable *cancellable; // Used to cancel the current data receive
                                // operation
+    GCancellable *trim_cancellable; // Used to cancel the trim in progress
+
+    // Used to release data of the current entry that can be loaded again from
+    // the database when memory is low.
+    GMemoryMonitor *memory_monitor;
 
     GPtrArray *allowed_mime_types; // Array of GRegex objects.
     GHashTable *mime_type_groups; // Each key is a GRegex and its value is a ptr
@@ -52,12 +77,19 @@ typedef enum
 {
     PROP_LABEL = 1,
     PROP_MAX_ENTRIES,
+    PROP_MAX_BYTES,
+    PROP_MAX_AGE,
+    PROP_SENSITIVE_MAX_AGE,
+    PROP_WRITE_DELAY,
     PROP_ALLOWED_MIME_TYPES,
     N_PROPERTIES
 } ClipporClipboardProperty;
 
 static GParamSpec *obj_properties[N_PROPERTIES] = {NULL};
 
+static void clippor_clipboard_trim(ClipporClipboard *self);
+static void clippor_clipboard_store_entry(ClipporClipboard *self);
+
 static void
 clippor_clipboard_set_property(
     GObject *object, guint property_id, const GValue *value, GParamSpec *pspec
@@ -72,8 +104,20 @@ clippor_clipboard_set_property(
         self->label = g_value_dup_string(value);
         break;
     case PROP_MAX_ENTRIES:
-        // TODO: also trim entries in database as well
         self->max_entries = g_value_get_int64(value);
+        clippor_clipboard_trim(self);
+        break;
+    case PROP_MAX_BYTES:
+        self->max_bytes = g_value_get_int64(value);
+        break;
+    case PROP_MAX_AGE:
+        self->max_age = g_value_get_int64(value);
+        break;
+    case PROP_SENSITIVE_MAX_AGE:
+        self->sensitive_max_age = g_value_get_int64(value);
+        break;
+    case PROP_WRITE_DELAY:
+        self->write_delay = g_value_get_uint(value);
         break;
     case PROP_ALLOWED_MIME_TYPES:
         if (self->allowed_mime_types != NULL)
@@ -101,6 +145,18 @@ clippor_clipboard_get_property(
     case PROP_MAX_ENTRIES:
         g_value_set_int64(value, self->max_entries);
         break;
+    case PROP_MAX_BYTES:
+        g_value_set_int64(value, self->max_bytes);
+        break;
+    case PROP_MAX_AGE:
+        g_value_set_int64(value, self->max_age);
+        break;
+    case PROP_SENSITIVE_MAX_AGE:
+        g_value_set_int64(value, self->sensitive_max_age);
+        break;
+    case PROP_WRITE_DELAY:
+        g_value_set_uint(value, self->write_delay);
+        break;
     case PROP_ALLOWED_MIME_TYPES:
         g_value_set_boxed(value, self->allowed_mime_types);
         break;
@@ -115,7 +171,28 @@ clippor_clipboard_dispose(GObject *object)
 {
     ClipporClipboard *self = CLIPPOR_CLIPBOARD(object);
 
+    // Write the entry waiting for the write delay, but don't queue a sweep for
+    // it, since the sweep would schedule the next one after we are gone.
+    if (self->write_source != NULL)
+    {
+        g_source_destroy(self->write_source);
+        g_clear_pointer(&self->write_source, g_source_unref);
+        clippor_clipboard_store_entry(self);
+    }
+
+    if (self->expire_source != NULL)
+    {
+        g_source_destroy(self->expire_source);
+        g_clear_pointer(&self->expire_source, g_source_unref);
+    }
+    if (self->trim_cancellable != NULL)
+    {
+        g_cancellable_cancel(self->trim_cancellable);
+        g_clear_object(&self->trim_cancellable);
+    }
+
     g_clear_object(&self->db);
+    g_clear_object(&self->memory_monitor);
     g_clear_pointer(&self->selections, g_ptr_array_unref);
     g_clear_object(&self->entry);
     g_clear_pointer(&self->allowed_mime_types, g_ptr_array_unref);
@@ -152,6 +229,32 @@ clippor_clipboard_class_init(ClipporClipboardClass *class)
         "max-entries", "Max entries", "Maximum number of entries in history", 1,
         G_MAXINT64, 100, G_PARAM_READWRITE | G_PARAM_CONSTRUCT
     );
+    obj_properties[PROP_MAX_BYTES] = g_param_spec_int64(
+        "max-bytes", "Max bytes",
+        "Maximum total size in bytes of the data of the entries in history, or "
+        "zero for no limit",
+        0, G_MAXINT64, 0, G_PARAM_READWRITE | G_PARAM_CONSTRUCT
+    );
+    obj_properties[PROP_MAX_AGE] = g_param_spec_int64(
+        "max-age", "Max age",
+        "Seconds after their last use that unstarred entries are removed from "
+        "history, or zero for no limit",
+        0, G_MAXINT64 / G_TIME_SPAN_SECOND, 0,
+        G_PARAM_READWRITE | G_PARAM_CONSTRUCT
+    );
+    obj_properties[PROP_SENSITIVE_MAX_AGE] = g_param_spec_int64(
+        "sensitive-max-age", "Sensitive max age",
+        "Seconds after their last use that unstarred sensitive entries are "
+        "removed from history, or zero for no limit",
+        0, G_MAXINT64 / G_TIME_SPAN_SECOND, 0,
+        G_PARAM_READWRITE | G_PARAM_CONSTRUCT
+    );
+    obj_properties[PROP_WRITE_DELAY] = g_param_spec_uint(
+        "write-delay", "Write delay",
+        "Milliseconds the selection must stay the same before it is written "
+        "to the database",
+        0, G_MAXUINT, 0, G_PARAM_READWRITE | G_PARAM_CONSTRUCT
+    );
     obj_properties[PROP_ALLOWED_MIME_TYPES] = g_param_spec_boxed(
         "allowed-mime-types", "Allowed mime types",
         "Allowed mime types to store", G_TYPE_PTR_ARRAY, G_PARAM_READWRITE
@@ -219,35 +322,272 @@ clippor_clipboard_update_selections(
     }
 }
 
-gboolean
-clippor_clipboard_set_database(
-    ClipporClipboard *self, ClipporDatabase *db, GError **error
+static void
+low_memory_warning(
+    GMemoryMonitor *monitor G_GNUC_UNUSED,
+    GMemoryMonitorWarningLevel level G_GNUC_UNUSED, ClipporClipboard *self
+)
+{
+    if (self->entry == NULL)
+        return;
+
+    uint64_t released = clippor_entry_release_data(self->entry);
+
+    g_debug(
+        "Released %lu bytes of data for clipboard '%s' due to low memory",
+        released, self->label
+    );
+}
+
+static gboolean expire_timeout(ClipporClipboard *self);
+
+static void
+database_trim_callback(
+    ClipporDatabase *db, GAsyncResult *result, ClipporClipboard *self
 )
+{
+    g_autoptr(GError) error = NULL;
+    int64_t removed = clippor_database_trim_entries_finish(db, result, &error);
+
+    // Cancelled if the maximum changed again before it finished
+    if (removed == -1 &&
+        !g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        g_warning("%s", error->message);
+    else if (removed > 0)
+        g_debug(
+            "Trimmed %ld entries of clipboard '%s'", removed, self->label
+        );
+
+    g_object_unref(self);
+}
+
+/*
+ * Trim the entries in the database to "max_entries" in the background. They
+ * are removed in small batches, so lowering the maximum by a lot doesn't hold
+ * up other writes. Any trim still in progress is cancelled first.
+ */
+static void
+clippor_clipboard_trim(ClipporClipboard *self)
+{
+    g_assert(CLIPPOR_IS_CLIPBOARD(self));
+
+    if (self->db == NULL)
+        return;
+
+    if (self->trim_cancellable != NULL)
+    {
+        g_cancellable_cancel(self->trim_cancellable);
+        g_object_unref(self->trim_cancellable);
+    }
+    self->trim_cancellable = g_cancellable_new();
+
+    clippor_database_trim_entries_async(
+        self->db, self->label, self->max_entries, self->trim_cancellable,
+        (GAsyncReadyCallback)database_trim_callback, g_object_ref(self)
+    );
+}
+
+/*
+ * Make sure expired entries are removed at "time", which is in real time.
+ * Does nothing if they already will be by then.
+ */
+static void
+clippor_clipboard_schedule_expiry(ClipporClipboard *self, int64_t time)
+{
+    g_assert(CLIPPOR_IS_CLIPBOARD(self));
+
+    if (time <= 0)
+        return;
+
+    if (self->expire_source != NULL)
+    {
+        if (self->expire_time <= time)
+            return;
+
+        g_source_destroy(self->expire_source);
+        g_clear_pointer(&self->expire_source, g_source_unref);
+    }
+
+    // Round up, so that the entry has expired once the timeout fires. If the
+    // delay is too long for a timeout, the next expiry is scheduled again
+    // when it fires.
+    int64_t delay = (time - g_get_real_time()) / G_TIME_SPAN_MILLISECOND + 1;
+
+    self->expire_source = g_timeout_source_new(CLAMP(delay, 0, G_MAXUINT));
+    self->expire_time = time;
+
+    g_source_set_callback(
+        self->expire_source, (GSourceFunc)expire_timeout, self, NULL
+    );
+    g_source_attach(self->expire_source, g_main_context_get_thread_default());
+}
+
+static void
+database_expire_callback(
+    ClipporDatabase *db, GAsyncResult *result, ClipporClipboard *self
+)
+{
+    g_autoptr(GError) error = NULL;
+    int64_t next = clippor_database_expire_entries_finish(db, result, &error);
+
+    if (next == -1)
+        g_warning("%s", error->message);
+    // Don't schedule anything if the clipboard was disposed in the meantime
+    else if (self->db != NULL)
+        clippor_clipboard_schedule_expiry(self, next);
+
+    g_object_unref(self);
+}
+
+/*
+ * Remove expired entries in the writer thread of the database, then schedule
+ * the next sweep for when the next entry expires.
+ */
+static void
+clippor_clipboard_expire(ClipporClipboard *self)
+{
+    g_assert(CLIPPOR_IS_CLIPBOARD(self));
+
+    if (self->db == NULL ||
+        (self->max_age == 0 && self->sensitive_max_age == 0))
+        return;
+
+    clippor_database_expire_entries_async(
+        self->db, self->label, self->max_age * G_TIME_SPAN_SECOND,
+        self->sensitive_max_age * G_TIME_SPAN_SECOND, NULL,
+        (GAsyncReadyCallback)database_expire_callback, g_object_ref(self)
+    );
+}
+
+static gboolean
+expire_timeout(ClipporClipboard *self)
+{
+    g_clear_pointer(&self->expire_source, g_source_unref);
+    clippor_clipboard_expire(self);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void
+database_restore_callback(
+    ClipporDatabase *db, GAsyncResult *result, ClipporClipboard *self
+)
+{
+    g_autoptr(GError) error = NULL;
+    ClipporEntry *entry =
+        clippor_database_deserialize_entry_at_index_finish(db, result, &error);
+
+    // Ignore if database is just empty
+    if (entry == NULL)
+    {
+        if (!g_error_matches(
+                error, CLIPPOR_DATABASE_ERROR,
+                CLIPPOR_DATABASE_ERROR_ROW_NOT_EXIST
+            ))
+            g_warning(
+                "Failed loading clipboard '%s': %s", self->label,
+                error->message
+            );
+    }
+    // Something copied while the entry was loading is newer than it, or the
+    // clipboard was disposed in the meantime.
+    else if (self->entry != NULL || self->db == NULL)
+        g_object_unref(entry);
+    else
+    {
+        self->entry = entry;
+        clippor_clipboard_update_selections(self, NULL);
+    }
+
+    g_object_unref(self);
+}
+
+/*
+ * Set the database that entries are stored in, and restore the most recent
+ * entry from it. The entry is loaded in a worker thread, so that clipboards are
+ * restored in parallel. Only its mime types are loaded, the data is loaded
+ * once it is pasted.
+ */
+void
+clippor_clipboard_set_database(ClipporClipboard *self, ClipporDatabase *db)
 {
     g_assert(CLIPPOR_IS_CLIPBOARD(self));
     g_assert(CLIPPOR_IS_DATABASE(db));
-    g_assert(error == NULL || *error == NULL);
 
     if (self->db != NULL)
         g_object_unref(self->db);
     self->db = g_object_ref(db);
 
-    self->entry =
-        clippor_database_deserialize_entry_at_index(db, self->label, 0, error);
-
-    // Ignore if database is just empty
-    if (self->entry == NULL &&
-        (*error)->code != CLIPPOR_DATABASE_ERROR_ROW_NOT_EXIST)
+    if (self->memory_monitor == NULL)
     {
-        g_prefix_error(error, "Failed loading clipboard '%s': ", self->label);
-        return FALSE;
+        self->memory_monitor = g_memory_monitor_dup_default();
+
+        g_signal_connect_object(
+            self->memory_monitor, "low-memory-warning",
+            G_CALLBACK(low_memory_warning), self, G_CONNECT_DEFAULT
+        );
     }
-    g_clear_error(error);
 
-    if (self->entry != NULL)
-        clippor_clipboard_update_selections(self, NULL);
+    clippor_database_deserialize_entry_at_index_async(
+        db, self->label, 0, NULL,
+        (GAsyncReadyCallback)database_restore_callback, g_object_ref(self)
+    );
+
+    // Entries may have expired while we weren't running, or the maximums may
+    // have been lowered.
+    clippor_clipboard_expire(self);
+    clippor_clipboard_trim(self);
+}
+
+static void
+database_add_callback(
+    ClipporDatabase *db, GAsyncResult *result, void *user_data G_GNUC_UNUSED
+)
+{
+    g_autoptr(GError) error = NULL;
+
+    if (!clippor_database_add_entry_finish(db, result, &error))
+        g_warning("Failed adding entry to database: %s", error->message);
+}
+
+/*
+ * Add the current entry to the database. This is done in the writer thread of
+ * the database so that we don't block the main loop. If the same contents were
+ * copied before, the existing entry is moved to the top instead.
+ */
+static void
+clippor_clipboard_store_entry(ClipporClipboard *self)
+{
+    g_assert(CLIPPOR_IS_CLIPBOARD(self));
+    g_assert(self->db != NULL);
+    g_assert(self->entry != NULL);
+
+    clippor_database_add_entry_async(
+        self->db, self->entry, self->max_entries, self->max_bytes, NULL,
+        (GAsyncReadyCallback)database_add_callback, NULL
+    );
+}
+
+/*
+ * Same as clippor_clipboard_store_entry(), then sweep the expired entries.
+ */
+static void
+clippor_clipboard_write_entry(ClipporClipboard *self)
+{
+    clippor_clipboard_store_entry(self);
 
-    return TRUE;
+    // The entry that was the most recent one until now may expire now, so the
+    // sweep is queued after the entry is added to find out when.
+    clippor_clipboard_expire(self);
+}
+
+static gboolean
+write_timeout(ClipporClipboard *self)
+{
+    g_clear_pointer(&self->write_source, g_source_unref);
+    clippor_clipboard_write_entry(self);
+
+    return G_SOURCE_REMOVE;
 }
 
 /*
@@ -260,25 +600,23 @@ selection_data_received(ClipporSelection *sel, ClipporClipboard *cb)
     g_assert(CLIPPOR_IS_CLIPBOARD(cb));
 
     // Update database if we are attached to one
-    if (cb->db != NULL)
+    if (cb->db != NULL && cb->write_delay == 0)
+        clippor_clipboard_write_entry(cb);
+    else if (cb->db != NULL)
     {
-        GError *error = NULL;
-
-        if (!clippor_database_serialize_entry(cb->db, cb->entry, &error))
+        // Restart the delay, discarding the entry that was waiting for it
+        if (cb->write_source != NULL)
         {
-            g_assert(error != NULL);
-            g_warning("Failed serializing entry: %s", error->message);
-            g_error_free(error);
+            g_source_destroy(cb->write_source);
+            g_source_unref(cb->write_source);
         }
 
-        if (!clippor_database_trim_entries(
-                cb->db, cb->label, cb->max_entries, &error
-            ))
-        {
-            g_assert(error != NULL);
-            g_warning("Failed trimming database: %s", error->message);
-            g_error_free(error);
-        }
+        cb->write_source = g_timeout_source_new(cb->write_delay);
+
+        g_source_set_callback(
+            cb->write_source, (GSourceFunc)write_timeout, cb, NULL
+        );
+        g_source_attach(cb->write_source, g_main_context_get_thread_default());
     }
 
     clippor_clipboard_update_selections(cb, sel);
@@ -333,8 +671,17 @@ selection_data_async_ready_callback(
         // EOF received
         const char *mime_type = ctx->mime_types->pdata[ctx->index];
         GBytes *bytes = g_byte_array_free_to_bytes(ctx->data);
+        g_autofree char *data_id = NULL;
+
+        if (ctx->checksum != NULL)
+        {
+            data_id = clippor_checksum_get_string(ctx->checksum);
+            clippor_checksum_reset(ctx->checksum);
+        }
 
-        clippor_entry_add_mime_type(ctx->entry, mime_type, bytes);
+        clippor_entry_add_mime_type_with_id(
+            ctx->entry, mime_type, bytes, data_id
+        );
         g_bytes_unref(bytes);
 
         if (ctx->index + 1 >= ctx->mime_types->len)
@@ -381,9 +728,14 @@ finish:
         stream = new_stream;
     }
     else
+    {
         // Still more data to receive
         g_byte_array_append(ctx->data, ctx->buf, r);
 
+        if (ctx->checksum != NULL)
+            clippor_checksum_update(ctx->checksum, ctx->buf, r);
+    }
+
     g_input_stream_read_async(
         stream, ctx->buf, 4096, G_PRIORITY_HIGH, ctx->cb->cancellable,
         (GAsyncReadyCallback)selection_data_async_ready_callback, ctx
@@ -404,6 +756,7 @@ bail:
     g_object_unref(ctx->cb);
     g_object_unref(ctx->cancellable);
     g_ptr_array_unref(ctx->mime_types);
+    g_clear_pointer(&ctx->checksum, clippor_checksum_free);
     g_free(ctx);
 }
 
@@ -452,6 +805,12 @@ selection_update(ClipporSelection *sel, ClipporClipboard *cb)
     ctx->data = g_byte_array_new();
     ctx->index = i;
 
+    if (cb->db != NULL)
+        ctx->checksum =
+            clippor_checksum_new(clippor_database_get_checksum_type(cb->db));
+    else
+        ctx->checksum = NULL;
+
     cb->cancellable = g_cancellable_new();
     ctx->cancellable = cb->cancellable;
 
@@ -516,6 +875,36 @@ clippor_clipboard_get_label(ClipporClipboard *self)
     return self->label;
 }
 
+/*
+ * Return database used by clipboard or NULL if it doesn't have one. Database
+ * object is owned by the clipboard.
+ */
+ClipporDatabase *
+clippor_clipboard_get_database(ClipporClipboard *self)
+{
+    g_assert(CLIPPOR_IS_CLIPBOARD(self));
+
+    return self->db;
+}
+
+/*
+ * If the current entry is waiting to be written to the database, write it now
+ * instead of waiting for the write delay to pass.
+ */
+void
+clippor_clipboard_flush(ClipporClipboard *self)
+{
+    g_assert(CLIPPOR_IS_CLIPBOARD(self));
+
+    if (self->write_source == NULL)
+        return;
+
+    g_source_destroy(self->write_source);
+    g_clear_pointer(&self->write_source, g_source_unref);
+
+    clippor_clipboard_write_entry(self);
+}
+
 /*
  * Return current entry. Entry object is owned by the clipboard
  */
@@ -55,6 +55,78 @@ clippor_config_populate(
 
     const char *err_msg;
 
+    // Parse database table
+    toml_datum_t database = toml_seek(result.toptab, "database");
+
+    if (database.type == TOML_UNKNOWN)
+        goto skip_database;
+
+    if (database.type != TOML_TABLE)
+        TOML_ERROR("Option 'database' is not a table");
+
+    toml_datum_t checksum = toml_seek(database, "checksum");
+    toml_datum_t inline_threshold = toml_seek(database, "inline_threshold");
+    toml_datum_t memory_budget = toml_seek(database, "memory_budget");
+    toml_datum_t entry_cache_size = toml_seek(database, "entry_cache_size");
+    toml_datum_t storage = toml_seek(database, "storage");
+    toml_datum_t segment_size = toml_seek(database, "segment_size");
+
+    if (checksum.type != TOML_UNKNOWN && checksum.type != TOML_STRING)
+        TOML_ERROR("Option 'checksum' in 'database' is not a string");
+    if (inline_threshold.type != TOML_UNKNOWN &&
+        inline_threshold.type != TOML_INT64)
+        TOML_ERROR("Option 'inline_threshold' in 'database' is not a number");
+    if (inline_threshold.type == TOML_INT64 && inline_threshold.u.int64 < 0)
+        TOML_ERROR("Option 'inline_threshold' in 'database' is negative");
+
+    if (memory_budget.type != TOML_UNKNOWN && memory_budget.type != TOML_INT64)
+        TOML_ERROR("Option 'memory_budget' in 'database' is not a number");
+    if (memory_budget.type == TOML_INT64 && memory_budget.u.int64 < 0)
+        TOML_ERROR("Option 'memory_budget' in 'database' is negative");
+
+    if (entry_cache_size.type != TOML_UNKNOWN &&
+        entry_cache_size.type != TOML_INT64)
+        TOML_ERROR("Option 'entry_cache_size' in 'database' is not a number");
+    if (entry_cache_size.type == TOML_INT64 && entry_cache_size.u.int64 < 0)
+        TOML_ERROR("Option 'entry_cache_size' in 'database' is negative");
+
+    if (storage.type != TOML_UNKNOWN && storage.type != TOML_STRING)
+        TOML_ERROR("Option 'storage' in 'database' is not a string");
+    if (segment_size.type != TOML_UNKNOWN && segment_size.type != TOML_INT64)
+        TOML_ERROR("Option 'segment_size' in 'database' is not a number");
+    if (segment_size.type == TOML_INT64 && segment_size.u.int64 <= 0)
+        TOML_ERROR("Option 'segment_size' in 'database' is not positive");
+
+    if (inline_threshold.type == TOML_INT64)
+        self->database.inline_threshold = inline_threshold.u.int64;
+    if (memory_budget.type == TOML_INT64)
+        self->database.memory_budget = memory_budget.u.int64;
+    if (entry_cache_size.type == TOML_INT64)
+        self->database.entry_cache_size = entry_cache_size.u.int64;
+    if (segment_size.type == TOML_INT64)
+        self->database.segment_size = segment_size.u.int64;
+
+    if (checksum.type == TOML_STRING)
+    {
+        if (g_strcmp0(checksum.u.str.ptr, "xxh64") == 0)
+            self->database.flags |= CLIPPOR_DATABASE_FAST_CHECKSUM;
+        else if (g_strcmp0(checksum.u.str.ptr, "sha1") != 0)
+            TOML_ERROR(
+                "Option 'checksum' in 'database' must be 'sha1' or 'xxh64'"
+            );
+    }
+
+    if (storage.type == TOML_STRING)
+    {
+        if (g_strcmp0(storage.u.str.ptr, "packed") == 0)
+            self->database.flags |= CLIPPOR_DATABASE_PACKED;
+        else if (g_strcmp0(storage.u.str.ptr, "files") != 0)
+            TOML_ERROR(
+                "Option 'storage' in 'database' must be 'files' or 'packed'"
+            );
+    }
+
+skip_database:;
     // Parse clipboards array
     toml_datum_t clipboards = toml_seek(result.toptab, "clipboards");
 
@@ -74,6 +146,11 @@ clippor_config_populate(
 
         toml_datum_t label = toml_seek(clipboard, "clipboard");
         toml_datum_t max_entries = toml_seek(clipboard, "max_entries");
+        toml_datum_t max_bytes = toml_seek(clipboard, "max_bytes");
+        toml_datum_t max_age = toml_seek(clipboard, "max_age");
+        toml_datum_t sensitive_max_age =
+            toml_seek(clipboard, "sensitive_max_age");
+        toml_datum_t write_delay = toml_seek(clipboard, "write_delay");
 
         toml_datum_t allowed_mime_types =
             toml_seek(clipboard, "allowed_mime_types");
@@ -88,6 +165,34 @@ clippor_config_populate(
             );
         if (max_entries.type != TOML_UNKNOWN && max_entries.type != TOML_INT64)
             TOML_ERROR("Option 'max_entries' in 'clipboards' is not a number");
+        if (max_bytes.type != TOML_UNKNOWN &&
+            (max_bytes.type != TOML_INT64 || max_bytes.u.int64 < 0))
+            TOML_ERROR(
+                "Option 'max_bytes' in 'clipboards' is not a valid number of "
+                "bytes"
+            );
+        if (max_age.type != TOML_UNKNOWN &&
+            (max_age.type != TOML_INT64 || max_age.u.int64 < 0 ||
+             max_age.u.int64 > G_MAXINT64 / G_TIME_SPAN_SECOND))
+            TOML_ERROR(
+                "Option 'max_age' in 'clipboards' is not a valid number of "
+                "seconds"
+            );
+        if (sensitive_max_age.type != TOML_UNKNOWN &&
+            (sensitive_max_age.type != TOML_INT64 ||
+             sensitive_max_age.u.int64 < 0 ||
+             sensitive_max_age.u.int64 > G_MAXINT64 / G_TIME_SPAN_SECOND))
+            TOML_ERROR(
+                "Option 'sensitive_max_age' in 'clipboards' is not a valid "
+                "number of seconds"
+            );
+        if (write_delay.type != TOML_UNKNOWN &&
+            (write_delay.type != TOML_INT64 || write_delay.u.int64 < 0 ||
+             write_delay.u.int64 > G_MAXUINT))
+            TOML_ERROR(
+                "Option 'write_delay' in 'clipboards' is not a valid number of "
+                "milliseconds"
+            );
         if (allowed_mime_types.type != TOML_UNKNOWN &&
             allowed_mime_types.type != TOML_ARRAY)
             TOML_ERROR(
@@ -103,6 +208,16 @@ clippor_config_populate(
 
         if (max_entries.type != TOML_UNKNOWN)
             g_object_set(cb, "max-entries", max_entries.u.int64, NULL);
+        if (max_bytes.type != TOML_UNKNOWN)
+            g_object_set(cb, "max-bytes", max_bytes.u.int64, NULL);
+        if (max_age.type != TOML_UNKNOWN)
+            g_object_set(cb, "max-age", max_age.u.int64, NULL);
+        if (sensitive_max_age.type != TOML_UNKNOWN)
+            g_object_set(
+                cb, "sensitive-max-age", sensitive_max_age.u.int64, NULL
+            );
+        if (write_delay.type != TOML_UNKNOWN)
+            g_object_set(cb, "write-delay", (uint)write_delay.u.int64, NULL);
 
         if (allowed_mime_types.type == TOML_ARRAY)
         {
@@ -313,6 +428,11 @@ clippor_config_init(void)
 {
     ClipporConfig *cfg = g_rc_box_new(ClipporConfig);
 
+    cfg->database.flags = CLIPPOR_DATABASE_DEFAULT;
+    cfg->database.inline_threshold = -1;
+    cfg->database.memory_budget = -1;
+    cfg->database.entry_cache_size = -1;
+    cfg->database.segment_size = -1;
     cfg->clipboards = g_ptr_array_new_with_free_func(g_object_unref);
     cfg->wayland_connections = g_ptr_array_new_with_free_func(g_object_unref);
     cfg->wayland_seat_map = g_hash_table_new_full(
@@ -1,9 +1,16 @@
 #include "clippor-database.h"
+#include "clippor-blob-writer.h"
 #include "clippor-entry.h"
+#include "clippor-memory-store.h"
+#include "clippor-pack.h"
+#include <gio/gio.h>
 #include <glib-object.h>
 #include <glib-unix.h>
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <sqlite3.h>
+#include <stdlib.h>
+#include <string.h>
 
 G_DEFINE_QUARK(CLIPPOR_DATABASE_ERROR, clippor_database_error)
 
@@ -19,19 +26,292 @@ struct _ClipporDatabase
     sqlite3 *handle;
     ClipporDatabaseFlags flags;
 
+    // Data that is this size or smaller is stored inside the Blobs table
+    // instead of in its own file.
+    int64_t inline_threshold;
+
     // Used to store the data in memory instead of inside a file if configured
-    // to. Each key is a data id and its value is a GBytes.
-    GHashTable *store;
+    // to. Data over the memory budget is spilled to a file in the data
+    // directory.
+    ClipporMemoryStore *store;
+    uint64_t memory_budget; // Zero means no limit
+
+    // Writes data files of an entry as one batch, which is made durable before
+    // the transaction that refers to them is committed. NULL for in-memory
+    // databases.
+    ClipporBlobWriter *blob_writer;
+
+    // Data that isn't stored inline is appended to segment files instead of
+    // having a file of its own. NULL unless CLIPPOR_DATABASE_PACKED is used or
+    // segments were created before.
+    ClipporPack *pack;
+    uint64_t segment_size;
+
+    // Recently deserialized entries, so that they don't have to be loaded
+    // again. Each key is an entry id and its value is a CachedEntry. The
+    // cached entries are copies without a database set, since entries hold a
+    // reference to it.
+    GHashTable *entry_cache;
+    GQueue entry_lru; // Most recently used first
+    uint64_t entry_cache_size; // Zero means entries are not cached
+    // Incremented whenever a write changes cached entries, so that a reader
+    // doesn't cache an entry it loaded from an older snapshot.
+    uint64_t entry_cache_generation;
+
+    // Each key is a SQL statement string and its value is the prepared
+    // sqlite3_stmt for it. Statements are kept for the lifetime of the
+    // database and are reset after every use.
+    GHashTable *statements;
+
+    ClipporDatabaseStats stats;
+
+    // Protects the handle and everything else above, since the database is
+    // used by both the writer thread and the thread that created it.
+    GMutex lock;
+
+    GThread *writer; // Thread that does queued jobs
+    GAsyncQueue *jobs;
+
+    // Connection used to checkpoint the WAL file without holding the lock.
+    // Opened when it is first needed, and may be used by any thread.
+    sqlite3 *checkpointer;
+
+    // Set while the writer thread moves the rows of an old database to the
+    // compact schema. Nothing else may use the database until it is done, and
+    // "compacted" is signalled. If it failed, "compact_error" is set.
+    gboolean compacting;
+    GCond compacted;
+    GError *compact_error;
+
+    // Idle read-only connections used for listing, searching and looking up
+    // entries, so that reads don't have to wait for the writer. Not used for
+    // in-memory databases, which only have a single connection.
+    GAsyncQueue *readers;
+    int n_readers; // Number of readers opened, accessed atomically
 };
 
 G_DEFINE_TYPE(ClipporDatabase, clippor_database, G_TYPE_OBJECT);
 
+typedef enum
+{
+    PROP_INLINE_THRESHOLD = 1,
+    PROP_MEMORY_BUDGET,
+    PROP_ENTRY_CACHE_SIZE,
+    PROP_SEGMENT_SIZE,
+    N_PROPERTIES
+} ClipporDatabaseProperty;
+
+static GParamSpec *obj_properties[N_PROPERTIES] = {NULL};
+
+typedef enum
+{
+    DATABASE_JOB_SERIALIZE,
+    DATABASE_JOB_ADD,
+    DATABASE_JOB_TRIM,
+    DATABASE_JOB_DELETE,
+    DATABASE_JOB_GC,
+    DATABASE_JOB_EXPIRE,
+    DATABASE_JOB_COMPACT,
+    DATABASE_JOB_FLUSH,
+    DATABASE_JOB_STOP
+} DatabaseJobType;
+
+typedef enum
+{
+    MAINTENANCE_CHECKPOINT,
+    MAINTENANCE_PACK,
+    MAINTENANCE_VACUUM,
+    MAINTENANCE_OPTIMIZE,
+    MAINTENANCE_DONE
+} MaintenanceStep;
+
+typedef enum
+{
+    GC_PHASE_REFCOUNTS,
+    GC_PHASE_FILES
+} GCPhase;
+
+// State of a garbage collection, which is done in small steps so that other
+// jobs don't have to wait for it.
+typedef struct
+{
+    GCPhase phase;
+    int64_t cursor; // Last blob id whose reference count was checked
+    GDir *dir; // Data directory being walked
+    uint64_t reclaimed; // Bytes reclaimed so far
+} DatabaseGC;
+
+// Job for the writer thread
+typedef struct
+{
+    DatabaseJobType type;
+    GTask *task;
+
+    ClipporEntry *entry;
+    char *str; // Clipboard label or entry id
+    int64_t n; // Number of entries to keep, or batches compacted so far
+    int64_t max_bytes; // Total size of entries to keep, zero for no limit
+    int64_t max_age; // Maximum age of entries, zero for no limit
+    int64_t sensitive_age; // Same as "max_age", but for sensitive entries
+    int64_t trimmed; // Entries removed so far by a trim
+    gboolean requeued; // If put back at the end of the queue before it was done
+    void *data;
+    DatabaseGC *gc;
+} DatabaseJob;
+
+// Used to wait for the writer thread to finish all queued jobs
+typedef struct
+{
+    GMutex lock;
+    GCond cond;
+    gboolean done;
+} DatabaseFlush;
+
+// Read-only connection to the database, used by one thread at a time
+typedef struct
+{
+    sqlite3 *handle;
+    GHashTable *statements; // Same as the statements of the database
+} DatabaseReader;
+
+typedef enum
+{
+    READ_JOB_SEARCH,
+    READ_JOB_ENTRIES,
+    READ_JOB_ENTRY,
+    READ_JOB_ENTRY_AT_INDEX,
+    READ_JOB_DATA
+} ReadJobType;
+
+// Read done in a worker thread
+typedef struct
+{
+    ReadJobType type;
+
+    char *cb; // Clipboard label
+    char *str; // Search query, entry id, or data id
+    int64_t n; // Maximum number of results, or index of the entry
+    int64_t cursor;
+} ReadJob;
+
+// Entry kept in the entry cache
+typedef struct
+{
+    ClipporEntry *entry;
+    uint64_t size;
+    GList link; // Link in the LRU queue
+} CachedEntry;
+
+static void database_job_free(DatabaseJob *job);
+static void database_reader_free(DatabaseReader *reader);
+static void clippor_database_cache_trim(ClipporDatabase *self);
+static void *clippor_database_writer_func(ClipporDatabase *self);
+static gboolean clippor_database_migrate(ClipporDatabase *self, GError **error);
+static gboolean
+clippor_database_wait_compacted(ClipporDatabase *self, GError **error);
+
+static void
+clippor_database_set_property(
+    GObject *object, guint property_id, const GValue *value, GParamSpec *pspec
+)
+{
+    ClipporDatabase *self = CLIPPOR_DATABASE(object);
+
+    switch (property_id)
+    {
+    case PROP_INLINE_THRESHOLD:
+        g_mutex_lock(&self->lock);
+        self->inline_threshold = g_value_get_int64(value);
+        g_mutex_unlock(&self->lock);
+        break;
+    case PROP_MEMORY_BUDGET:
+        g_mutex_lock(&self->lock);
+        self->memory_budget = g_value_get_int64(value);
+        if (self->store != NULL)
+            clippor_memory_store_set_budget(self->store, self->memory_budget);
+        g_mutex_unlock(&self->lock);
+        break;
+    case PROP_ENTRY_CACHE_SIZE:
+        g_mutex_lock(&self->lock);
+        self->entry_cache_size = g_value_get_int64(value);
+        clippor_database_cache_trim(self);
+        g_mutex_unlock(&self->lock);
+        break;
+    case PROP_SEGMENT_SIZE:
+        g_mutex_lock(&self->lock);
+        self->segment_size = g_value_get_int64(value);
+        if (self->pack != NULL)
+            clippor_pack_set_segment_size(self->pack, self->segment_size);
+        g_mutex_unlock(&self->lock);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
+        break;
+    }
+}
+
+static void
+clippor_database_get_property(
+    GObject *object, guint property_id, GValue *value, GParamSpec *pspec
+)
+{
+    ClipporDatabase *self = CLIPPOR_DATABASE(object);
+
+    switch (property_id)
+    {
+    case PROP_INLINE_THRESHOLD:
+        g_mutex_lock(&self->lock);
+        g_value_set_int64(value, self->inline_threshold);
+        g_mutex_unlock(&self->lock);
+        break;
+    case PROP_MEMORY_BUDGET:
+        g_mutex_lock(&self->lock);
+        g_value_set_int64(value, self->memory_budget);
+        g_mutex_unlock(&self->lock);
+        break;
+    case PROP_ENTRY_CACHE_SIZE:
+        g_mutex_lock(&self->lock);
+        g_value_set_int64(value, self->entry_cache_size);
+        g_mutex_unlock(&self->lock);
+        break;
+    case PROP_SEGMENT_SIZE:
+        g_mutex_lock(&self->lock);
+        g_value_set_int64(value, self->segment_size);
+        g_mutex_unlock(&self->lock);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
+        break;
+    }
+}
+
 static void
 clippor_database_dispose(GObject *object)
 {
     ClipporDatabase *self = CLIPPOR_DATABASE(object);
 
-    g_clear_pointer(&self->store, g_hash_table_unref);
+    // Let the writer thread finish any queued jobs first
+    if (self->writer != NULL)
+    {
+        DatabaseJob *job = g_new0(DatabaseJob, 1);
+
+        job->type = DATABASE_JOB_STOP;
+        g_async_queue_push(self->jobs, job);
+
+        g_thread_join(self->writer);
+        self->writer = NULL;
+    }
+
+    g_clear_pointer(&self->store, clippor_memory_store_free);
+    g_clear_pointer(&self->blob_writer, clippor_blob_writer_free);
+    g_clear_pointer(&self->pack, clippor_pack_free);
+    g_clear_pointer(&self->readers, g_async_queue_unref);
+    g_queue_init(&self->entry_lru);
+    g_clear_pointer(&self->entry_cache, g_hash_table_unref);
+    self->stats.entry_cache_used = 0;
+
+    // Must be done before the handle is closed
+    g_clear_pointer(&self->statements, g_hash_table_unref);
 
     G_OBJECT_CLASS(clippor_database_parent_class)->dispose(object);
 }
@@ -41,10 +321,16 @@ clippor_database_finalize(GObject *object)
 {
     ClipporDatabase *self = CLIPPOR_DATABASE(object);
 
+    sqlite3_close(self->checkpointer);
     sqlite3_close(self->handle);
     g_free(self->location);
     g_free(self->location_dir);
 
+    g_async_queue_unref(self->jobs);
+    g_cond_clear(&self->compacted);
+    g_clear_error(&self->compact_error);
+    g_mutex_clear(&self->lock);
+
     G_OBJECT_CLASS(clippor_database_parent_class)->finalize(object);
 }
 
@@ -53,15 +339,251 @@ clippor_database_class_init(ClipporDatabaseClass *class)
 {
     GObjectClass *gobject_class = G_OBJECT_CLASS(class);
 
+    gobject_class->set_property = clippor_database_set_property;
+    gobject_class->get_property = clippor_database_get_property;
+
     gobject_class->dispose = clippor_database_dispose;
     gobject_class->finalize = clippor_database_finalize;
+
+    obj_properties[PROP_INLINE_THRESHOLD] = g_param_spec_int64(
+        "inline-threshold", "Inline threshold",
+        "Maximum size in bytes of data that is stored inside the database "
+        "instead of in a file",
+        0, G_MAXINT64, 4096, G_PARAM_READWRITE | G_PARAM_CONSTRUCT
+    );
+    obj_properties[PROP_MEMORY_BUDGET] = g_param_spec_int64(
+        "memory-budget", "Memory budget",
+        "Maximum size in bytes of data kept in memory for an in-memory "
+        "database before it is moved to a temporary file, or zero for no limit",
+        0, G_MAXINT64, 0, G_PARAM_READWRITE | G_PARAM_CONSTRUCT
+    );
+    obj_properties[PROP_ENTRY_CACHE_SIZE] = g_param_spec_int64(
+        "entry-cache-size", "Entry cache size",
+        "Maximum estimated size in bytes of deserialized entries that are kept "
+        "in memory, or zero to not cache entries",
+        0, G_MAXINT64, 4 * 1024 * 1024, G_PARAM_READWRITE | G_PARAM_CONSTRUCT
+    );
+
+    obj_properties[PROP_SEGMENT_SIZE] = g_param_spec_int64(
+        "segment-size", "Segment size",
+        "Size in bytes after which a new segment file is started, if data is "
+        "stored in segment files",
+        1, G_MAXINT64, 64 * 1024 * 1024, G_PARAM_READWRITE | G_PARAM_CONSTRUCT
+    );
+
+    g_object_class_install_properties(
+        gobject_class, N_PROPERTIES, obj_properties
+    );
+}
+
+static void
+cached_entry_free(CachedEntry *cached)
+{
+    g_object_unref(cached->entry);
+    g_free(cached);
+}
+
+static void
+clippor_database_init(ClipporDatabase *self)
+{
+    // Keys are owned by the cached entries
+    self->entry_cache = g_hash_table_new_full(
+        g_str_hash, g_str_equal, NULL, (GDestroyNotify)cached_entry_free
+    );
+    g_queue_init(&self->entry_lru);
+
+    // Keys are not copied because statements are always string literals
+    self->statements = g_hash_table_new_full(
+        g_str_hash, g_str_equal, NULL, (GDestroyNotify)sqlite3_finalize
+    );
+
+    g_mutex_init(&self->lock);
+    g_cond_init(&self->compacted);
+    self->jobs = g_async_queue_new_full((GDestroyNotify)database_job_free);
+    self->readers =
+        g_async_queue_new_full((GDestroyNotify)database_reader_free);
+}
+
+// Schema that new databases are created with, before they are migrated to the
+// latest version.
+static const char *initial_schema =
+    "CREATE TABLE Entries ("
+    "   Position INTEGER PRIMARY KEY AUTOINCREMENT,"
+    "   Id CHAR(40) NOT NULL UNIQUE,"
+    "   Creation_time INTEGER NOT NULL CHECK (Creation_time > 0),"
+    "   Last_used_time INTEGER NOT NULL CHECK (Last_used_time > 0),"
+    "   Flags INTEGER NOT NULL CHECK (Flags >= 0),"
+    "   Clipboard TEXT NOT NULL"
+    ");"
+    ""
+    "CREATE TABLE Mime_types ("
+    "   Id CHAR(40),"
+    "   Mime_type TEXT,"
+    "   Data_id CHAR(40),"
+    "   PRIMARY KEY (Id, Mime_type),"
+    "   FOREIGN KEY (Id) REFERENCES Entries(Id) ON DELETE RESTRICT,"
+    "   FOREIGN KEY (Data_id) REFERENCES Data(Data_id) ON DELETE RESTRICT"
+    ");"
+    ""
+    "CREATE TABLE Data ("
+    "   Data_id CHAR(40) PRIMARY KEY,"
+    "   Ref_count INTEGER DEFAULT 1 CHECK (Ref_count >= 0)"
+    ");"
+    ""
+    // Used for foreign key checks when deleting from Data
+    "CREATE INDEX Mime_types_data_id ON Mime_types (Data_id);"
+    // Lets orphaned data rows be found without scanning the whole table
+    "CREATE INDEX Data_unreferenced ON Data (Data_id) WHERE Ref_count <= 0;"
+    ""
+    "CREATE TABLE Version ("
+    "   Db_version INTEGER UNIQUE NOT NULL"
+    ");"
+    "INSERT INTO Version (Db_version) VALUES (0);";
+
+/*
+ * Returns TRUE if the database has already been created.
+ */
+static gboolean
+clippor_database_has_version(ClipporDatabase *self)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+
+    sqlite3_stmt *stmt;
+    int ret = sqlite3_prepare_v2(
+        self->handle,
+        "SELECT 1 FROM sqlite_master "
+        "WHERE type = 'table' AND name = 'Version';",
+        -1, &stmt, NULL
+    );
+
+    if (ret != SQLITE_OK)
+        return FALSE;
+
+    ret = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+
+    return ret == SQLITE_ROW;
+}
+
+/*
+ * SQL function that converts a data id into the digest it is stored as. Data
+ * ids made from a checksum are lowercase hex strings, which are stored as a
+ * blob of half the size. Any other data id is stored as is. Digests are never
+ * truncated, since a data id must be recoverable from its digest, and is also
+ * the name of the file its data may be in. They are 8 bytes with XXH64
+ * checksums and 20 bytes with SHA-1 checksums.
+ */
+static void
+sql_to_digest(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+    g_assert(argc == 1);
+
+    const char *data_id = (const char *)sqlite3_value_text(argv[0]);
+    int len = sqlite3_value_bytes(argv[0]);
+
+    if (data_id == NULL)
+    {
+        sqlite3_result_null(ctx);
+        return;
+    }
+
+    if (len > 0 && len % 2 == 0)
+    {
+        uint8_t *digest = sqlite3_malloc(len / 2);
+
+        if (digest == NULL)
+        {
+            sqlite3_result_error_nomem(ctx);
+            return;
+        }
+
+        int i = 0;
+
+        for (; i < len; i += 2)
+        {
+            // Uppercase would not be the same data id once converted back
+            if (!g_ascii_isxdigit(data_id[i]) || g_ascii_isupper(data_id[i]) ||
+                !g_ascii_isxdigit(data_id[i + 1]) ||
+                g_ascii_isupper(data_id[i + 1]))
+                break;
+
+            digest[i / 2] = g_ascii_xdigit_value(data_id[i]) << 4 |
+                            g_ascii_xdigit_value(data_id[i + 1]);
+        }
+
+        if (i == len)
+        {
+            sqlite3_result_blob(ctx, digest, len / 2, sqlite3_free);
+            return;
+        }
+        sqlite3_free(digest);
+    }
+
+    sqlite3_result_text(ctx, data_id, len, SQLITE_TRANSIENT);
+}
+
+/*
+ * SQL function that converts a digest back into its data id.
+ */
+static void
+sql_to_data_id(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+    g_assert(argc == 1);
+
+    if (sqlite3_value_type(argv[0]) != SQLITE_BLOB)
+    {
+        sqlite3_result_value(ctx, argv[0]);
+        return;
+    }
+
+    static const char hex[] = "0123456789abcdef";
+    const uint8_t *digest = sqlite3_value_blob(argv[0]);
+    int len = sqlite3_value_bytes(argv[0]);
+    char *data_id = sqlite3_malloc(len * 2 + 1);
+
+    if (data_id == NULL)
+    {
+        sqlite3_result_error_nomem(ctx);
+        return;
+    }
+
+    for (int i = 0; i < len; i++)
+    {
+        data_id[i * 2] = hex[digest[i] >> 4];
+        data_id[i * 2 + 1] = hex[digest[i] & 0xf];
+    }
+    data_id[len * 2] = 0;
+
+    sqlite3_result_text(ctx, data_id, len * 2, sqlite3_free);
 }
 
+/*
+ * SQL function that makes the preview of an entry from its text, the same way
+ * clippor_entry_get_preview() does.
+ */
 static void
-clippor_database_init(ClipporDatabase *self G_GNUC_UNUSED)
+sql_make_preview(sqlite3_context *ctx, int argc, sqlite3_value **argv)
 {
+    g_assert(argc == 1);
+
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL)
+    {
+        sqlite3_result_null(ctx);
+        return;
+    }
+
+    const void *text = sqlite3_value_blob(argv[0]);
+    g_autoptr(GBytes) bytes =
+        g_bytes_new_static(text, sqlite3_value_bytes(argv[0]));
+
+    sqlite3_result_text(ctx, clippor_entry_make_preview(bytes), -1, g_free);
 }
 
+/*
+ * Open the database in "data_directory", or in the clippor directory in the
+ * user data directory if it is NULL. In-memory databases only use it to spill
+ * data over their memory budget to, and default to the user cache directory.
+ */
 ClipporDatabase *
 clippor_database_new(
     const char *data_directory, ClipporDatabaseFlags flags, GError **error
@@ -116,35 +638,39 @@ clippor_database_new(
 
     const char *statement =
         "PRAGMA foreign_keys = ON;"
+        // Only has an effect when the database is created. Lets free pages be
+        // given back with "PRAGMA incremental_vacuum".
+        "PRAGMA auto_vacuum = INCREMENTAL;"
         "PRAGMA journal_mode = WAL;"
         "PRAGMA synchronous = NORMAL;"
-        "CREATE TABLE IF NOT EXISTS Entries ("
-        "   Position INTEGER PRIMARY KEY AUTOINCREMENT,"
-        "   Id CHAR(40) NOT NULL UNIQUE,"
-        "   Creation_time INTEGER NOT NULL CHECK (Creation_time > 0),"
-        "   Last_used_time INTEGER NOT NULL CHECK (Last_used_time > 0),"
-        "   Flags INTEGER NOT NULL CHECK (Flags >= 0),"
-        "   Clipboard TEXT NOT NULL"
-        ");"
-        ""
-        "CREATE TABLE IF NOT EXISTS Mime_types ("
-        "   Id CHAR(40),"
-        "   Mime_type TEXT,"
-        "   Data_id CHAR(40),"
-        "   PRIMARY KEY (Id, Mime_type),"
-        "   FOREIGN KEY (Id) REFERENCES Entries(Id) ON DELETE RESTRICT,"
-        "   FOREIGN KEY (Data_id) REFERENCES Data(Data_id) ON DELETE RESTRICT"
-        ");"
-        ""
-        "CREATE TABLE IF NOT EXISTS Data ("
-        "   Data_id CHAR(40) PRIMARY KEY,"
-        "   Ref_count INTEGER DEFAULT 1 CHECK (Ref_count >= 0)"
-        ");"
+        // Truncate the WAL file after a checkpoint if it grew larger than this
+        "PRAGMA journal_size_limit = 4194304;"
+        // Keep "PRAGMA optimize" from taking too long on large tables
+        "PRAGMA analysis_limit = 400;"
         ""
-        "CREATE TABLE IF NOT EXISTS Version ("
-        "   Db_version INTEGER UNIQUE NOT NULL"
-        ");"
-        "INSERT OR IGNORE INTO Version (Db_version) VALUES (0)";
+        // Entries being removed by clippor_database_trim_entries()
+        "CREATE TEMP TABLE IF NOT EXISTS Trimmed ("
+        "   Position INTEGER PRIMARY KEY,"
+        "   Id CHAR(40) NOT NULL"
+        ");";
+
+    // Used to convert between data ids and the digests they are stored as
+    ret = sqlite3_create_function_v2(
+        db->handle, "to_digest", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+        sql_to_digest, NULL, NULL, NULL
+    );
+
+    if (ret == SQLITE_OK)
+        ret = sqlite3_create_function_v2(
+            db->handle, "to_data_id", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+            NULL, sql_to_data_id, NULL, NULL, NULL
+        );
+    // Used by migrations to make previews of existing entries
+    if (ret == SQLITE_OK)
+        ret = sqlite3_create_function_v2(
+            db->handle, "make_preview", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+            NULL, sql_make_preview, NULL, NULL, NULL
+        );
 
     if (ret != SQLITE_OK)
     {
@@ -160,6 +686,9 @@ clippor_database_new(
     char *err_msg;
     ret = sqlite3_exec(db->handle, statement, NULL, NULL, &err_msg);
 
+    if (ret == SQLITE_OK && !clippor_database_has_version(db))
+        ret = sqlite3_exec(db->handle, initial_schema, NULL, NULL, &err_msg);
+
     if (ret != SQLITE_OK)
     {
         g_set_error(
@@ -171,796 +700,4801 @@ clippor_database_new(
         return NULL;
     }
 
+    // Tables above are always created using the first version of the schema,
+    // then they are migrated to the latest one.
+    if (!clippor_database_migrate(db, error))
+    {
+        g_object_unref(db);
+        return NULL;
+    }
+
     if (flags & CLIPPOR_DATABASE_IN_MEMORY)
-        db->store = g_hash_table_new_full(
-            g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_bytes_unref
-        );
+        db->store = clippor_memory_store_new(db->memory_budget, data_directory);
+    else
+    {
+        g_autofree char *data_dir_path =
+            g_strdup_printf("%s/data", db->location_dir);
+        g_autofree char *packs_dir_path =
+            g_strdup_printf("%s/packs", db->location_dir);
+
+        db->blob_writer = clippor_blob_writer_new(data_dir_path);
+
+        // Segments are still read if packing is turned off again later
+        if ((flags & CLIPPOR_DATABASE_PACKED) ||
+            g_file_test(packs_dir_path, G_FILE_TEST_IS_DIR))
+        {
+            db->pack =
+                clippor_pack_new(packs_dir_path, db->segment_size, error);
+
+            if (db->pack == NULL)
+            {
+                g_prefix_error(error, "Failed opening segments: ");
+                g_object_unref(db);
+                return NULL;
+            }
+        }
+    }
+
+    db->writer = g_thread_new(
+        "clippor-db-writer", (GThreadFunc)clippor_database_writer_func, db
+    );
 
     return db;
 }
 
-#define EXEC_ERROR(r)                                                          \
-    do                                                                         \
-    {                                                                          \
-        g_set_error(                                                           \
-            error, CLIPPOR_DATABASE_ERROR, CLIPPOR_DATABASE_ERROR_EXEC,        \
-            "Failed execing statement '%s': %s", statement, err_msg            \
-        );                                                                     \
-        sqlite3_free(err_msg);                                                 \
-        return r;                                                              \
-    } while (FALSE)
-#define PREPARE_ERROR(r)                                                       \
-    do                                                                         \
-    {                                                                          \
-        g_set_error(                                                           \
-            error, CLIPPOR_DATABASE_ERROR, CLIPPOR_DATABASE_ERROR_PREPARE,     \
-            "Failed preparing statement '%s': %s", statement,                  \
-            sqlite3_errmsg(self->handle)                                       \
-        );                                                                     \
-        return r;                                                              \
-    } while (FALSE)
-#define STEP_ERROR(r)                                                          \
-    do                                                                         \
-    {                                                                          \
-        g_set_error(                                                           \
-            error, CLIPPOR_DATABASE_ERROR, CLIPPOR_DATABASE_ERROR_STEP,        \
-            "Failed stepping statement '%s': %s", statement,                   \
-            sqlite3_errmsg(self->handle)                                       \
-        );                                                                     \
-        sqlite3_finalize(stmt);                                                \
-        return r;                                                              \
-    } while (FALSE)
-#define EXEC(r)                                                                \
-    do                                                                         \
-    {                                                                          \
-        ret = sqlite3_exec(self->handle, statement, NULL, NULL, &err_msg);     \
-        if (ret != SQLITE_OK)                                                  \
-            EXEC_ERROR(r);                                                     \
-    } while (FALSE)
-#define PREPARE(r)                                                             \
-    do                                                                         \
-    {                                                                          \
-        ret = sqlite3_prepare_v2(self->handle, statement, -1, &stmt, 0);       \
-        if (ret != SQLITE_OK)                                                  \
-            PREPARE_ERROR(r);                                                  \
-    } while (FALSE)
-#define STEP_NO_ROW(r)                                                         \
-    do                                                                         \
-    {                                                                          \
-        ret = sqlite3_step(stmt);                                              \
-        if (ret != SQLITE_DONE)                                                \
-            STEP_ERROR(r);                                                     \
-        sqlite3_finalize(stmt);                                                \
-    } while (FALSE)
-
 /*
- * Returns 0 if entry exists in the database, 1 if it doesn't, and -1 on error.
+ * Return the cached prepared statement for "statement", preparing it if this is
+ * the first time it is used. The returned statement is owned by the database
+ * and must be reset with RESET() when the caller is done with it.
  */
-int
-clippor_database_entry_exists(
-    ClipporDatabase *self, ClipporEntry *entry, GError **error
+static sqlite3_stmt *
+clippor_database_get_statement(
+    ClipporDatabase *self, const char *statement, GError **error
 )
 {
     g_assert(CLIPPOR_IS_DATABASE(self));
-    g_assert(CLIPPOR_IS_ENTRY(entry));
+    g_assert(statement != NULL);
     g_assert(error == NULL || *error == NULL);
 
-    const char *statement = "SELECT Id FROM Entries WHERE Id = ?";
-    sqlite3_stmt *stmt;
-    int ret;
+    sqlite3_stmt *stmt = g_hash_table_lookup(self->statements, statement);
 
-    PREPARE(-1);
+    if (stmt != NULL)
+    {
+        self->stats.statement_cache_hits++;
+        return stmt;
+    }
 
-    ret = sqlite3_step(stmt);
+    int ret = sqlite3_prepare_v3(
+        self->handle, statement, -1, SQLITE_PREPARE_PERSISTENT, &stmt, NULL
+    );
 
-    if (ret == SQLITE_ROW)
-        ret = 0;
-    else if (ret == SQLITE_DONE)
-        ret = 1;
-    else
-        STEP_ERROR(-1);
+    if (ret != SQLITE_OK)
+    {
+        g_set_error(
+            error, CLIPPOR_DATABASE_ERROR, CLIPPOR_DATABASE_ERROR_PREPARE,
+            "Failed preparing statement '%s': %s", statement,
+            sqlite3_errmsg(self->handle)
+        );
+        return NULL;
+    }
 
-    sqlite3_finalize(stmt);
-    return ret;
+    self->stats.statements_prepared++;
+    g_hash_table_insert(self->statements, (char *)statement, stmt);
+
+    return stmt;
 }
 
-static char *
-clippor_database_ref_data(ClipporDatabase *self, GBytes *bytes, GError **error)
+#define READER_POOL_SIZE 4
+// How long a reader waits if the database is locked, which only happens
+// while the WAL file is being recovered or reset.
+#define READER_BUSY_TIMEOUT 1000
+
+static void
+database_reader_free(DatabaseReader *reader)
+{
+    // Statements must be finalized before the handle is closed
+    g_clear_pointer(&reader->statements, g_hash_table_unref);
+    sqlite3_close(reader->handle);
+    g_free(reader);
+}
+
+/*
+ * Open a new read-only connection to the database.
+ */
+static DatabaseReader *
+database_reader_new(ClipporDatabase *self, GError **error)
 {
     g_assert(CLIPPOR_IS_DATABASE(self));
-    g_assert(bytes != NULL);
     g_assert(error == NULL || *error == NULL);
 
-    // Add new row, or if one already exists, increment the reference count
-    const char *statement =
-        "INSERT INTO Data (Data_id) "
-        "VALUES (?) ON CONFLICT DO UPDATE SET Ref_count = Ref_count + 1;;";
-    sqlite3_stmt *stmt;
-    int ret;
+    DatabaseReader *reader = g_new0(DatabaseReader, 1);
 
-    PREPARE(NULL);
+    reader->statements = g_hash_table_new_full(
+        g_str_hash, g_str_equal, NULL, (GDestroyNotify)sqlite3_finalize
+    );
 
-    char *data_id = g_compute_checksum_for_bytes(G_CHECKSUM_SHA1, bytes);
+    // Each reader is only used by a single thread at a time
+    int ret = sqlite3_open_v2(
+        self->location, &reader->handle,
+        SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL
+    );
 
-    sqlite3_bind_text(stmt, 1, data_id, -1, SQLITE_STATIC);
+    if (ret == SQLITE_OK)
+        ret = sqlite3_create_function_v2(
+            reader->handle, "to_digest", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+            NULL, sql_to_digest, NULL, NULL, NULL
+        );
+    if (ret == SQLITE_OK)
+        ret = sqlite3_create_function_v2(
+            reader->handle, "to_data_id", 1,
+            SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL, sql_to_data_id, NULL,
+            NULL, NULL
+        );
+    if (ret == SQLITE_OK)
+        ret = sqlite3_busy_timeout(reader->handle, READER_BUSY_TIMEOUT);
 
-    ret = sqlite3_step(stmt);
-
-    if (ret != SQLITE_DONE)
-    {
-        g_free(data_id);
-        STEP_ERROR(NULL);
-    }
-    sqlite3_finalize(stmt);
-
-    if (self->flags & CLIPPOR_DATABASE_IN_MEMORY)
-        g_hash_table_insert(self->store, g_strdup(data_id), g_bytes_ref(bytes));
-    else
+    if (ret != SQLITE_OK)
     {
-        size_t sz;
-        const char *stuff = g_bytes_get_data(bytes, &sz);
-        g_autofree char *path =
-            g_strdup_printf("%s/data/%s", self->location_dir, data_id);
-
-        // If file already exists, ignore
-        if (!g_file_test(path, G_FILE_TEST_EXISTS) &&
-            !g_file_set_contents_full(
-                path, stuff, sz, G_FILE_SET_CONTENTS_CONSISTENT, 0644, error
-            ))
-        {
-            g_prefix_error(error, "Failed creating data file '%s': ", data_id);
-            g_free(data_id);
-            return NULL;
-        }
+        g_set_error(
+            error, CLIPPOR_DATABASE_ERROR, CLIPPOR_DATABASE_ERROR_OPEN,
+            "Failed opening reader for database at '%s': %s", self->location,
+            sqlite3_errmsg(reader->handle)
+        );
+        database_reader_free(reader);
+        return NULL;
     }
 
-    return data_id;
+    return reader;
 }
 
 /*
- * Unreferences data id by one, if it reaches zero, then it removes the row and
- * the associated data file from the filesystem.
+ * Take an idle reader from the pool. A new one is opened if there are less
+ * than READER_POOL_SIZE, otherwise this waits until one is released. "reader"
+ * is set to NULL for in-memory databases, which are read through the
+ * connection of the writer instead.
  */
 static gboolean
-clippor_database_unref_data(
-    ClipporDatabase *self, const char *data_id, GError **error
+clippor_database_acquire_reader(
+    ClipporDatabase *self, DatabaseReader **reader, GError **error
 )
 {
     g_assert(CLIPPOR_IS_DATABASE(self));
-    g_assert(data_id != NULL);
+    g_assert(reader != NULL);
     g_assert(error == NULL || *error == NULL);
 
-    const char *statement = "UPDATE Data "
-                            "SET Ref_count = Ref_count - 1 "
-                            "WHERE Data_id = ? RETURNING Ref_count;";
-    sqlite3_stmt *stmt;
-    int ret;
-
-    PREPARE(FALSE);
+    *reader = NULL;
 
-    sqlite3_bind_text(stmt, 1, data_id, -1, SQLITE_STATIC);
-
-    ret = sqlite3_step(stmt);
+    if (self->flags & CLIPPOR_DATABASE_IN_MEMORY)
+        return TRUE;
 
-    if (ret == SQLITE_ROW)
+    // Readers would see the old schema until every row has been moved. The
+    // flag is checked first so that readers don't wait for the lock otherwise.
+    if (g_atomic_int_get(&self->compacting) || self->compact_error != NULL)
     {
-        int ref_count = sqlite3_column_int(stmt, 0);
-
-        sqlite3_finalize(stmt);
-
-        if (ref_count <= 0)
-        {
-            // Delete row and remove data file
-            if (self->flags & CLIPPOR_DATABASE_IN_MEMORY)
-                g_hash_table_remove(self->store, data_id);
-            else
-            {
-                g_autofree char *path =
-                    g_strdup_printf("%s/data/%s", self->location_dir, data_id);
+        g_mutex_lock(&self->lock);
+        gboolean compacted = clippor_database_wait_compacted(self, error);
+        g_mutex_unlock(&self->lock);
 
-                g_unlink(path);
-            }
+        if (!compacted)
+            return FALSE;
+    }
 
-            statement = "DELETE FROM Data WHERE Data_id = ?;";
+    *reader = g_async_queue_try_pop(self->readers);
 
-            PREPARE(FALSE);
+    if (*reader != NULL)
+        return TRUE;
 
-            sqlite3_bind_text(stmt, 1, data_id, -1, SQLITE_STATIC);
+    if (g_atomic_int_add(&self->n_readers, 1) >= READER_POOL_SIZE)
+    {
+        g_atomic_int_add(&self->n_readers, -1);
+        *reader = g_async_queue_pop(self->readers);
+        return TRUE;
+    }
 
-            STEP_NO_ROW(FALSE);
-        }
+    *reader = database_reader_new(self, error);
 
-        return TRUE;
+    if (*reader == NULL)
+    {
+        g_atomic_int_add(&self->n_readers, -1);
+        return FALSE;
     }
-    else if (ret != SQLITE_DONE)
-        STEP_ERROR(FALSE);
 
-    sqlite3_finalize(stmt);
+    g_mutex_lock(&self->lock);
+    self->stats.readers_opened++;
+    g_mutex_unlock(&self->lock);
+
     return TRUE;
 }
 
 /*
- * Removes mime type rows in the database with id that doesn't exist in the hash
- * table. If "all" is TRUE then just removes all of them and ignores
- * "mime_types".
+ * Put "reader" back into the pool. Does nothing if it is NULL.
  */
-static gboolean
-clippor_database_cleanup_mime_types(
-    ClipporDatabase *self, const char *id, GHashTable *mime_types, gboolean all,
+static void
+clippor_database_release_reader(ClipporDatabase *self, DatabaseReader *reader)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+
+    if (reader != NULL)
+        g_async_queue_push(self->readers, reader);
+}
+
+/*
+ * Same as clippor_database_get_statement(), but for "reader". If "reader" is
+ * NULL then the statement is prepared for the writer's connection, which
+ * requires the lock to be held.
+ */
+static sqlite3_stmt *
+clippor_database_get_read_statement(
+    ClipporDatabase *self, DatabaseReader *reader, const char *statement,
     GError **error
 )
 {
     g_assert(CLIPPOR_IS_DATABASE(self));
-    g_assert(id != NULL);
-    g_assert(all || mime_types != NULL);
+    g_assert(statement != NULL);
     g_assert(error == NULL || *error == NULL);
 
-    const char *statement =
-        "SELECT Mime_type,Data_id FROM Mime_types WHERE Id = ?;";
-    const char *statement2 =
-        "DELETE FROM Mime_types WHERE Id = ? AND Mime_type = ?;";
-    sqlite3_stmt *stmt, *stmt2;
-    ;
-    int ret;
+    if (reader == NULL)
+        return clippor_database_get_statement(self, statement, error);
 
-    PREPARE(FALSE);
+    sqlite3_stmt *stmt = g_hash_table_lookup(reader->statements, statement);
 
-    ret = sqlite3_prepare_v2(self->handle, statement2, -1, &stmt2, NULL);
+    if (stmt != NULL)
+        return stmt;
+
+    int ret = sqlite3_prepare_v3(
+        reader->handle, statement, -1, SQLITE_PREPARE_PERSISTENT, &stmt, NULL
+    );
 
     if (ret != SQLITE_OK)
     {
-        sqlite3_finalize(stmt);
-        PREPARE_ERROR(FALSE);
+        g_set_error(
+            error, CLIPPOR_DATABASE_ERROR, CLIPPOR_DATABASE_ERROR_PREPARE,
+            "Failed preparing statement '%s': %s", statement,
+            sqlite3_errmsg(reader->handle)
+        );
+        return NULL;
     }
 
-    sqlite3_bind_text(stmt, 1, id, -1, SQLITE_STATIC);
+    g_hash_table_insert(reader->statements, (char *)statement, stmt);
 
-    while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
-    {
-        const char *mime_type = (const char *)sqlite3_column_text(stmt, 0);
-        const char *data_id = (const char *)sqlite3_column_text(stmt, 1);
+    return stmt;
+}
 
-        if (all || !g_hash_table_contains(mime_types, mime_type))
-        {
-            // Delete mime type row first to avoid foriegn key restriction
-            sqlite3_bind_text(stmt2, 1, id, -1, SQLITE_STATIC);
-            sqlite3_bind_text(stmt2, 2, mime_type, -1, SQLITE_STATIC);
+/*
+ * Returns a rough estimate of how much memory "entry" uses, counting the data
+ * that is kept in memory.
+ */
+static uint64_t
+entry_estimate_size(ClipporEntry *entry)
+{
+    GHashTable *mime_types = clippor_entry_get_mime_types(entry);
+    GHashTableIter iter;
+    const char *mime_type;
+    uint64_t size = 256;
 
-            ret = sqlite3_step(stmt2);
+    g_hash_table_iter_init(&iter, mime_types);
 
-            sqlite3_clear_bindings(stmt2);
-            sqlite3_reset(stmt2);
+    while (g_hash_table_iter_next(&iter, (void **)&mime_type, NULL))
+    {
+        g_autoptr(GBytes) bytes = clippor_entry_peek_data(entry, mime_type);
 
-            if (!clippor_database_unref_data(self, data_id, error))
-            {
-                sqlite3_finalize(stmt);
-                sqlite3_finalize(stmt2);
+        size += strlen(mime_type) + 64;
 
-                g_prefix_error(
-                    error, "Failed cleaning up id '%s' in database: ", id
-                );
-                return FALSE;
-            }
-        }
+        // Mime types with the same data may be counted more than once, which
+        // is fine for an estimate.
+        if (bytes != NULL)
+            size += g_bytes_get_size(bytes);
     }
 
-    sqlite3_finalize(stmt2);
+    return size;
+}
 
-    if (ret != SQLITE_DONE)
-        STEP_ERROR(FALSE);
+static void
+clippor_database_cache_remove(ClipporDatabase *self, const char *id)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(id != NULL);
 
-    // STEP_ERROR finalizes stmt
-    sqlite3_finalize(stmt);
+    CachedEntry *cached = g_hash_table_lookup(self->entry_cache, id);
 
-    return TRUE;
+    if (cached == NULL)
+        return;
+
+    g_queue_unlink(&self->entry_lru, &cached->link);
+    self->stats.entry_cache_used -= cached->size;
+    g_hash_table_remove(self->entry_cache, id);
 }
 
 /*
- * Given a hash table of mime types and the associated data, for each mime type,
- * create a new row with id in the Mime_types table, and for every piece of
- * data, create a new row in the Data table, or increase the reference count if
- * it already exists,
- *
- * If mime type already exists in the table, update it, or if
- * it exists in the database but not in the hash table, remove it.
+ * Remove the entry with "id" from the cache because a write changed it.
  */
-static gboolean
-clippor_database_serialize_mime_types(
-    ClipporDatabase *self, const char *id, GHashTable *mime_types,
-    GError **error
-)
+static void
+clippor_database_cache_invalidate(ClipporDatabase *self, const char *id)
 {
     g_assert(CLIPPOR_IS_DATABASE(self));
     g_assert(id != NULL);
-    g_assert(mime_types != NULL);
-    g_assert(error == NULL || *error == NULL);
 
-    g_autofree char *data_dir_path =
-        g_strdup_printf("%s/data", self->location_dir);
+    self->entry_cache_generation++;
+    clippor_database_cache_remove(self, id);
+}
 
-    if (!(self->flags & CLIPPOR_DATABASE_IN_MEMORY) &&
-        g_mkdir_with_parents(data_dir_path, 0755) == -1)
+/*
+ * Remove the least recently used entries until the cache is within its size.
+ */
+static void
+clippor_database_cache_trim(ClipporDatabase *self)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+
+    while (self->stats.entry_cache_used > self->entry_cache_size &&
+           self->entry_lru.tail != NULL)
     {
-        g_set_error(
-            error, CLIPPOR_DATABASE_ERROR, CLIPPOR_DATABASE_ERROR_DATA_DIR,
-            "Failed creating directory '%s'", data_dir_path
+        CachedEntry *cached = self->entry_lru.tail->data;
+
+        clippor_database_cache_remove(
+            self, clippor_entry_get_id(cached->entry)
         );
-        return FALSE;
     }
+}
 
-    // Remove deleted mime types first
-    if (!clippor_database_cleanup_mime_types(
-            self, id, mime_types, FALSE, error
-        ))
-    {
-        g_prefix_error(error, "Failed serializing mime types: ");
-        return FALSE;
-    }
+/*
+ * Add a copy of "entry" to the entry cache, replacing the existing one with the
+ * same id. The data ids of every mime type of "entry" must be known.
+ */
+static void
+clippor_database_cache_insert(ClipporDatabase *self, ClipporEntry *entry)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(CLIPPOR_IS_ENTRY(entry));
 
-    const char *statement =
-        "INSERT INTO Mime_Types (Id, Mime_type, Data_id) "
-        "VALUES (?, ?, ?) ON CONFLICT DO UPDATE SET Data_id = ?;";
-    sqlite3_stmt *stmt;
-    int ret;
+    clippor_database_cache_remove(self, clippor_entry_get_id(entry));
 
-    PREPARE(FALSE);
+    uint64_t size = entry_estimate_size(entry);
 
-    GHashTableIter iter;
-    const char *mime_type;
-    GBytes *bytes;
+    // Don't throw out everything else for an entry that won't fit anyway
+    if (size > self->entry_cache_size)
+        return;
 
-    g_hash_table_iter_init(&iter, mime_types);
+    CachedEntry *cached = g_new(CachedEntry, 1);
 
-    while (g_hash_table_iter_next(&iter, (void **)&mime_type, (void **)&bytes))
-    {
-        g_autofree char *data_id =
-            clippor_database_ref_data(self, bytes, error);
+    cached->entry = clippor_entry_copy(entry);
+    cached->size = size;
+    cached->link.data = cached;
 
-        if (data_id == NULL)
-        {
-            g_prefix_error(
-                error, "Failed serializing entry with id '%s': ", id
-            );
-            sqlite3_finalize(stmt);
-            return FALSE;
-        }
+    g_hash_table_insert(
+        self->entry_cache, (char *)clippor_entry_get_id(cached->entry), cached
+    );
+    g_queue_push_head_link(&self->entry_lru, &cached->link);
+    self->stats.entry_cache_used += size;
 
-        sqlite3_bind_text(stmt, 1, id, -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 2, mime_type, -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 3, data_id, -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 4, data_id, -1, SQLITE_STATIC);
+    clippor_database_cache_trim(self);
+}
 
-        ret = sqlite3_step(stmt);
+/*
+ * Returns a new entry copied from the cached entry with "id", or NULL if it is
+ * not cached.
+ */
+static ClipporEntry *
+clippor_database_cache_lookup(ClipporDatabase *self, const char *id)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(id != NULL);
 
-        if (ret != SQLITE_DONE)
-            STEP_ERROR(FALSE);
+    CachedEntry *cached = g_hash_table_lookup(self->entry_cache, id);
 
-        sqlite3_reset(stmt);
-        sqlite3_clear_bindings(stmt);
+    if (cached == NULL)
+    {
+        self->stats.entry_cache_misses++;
+        return NULL;
     }
 
-    sqlite3_finalize(stmt);
+    self->stats.entry_cache_hits++;
 
-    return TRUE;
+    g_queue_unlink(&self->entry_lru, &cached->link);
+    g_queue_push_head_link(&self->entry_lru, &cached->link);
+
+    ClipporEntry *entry = clippor_entry_copy(cached->entry);
+
+    clippor_entry_set_database(entry, self);
+
+    return entry;
 }
 
+#define RESET(s)                                                               \
+    do                                                                         \
+    {                                                                          \
+        sqlite3_reset(s);                                                      \
+        sqlite3_clear_bindings(s);                                             \
+    } while (FALSE)
+#define EXEC_ERROR(r)                                                          \
+    do                                                                         \
+    {                                                                          \
+        g_set_error(                                                           \
+            error, CLIPPOR_DATABASE_ERROR, CLIPPOR_DATABASE_ERROR_EXEC,        \
+            "Failed execing statement '%s': %s", statement,                    \
+            sqlite3_errmsg(self->handle)                                       \
+        );                                                                     \
+        return r;                                                              \
+    } while (FALSE)
+#define STEP_ERROR(r)                                                          \
+    do                                                                         \
+    {                                                                          \
+        g_set_error(                                                           \
+            error, CLIPPOR_DATABASE_ERROR, CLIPPOR_DATABASE_ERROR_STEP,        \
+            "Failed stepping statement '%s': %s", statement,                   \
+            sqlite3_errmsg(sqlite3_db_handle(stmt))                            \
+        );                                                                     \
+        RESET(stmt);                                                           \
+        return r;                                                              \
+    } while (FALSE)
+#define EXEC(r)                                                                \
+    do                                                                         \
+    {                                                                          \
+        sqlite3_stmt *e_stmt =                                                 \
+            clippor_database_get_statement(self, statement, error);            \
+        if (e_stmt == NULL)                                                    \
+            return r;                                                          \
+        ret = sqlite3_step(e_stmt);                                            \
+        sqlite3_reset(e_stmt);                                                 \
+        if (ret != SQLITE_DONE)                                                \
+            EXEC_ERROR(r);                                                     \
+    } while (FALSE)
+#define PREPARE(r)                                                             \
+    do                                                                         \
+    {                                                                          \
+        stmt = clippor_database_get_statement(self, statement, error);         \
+        if (stmt == NULL)                                                      \
+            return r;                                                          \
+    } while (FALSE)
+#define READ_PREPARE(r)                                                        \
+    do                                                                         \
+    {                                                                          \
+        stmt = clippor_database_get_read_statement(                            \
+            self, reader, statement, error                                     \
+        );                                                                     \
+        if (stmt == NULL)                                                      \
+            return r;                                                          \
+    } while (FALSE)
+// Readers don't hold the lock, unlike the writer's connection
+#define READ_LOCK()                                                            \
+    do                                                                         \
+    {                                                                          \
+        if (reader != NULL)                                                    \
+            g_mutex_lock(&self->lock);                                         \
+    } while (FALSE)
+#define READ_UNLOCK()                                                          \
+    do                                                                         \
+    {                                                                          \
+        if (reader != NULL)                                                    \
+            g_mutex_unlock(&self->lock);                                       \
+    } while (FALSE)
+#define STEP_NO_ROW(r)                                                         \
+    do                                                                         \
+    {                                                                          \
+        ret = sqlite3_step(stmt);                                              \
+        if (ret != SQLITE_DONE)                                                \
+            STEP_ERROR(r);                                                     \
+        RESET(stmt);                                                           \
+    } while (FALSE)
+
+// Each statement upgrades the database schema from the version at its index to
+// the next one.
+static const char *migrations[] = {
+    // Version 1: Record which checksum was used to create each data id
+    "ALTER TABLE Data ADD COLUMN Checksum INTEGER NOT NULL DEFAULT 0;",
+    // Version 2: Store small data inside the database. If NULL, then the data
+    // is stored in a file.
+    "ALTER TABLE Data ADD COLUMN Contents BLOB;",
+    // Version 3: Store size of data so it doesn't need to be loaded to know it.
+    // If NULL, then the size of the file is used.
+    "ALTER TABLE Data ADD COLUMN Size INTEGER;"
+    "UPDATE Data SET Size = length(Contents) WHERE Contents IS NOT NULL;",
+    // Version 4: Used to page through the history of a clipboard
+    "CREATE INDEX Entries_clipboard_position ON Entries (Clipboard, Position);",
+    // Version 5: Full text search over the text of entries. The rowid of each
+    // row is the position of the entry. Existing entries are indexed using
+    // their text if it is stored inside the database.
+    "CREATE VIRTUAL TABLE Search USING fts5 (Text);"
+    "INSERT INTO Search (rowid, Text) "
+    "SELECT Position, CAST(Contents AS TEXT) FROM Entries "
+    "JOIN Mime_types USING (Id) JOIN Data USING (Data_id) "
+    "WHERE Contents IS NOT NULL AND (Mime_type = 'UTF8_STRING' OR "
+    "Mime_type LIKE 'text/plain%') "
+    "GROUP BY Position;",
+    // Version 6: Checksum over the mime types and data of each entry, used to
+    // find an existing entry when the same contents are copied again. Existing
+    // entries are left without one.
+    "ALTER TABLE Entries ADD COLUMN Fingerprint CHAR(40);"
+    "CREATE INDEX Entries_fingerprint ON Entries (Clipboard, Fingerprint) "
+    "WHERE Fingerprint IS NOT NULL;",
+    // Version 7: Compact schema. Mime types refer to entries by position and to
+    // data by an integer id, mime type names are only stored once, and data
+    // ids are stored as binary digests. Existing rows are moved over by
+    // clippor_database_compact() before the next version is applied.
+    "CREATE TABLE Mime_type_names ("
+    "   Mime_type_id INTEGER PRIMARY KEY,"
+    "   Name TEXT NOT NULL UNIQUE"
+    ");"
+    "CREATE TABLE Blobs ("
+    "   Blob_id INTEGER PRIMARY KEY,"
+    "   Digest BLOB NOT NULL UNIQUE,"
+    "   Ref_count INTEGER NOT NULL DEFAULT 1 CHECK (Ref_count >= 0),"
+    "   Checksum INTEGER NOT NULL DEFAULT 0,"
+    "   Contents BLOB,"
+    "   Size INTEGER"
+    ");"
+    "CREATE TABLE Entry_mime_types ("
+    "   Position INTEGER NOT NULL,"
+    "   Mime_type_id INTEGER NOT NULL,"
+    "   Blob_id INTEGER NOT NULL,"
+    "   PRIMARY KEY (Position, Mime_type_id),"
+    "   FOREIGN KEY (Position) REFERENCES Entries (Position) "
+    "   ON DELETE RESTRICT,"
+    "   FOREIGN KEY (Mime_type_id) REFERENCES Mime_type_names (Mime_type_id),"
+    "   FOREIGN KEY (Blob_id) REFERENCES Blobs (Blob_id) ON DELETE RESTRICT"
+    ") WITHOUT ROWID;"
+    "CREATE INDEX Entry_mime_types_blob_id ON Entry_mime_types (Blob_id);"
+    "CREATE INDEX Blobs_unreferenced ON Blobs (Blob_id) WHERE Ref_count <= 0;",
+    // Version 8: Drop the old tables once every row has been moved. Data that
+    // no entry uses is moved as well, so garbage collection can remove it.
+    "INSERT INTO Blobs (Digest, Ref_count, Checksum, Contents, Size) "
+    "SELECT to_digest(Data_id), Ref_count, Checksum, Contents, Size FROM Data "
+    "WHERE true ON CONFLICT DO NOTHING;"
+    "DROP TABLE Mime_types;"
+    "DROP TABLE Data;",
+    // Version 9: Data appended to segment files. If Segment is not NULL, the
+    // data is at Segment_offset in that segment. The live bytes of each segment
+    // are kept up to date by the triggers, so that mostly dead segments can be
+    // found and compacted.
+    "ALTER TABLE Blobs ADD COLUMN Segment INTEGER;"
+    "ALTER TABLE Blobs ADD COLUMN Segment_offset INTEGER;"
+    "CREATE TABLE Segments ("
+    "   Segment_id INTEGER PRIMARY KEY,"
+    "   Size INTEGER NOT NULL DEFAULT 0,"
+    "   Live INTEGER NOT NULL DEFAULT 0"
+    ");"
+    "CREATE INDEX Blobs_segment ON Blobs (Segment) "
+    "WHERE Segment IS NOT NULL;"
+    "CREATE TRIGGER Blobs_segment_delete AFTER DELETE ON Blobs "
+    "WHEN old.Segment IS NOT NULL BEGIN "
+    "   UPDATE Segments SET Live = Live - old.Size "
+    "   WHERE Segment_id = old.Segment;"
+    "END;"
+    "CREATE TRIGGER Blobs_segment_update AFTER UPDATE OF Segment ON Blobs "
+    "BEGIN "
+    "   UPDATE Segments SET Live = Live - old.Size "
+    "   WHERE Segment_id = old.Segment;"
+    "   UPDATE Segments SET Live = Live + new.Size "
+    "   WHERE Segment_id = new.Segment;"
+    "END;",
+    // Version 10: Total size of the data each entry refers to, and of the
+    // entries of each clipboard, so that a clipboard can be kept under a
+    // number of bytes. The totals are kept up to date by the triggers. Data
+    // without a known size is counted as empty.
+    "ALTER TABLE Entries ADD COLUMN Size INTEGER NOT NULL DEFAULT 0;"
+    "UPDATE Entries SET Size = ("
+    "   SELECT IFNULL(SUM(Size), 0) FROM Blobs WHERE Blob_id IN ("
+    "       SELECT Blob_id FROM Entry_mime_types "
+    "       WHERE Position = Entries.Position"
+    "   )"
+    ");"
+    "CREATE TABLE Clipboard_sizes ("
+    "   Clipboard TEXT PRIMARY KEY,"
+    "   Size INTEGER NOT NULL DEFAULT 0"
+    ") WITHOUT ROWID;"
+    "INSERT INTO Clipboard_sizes (Clipboard, Size) "
+    "SELECT Clipboard, SUM(Size) FROM Entries GROUP BY Clipboard;"
+    "CREATE TRIGGER Entries_size_insert AFTER INSERT ON Entries BEGIN "
+    "   INSERT INTO Clipboard_sizes (Clipboard, Size) "
+    "   VALUES (new.Clipboard, new.Size) "
+    "   ON CONFLICT DO UPDATE SET Size = Size + excluded.Size;"
+    "END;"
+    "CREATE TRIGGER Entries_size_delete AFTER DELETE ON Entries BEGIN "
+    "   UPDATE Clipboard_sizes SET Size = Size - old.Size "
+    "   WHERE Clipboard = old.Clipboard;"
+    "END;"
+    "CREATE TRIGGER Entries_size_update AFTER UPDATE OF Size, Clipboard "
+    "ON Entries BEGIN "
+    "   UPDATE Clipboard_sizes SET Size = Size - old.Size "
+    "   WHERE Clipboard = old.Clipboard;"
+    "   INSERT INTO Clipboard_sizes (Clipboard, Size) "
+    "   VALUES (new.Clipboard, new.Size) "
+    "   ON CONFLICT DO UPDATE SET Size = Size + excluded.Size;"
+    "END;",
+    // Version 11: Used to find expired entries without a full scan. Sensitive
+    // entries expire sooner, so they get an index of their own.
+    "CREATE INDEX Entries_clipboard_last_used_time "
+    "ON Entries (Clipboard, Last_used_time);"
+    "CREATE INDEX Entries_sensitive_last_used_time "
+    "ON Entries (Clipboard, Last_used_time) WHERE Flags & 2 != 0;",
+    // Version 12: Kind of contents and a one line preview of each entry, set
+    // when it is serialized, so that history can be listed without loading any
+    // data. Existing entries get their preview from their indexed text.
+    "ALTER TABLE Entries ADD COLUMN Content INTEGER NOT NULL DEFAULT 0;"
+    "ALTER TABLE Entries ADD COLUMN Preview TEXT;"
+    "CREATE TEMP VIEW Entry_names AS "
+    "SELECT Position, Name FROM Entry_mime_types "
+    "JOIN Mime_type_names USING (Mime_type_id);"
+    "UPDATE Entries SET Content = CASE "
+    "   WHEN EXISTS (SELECT 1 FROM Entry_names "
+    "   WHERE Position = Entries.Position AND Name = 'text/uri-list') THEN 3 "
+    "   WHEN EXISTS (SELECT 1 FROM Entry_names "
+    "   WHERE Position = Entries.Position AND Name LIKE 'image/%') THEN 2 "
+    "   WHEN EXISTS (SELECT 1 FROM Entry_names "
+    "   WHERE Position = Entries.Position AND "
+    "   (Name = 'UTF8_STRING' OR Name LIKE 'text/%')) THEN 1 "
+    "   ELSE 0 END;"
+    "UPDATE Entries SET Preview = ("
+    "   SELECT make_preview(Text) FROM Search WHERE rowid = Entries.Position"
+    ");"
+    "DROP VIEW Entry_names;",
+    // Version 13: Number of entries of each clipboard, so that trimming can
+    // start from its oldest entry instead of stepping over the ones it keeps.
+    "ALTER TABLE Clipboard_sizes ADD COLUMN Count INTEGER NOT NULL DEFAULT 0;"
+    "UPDATE Clipboard_sizes SET Count = ("
+    "   SELECT COUNT(*) FROM Entries "
+    "   WHERE Clipboard = Clipboard_sizes.Clipboard"
+    ");"
+    "DROP TRIGGER Entries_size_insert;"
+    "DROP TRIGGER Entries_size_delete;"
+    "DROP TRIGGER Entries_size_update;"
+    "CREATE TRIGGER Entries_size_insert AFTER INSERT ON Entries BEGIN "
+    "   INSERT INTO Clipboard_sizes (Clipboard, Size, Count) "
+    "   VALUES (new.Clipboard, new.Size, 1) "
+    "   ON CONFLICT DO UPDATE SET "
+    "   Size = Size + excluded.Size, Count = Count + 1;"
+    "END;"
+    "CREATE TRIGGER Entries_size_delete AFTER DELETE ON Entries BEGIN "
+    "   UPDATE Clipboard_sizes SET Size = Size - old.Size, Count = Count - 1 "
+    "   WHERE Clipboard = old.Clipboard;"
+    "END;"
+    "CREATE TRIGGER Entries_size_update AFTER UPDATE OF Size, Clipboard "
+    "ON Entries BEGIN "
+    "   UPDATE Clipboard_sizes SET Size = Size - old.Size, Count = Count - 1 "
+    "   WHERE Clipboard = old.Clipboard;"
+    "   INSERT INTO Clipboard_sizes (Clipboard, Size, Count) "
+    "   VALUES (new.Clipboard, new.Size, 1) "
+    "   ON CONFLICT DO UPDATE SET "
+    "   Size = Size + excluded.Size, Count = Count + 1;"
+    "END;",
+};
+
+// Version 12 uses these values directly
+G_STATIC_ASSERT(CLIPPOR_ENTRY_CONTENT_TEXT == 1);
+G_STATIC_ASSERT(CLIPPOR_ENTRY_CONTENT_IMAGE == 2);
+G_STATIC_ASSERT(CLIPPOR_ENTRY_CONTENT_URI_LIST == 3);
+
+// Version whose tables are filled by clippor_database_compact()
+#define COMPACT_VERSION 7
+#define COMPACT_BATCH_SIZE 512
+
 /*
- * Serialize an entry into the database. If the entry already exists, it is
- * updated. The UPSERT clause is used so foreign key restrictions won't be
- * violated.
+ * Move the rows of the Mime_types and Data tables of COMPACT_BATCH_SIZE entries
+ * into the tables of the compact schema. Each batch is done in its own
+ * transaction and removes the rows it moved, so that a large history doesn't
+ * need one huge transaction, and an interrupted migration continues where it
+ * left off the next time the database is opened. Returns 1 once every row has
+ * been moved, 0 if there are more left, or -1 on error.
  */
-gboolean
-clippor_database_serialize_entry(
-    ClipporDatabase *self, ClipporEntry *entry, GError **error
-)
+static int
+clippor_database_compact_step(ClipporDatabase *self, GError **error)
 {
     g_assert(CLIPPOR_IS_DATABASE(self));
-    g_assert(CLIPPOR_IS_ENTRY(entry));
     g_assert(error == NULL || *error == NULL);
 
-    const char *statement = "BEGIN TRANSACTION;";
-    char *err_msg;
+    const char *batch =
+        "CREATE TEMP TABLE IF NOT EXISTS Compacting ("
+        "   Position INTEGER PRIMARY KEY,"
+        "   Id CHAR(40) NOT NULL"
+        ");"
+        "CREATE TEMP TABLE IF NOT EXISTS Compacting_data ("
+        "   Data_id CHAR(40) PRIMARY KEY"
+        ");"
+        "BEGIN TRANSACTION;"
+        "INSERT INTO temp.Compacting (Position, Id) "
+        "SELECT Position, Id FROM Entries WHERE Id IN ("
+        "   SELECT DISTINCT Id FROM Mime_types "
+        "   LIMIT " G_STRINGIFY(COMPACT_BATCH_SIZE) ""
+        ");"
+        "INSERT INTO temp.Compacting_data (Data_id) "
+        "SELECT DISTINCT Data_id FROM temp.Compacting "
+        "JOIN Mime_types USING (Id);"
+        "INSERT OR IGNORE INTO Mime_type_names (Name) "
+        "SELECT DISTINCT Mime_type FROM temp.Compacting "
+        "JOIN Mime_types USING (Id);"
+        "INSERT INTO Blobs (Digest, Ref_count, Checksum, Contents, Size) "
+        "SELECT to_digest(Data_id), Ref_count, Checksum, Contents, Size "
+        "FROM Data WHERE Data_id IN (SELECT Data_id FROM temp.Compacting_data) "
+        "ON CONFLICT DO NOTHING;"
+        "INSERT INTO Entry_mime_types (Position, Mime_type_id, Blob_id) "
+        "SELECT c.Position, n.Mime_type_id, b.Blob_id "
+        "FROM temp.Compacting AS c JOIN Mime_types AS m USING (Id) "
+        "JOIN Mime_type_names AS n ON n.Name = m.Mime_type "
+        "JOIN Blobs AS b ON b.Digest = to_digest(m.Data_id);"
+        "DELETE FROM Mime_types WHERE Id IN (SELECT Id FROM temp.Compacting);"
+        // Data can only be removed once no entry left to move uses it
+        "DELETE FROM Data "
+        "WHERE Data_id IN (SELECT Data_id FROM temp.Compacting_data) "
+        "AND NOT EXISTS ("
+        "   SELECT 1 FROM Mime_types AS m WHERE m.Data_id = Data.Data_id"
+        ");"
+        "DELETE FROM temp.Compacting;"
+        "DELETE FROM temp.Compacting_data;"
+        "COMMIT;";
+    const char *statement = "SELECT EXISTS (SELECT 1 FROM Mime_types);";
+    g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&self->lock);
     sqlite3_stmt *stmt;
+    char *err_msg;
     int ret;
 
-    EXEC(FALSE);
+    ret = sqlite3_exec(self->handle, batch, NULL, NULL, &err_msg);
 
-    statement = "INSERT INTO Entries"
-                "(Id, Creation_time, Last_used_time, Flags, Clipboard)"
-                "VALUES (?, ?, ?, ?, ?)"
-                "ON CONFLICT DO UPDATE SET "
-                "Creation_time = ?, Last_used_time = ?, Flags = ?;";
+    if (ret != SQLITE_OK)
+    {
+        sqlite3_exec(self->handle, "ROLLBACK;", NULL, NULL, NULL);
+        goto fail;
+    }
 
-    ret = sqlite3_prepare_v2(self->handle, statement, -1, &stmt, 0);
+    PREPARE(-1);
 
-    if (ret != SQLITE_OK)
+    ret = sqlite3_step(stmt);
+
+    if (ret != SQLITE_ROW)
+        STEP_ERROR(-1);
+
+    gboolean done = !sqlite3_column_int(stmt, 0);
+
+    RESET(stmt);
+
+    if (!done)
+        return 0;
+
+    ret = sqlite3_exec(
+        self->handle,
+        "DROP TABLE temp.Compacting;"
+        "DROP TABLE temp.Compacting_data;",
+        NULL, NULL, &err_msg
+    );
+
+    if (ret == SQLITE_OK)
+        return 1;
+
+fail:
+    g_set_error(
+        error, CLIPPOR_DATABASE_ERROR, CLIPPOR_DATABASE_ERROR_EXEC,
+        "Failed moving entries to compact schema: %s", err_msg
+    );
+    sqlite3_free(err_msg);
+    return -1;
+}
+
+/*
+ * Wait until the writer thread is done moving the rows of an old database to
+ * the compact schema, if it is still doing so. Must be called with the lock
+ * held. Returns FALSE if moving them failed.
+ */
+static gboolean
+clippor_database_wait_compacted(ClipporDatabase *self, GError **error)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(error == NULL || *error == NULL);
+
+    while (self->compacting)
+        g_cond_wait(&self->compacted, &self->lock);
+
+    if (self->compact_error != NULL)
+    {
+        g_propagate_error(error, g_error_copy(self->compact_error));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/*
+ * Upgrade the database schema to the latest version, one version at a time.
+ * Each step is done in its own transaction.
+ */
+static gboolean
+clippor_database_migrate(ClipporDatabase *self, GError **error)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(error == NULL || *error == NULL);
+
+    const char *statement = "SELECT MAX(Db_version) FROM Version;";
+    sqlite3_stmt *stmt;
+    int ret;
+
+    PREPARE(FALSE);
+
+    ret = sqlite3_step(stmt);
+
+    if (ret != SQLITE_ROW)
+        STEP_ERROR(FALSE);
+
+    int64_t version = sqlite3_column_int64(stmt, 0);
+
+    RESET(stmt);
+
+    if (version > (int64_t)G_N_ELEMENTS(migrations))
     {
         g_set_error(
-            error, CLIPPOR_DATABASE_ERROR, CLIPPOR_DATABASE_ERROR_PREPARE,
-            "Failed preparing statement '%s': %s", statement,
-            sqlite3_errmsg(self->handle)
+            error, CLIPPOR_DATABASE_ERROR, CLIPPOR_DATABASE_ERROR_FAILED,
+            "Database version %ld is newer than the supported version %zu",
+            version, G_N_ELEMENTS(migrations)
         );
-        goto fail;
+        return FALSE;
     }
 
-    const char *cb_label = clippor_entry_get_clipboard(entry);
+    for (; version < (int64_t)G_N_ELEMENTS(migrations); version++)
+    {
+        // Stop here if there are rows to move first, which is done by the
+        // writer thread in batches, so that opening a large history doesn't
+        // block until all of them are moved. The rest of the migrations are
+        // done once they are.
+        if (version == COMPACT_VERSION)
+        {
+            statement =
+                // Rows like these can't be moved and would never be removed
+                // otherwise.
+                "DELETE FROM Mime_types "
+                "WHERE Id IS NULL OR Mime_type IS NULL OR Data_id IS NULL;";
+            EXEC(FALSE);
+
+            statement = "SELECT EXISTS (SELECT 1 FROM Mime_types);";
+            PREPARE(FALSE);
 
-    const char *id = clippor_entry_get_id(entry);
-    int64_t creation_time = clippor_entry_get_creation_time(entry);
-    int64_t last_used_time = clippor_entry_get_last_used_time(entry);
-    ClipporEntryFlags flags = clippor_entry_get_flags(entry);
+            ret = sqlite3_step(stmt);
 
-    sqlite3_bind_text(stmt, 1, id, -1, SQLITE_STATIC);
-    sqlite3_bind_int64(stmt, 2, creation_time);
-    sqlite3_bind_int64(stmt, 3, last_used_time);
-    sqlite3_bind_int(stmt, 4, flags);
-    sqlite3_bind_text(stmt, 5, cb_label, -1, SQLITE_STATIC);
+            if (ret != SQLITE_ROW)
+                STEP_ERROR(FALSE);
+
+            gboolean compact = sqlite3_column_int(stmt, 0);
+
+            RESET(stmt);
+
+            if (compact)
+            {
+                DatabaseJob *job = g_new0(DatabaseJob, 1);
+
+                job->type = DATABASE_JOB_COMPACT;
+                g_async_queue_push(self->jobs, job);
+
+                g_atomic_int_set(&self->compacting, TRUE);
+                return TRUE;
+            }
+        }
+
+        g_autofree char *update = g_strdup_printf(
+            "BEGIN TRANSACTION;"
+            "%s"
+            "UPDATE Version SET Db_version = %ld;"
+            "COMMIT;",
+            migrations[version], version + 1
+        );
+        char *err_msg;
+
+        ret = sqlite3_exec(self->handle, update, NULL, NULL, &err_msg);
+
+        if (ret != SQLITE_OK)
+        {
+            g_set_error(
+                error, CLIPPOR_DATABASE_ERROR, CLIPPOR_DATABASE_ERROR_EXEC,
+                "Failed migrating database to version %ld: %s", version + 1,
+                err_msg
+            );
+            sqlite3_free(err_msg);
+            sqlite3_exec(self->handle, "ROLLBACK;", NULL, NULL, NULL);
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+ClipporChecksumType
+clippor_database_get_checksum_type(ClipporDatabase *self)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+
+    if (self->flags & CLIPPOR_DATABASE_FAST_CHECKSUM)
+        return CLIPPOR_CHECKSUM_XXH64;
+    return CLIPPOR_CHECKSUM_SHA1;
+}
+
+/*
+ * Returns 0 if entry exists in the database, 1 if it doesn't, and -1 on error.
+ */
+int
+clippor_database_entry_exists(
+    ClipporDatabase *self, ClipporEntry *entry, GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(CLIPPOR_IS_ENTRY(entry));
+    g_assert(error == NULL || *error == NULL);
+
+    g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&self->lock);
 
-    sqlite3_bind_int64(stmt, 6, creation_time);
-    sqlite3_bind_int64(stmt, 7, last_used_time);
-    sqlite3_bind_int(stmt, 8, flags);
+    if (!clippor_database_wait_compacted(self, error))
+        return -1;
+
+    const char *statement = "SELECT Id FROM Entries WHERE Id = ?;";
+    sqlite3_stmt *stmt;
+    int ret;
+
+    PREPARE(-1);
+
+    sqlite3_bind_text(stmt, 1, clippor_entry_get_id(entry), -1, SQLITE_STATIC);
 
     ret = sqlite3_step(stmt);
 
-    sqlite3_finalize(stmt);
+    if (ret == SQLITE_ROW)
+        ret = 0;
+    else if (ret == SQLITE_DONE)
+        ret = 1;
+    else
+        STEP_ERROR(-1);
 
-    if (ret != SQLITE_DONE)
+    RESET(stmt);
+    return ret;
+}
+
+/*
+ * Append "bytes" to the current segment and point the row of "blob_id" at it.
+ * Must be called inside a transaction, which should only be committed once the
+ * pack has been synced.
+ */
+static gboolean
+clippor_database_pack_data(
+    ClipporDatabase *self, int64_t blob_id, GBytes *bytes, GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(self->pack != NULL);
+    g_assert(bytes != NULL);
+    g_assert(error == NULL || *error == NULL);
+
+    int64_t segment, offset;
+
+    if (!clippor_pack_append(self->pack, bytes, &segment, &offset, error))
+        return FALSE;
+
+    const char *statement =
+        "INSERT INTO Segments (Segment_id, Size) VALUES (?, ?) "
+        "ON CONFLICT DO UPDATE SET Size = Size + excluded.Size;";
+    sqlite3_stmt *stmt;
+    int ret;
+
+    PREPARE(FALSE);
+
+    sqlite3_bind_int64(stmt, 1, segment);
+    sqlite3_bind_int64(stmt, 2, g_bytes_get_size(bytes));
+
+    STEP_NO_ROW(FALSE);
+
+    // Live bytes of the segment are updated by a trigger
+    statement = "UPDATE Blobs SET Segment = ?, Segment_offset = ? "
+                "WHERE Blob_id = ?;";
+
+    PREPARE(FALSE);
+
+    sqlite3_bind_int64(stmt, 1, segment);
+    sqlite3_bind_int64(stmt, 2, offset);
+    sqlite3_bind_int64(stmt, 3, blob_id);
+
+    STEP_NO_ROW(FALSE);
+
+    return TRUE;
+}
+
+/*
+ * Reference the data in the database, creating it if it doesn't exist yet.
+ * "known_id" should be the data id of "bytes" if it is already known, otherwise
+ * it is computed. Returns the blob id of the data, or -1 on error.
+ */
+static int64_t
+clippor_database_ref_data(
+    ClipporDatabase *self, GBytes *bytes, const char *known_id, GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(bytes != NULL);
+    g_assert(error == NULL || *error == NULL);
+
+    // Add new row, or if one already exists, increment the reference count
+    const char *statement =
+        "INSERT INTO Blobs (Digest, Checksum, Contents, Size) "
+        "VALUES (to_digest(?), ?, ?, ?) "
+        "ON CONFLICT DO UPDATE SET Ref_count = Ref_count + 1 "
+        "RETURNING Blob_id, Ref_count = 1 AND Segment IS NULL;";
+    sqlite3_stmt *stmt;
+    int ret;
+
+    PREPARE(-1);
+
+    size_t sz;
+    const char *stuff = g_bytes_get_data(bytes, &sz);
+    gboolean is_inline = (int64_t)sz <= self->inline_threshold;
+
+    g_autofree char *data_id = NULL;
+
+    if (known_id == NULL)
+        data_id = clippor_checksum_compute_for_bytes(
+            clippor_database_get_checksum_type(self), bytes
+        );
+    else
+        data_id = g_strdup(known_id);
+
+    sqlite3_bind_text(stmt, 1, data_id, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, clippor_checksum_type_from_string(data_id));
+
+    // Small data is stored in the row itself, which avoids creating a file
+    if (is_inline)
+        sqlite3_bind_blob64(stmt, 3, sz > 0 ? stuff : "", sz, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 4, sz);
+
+    ret = sqlite3_step(stmt);
+
+    if (ret != SQLITE_ROW)
+        STEP_ERROR(-1);
+
+    int64_t blob_id = sqlite3_column_int64(stmt, 0);
+    gboolean is_new = sqlite3_column_int(stmt, 1);
+
+    RESET(stmt);
+
+    if (is_inline)
+        return blob_id;
+
+    if (self->flags & CLIPPOR_DATABASE_IN_MEMORY)
+        clippor_memory_store_insert(self->store, data_id, bytes);
+    else if (self->flags & CLIPPOR_DATABASE_PACKED)
+    {
+        // Data that is already stored doesn't need to be appended again
+        if (is_new && !clippor_database_pack_data(self, blob_id, bytes, error))
+        {
+            g_prefix_error(error, "Failed packing data '%s': ", data_id);
+            return -1;
+        }
+    }
+    // File is only written once the transaction is about to be committed
+    else if (!clippor_blob_writer_stage(
+                 self->blob_writer, data_id, bytes, error
+             ))
+    {
+        g_prefix_error(error, "Failed creating data file '%s': ", data_id);
+        return -1;
+    }
+
+    return blob_id;
+}
+
+/*
+ * Increment the reference count of data that is already in the database.
+ * Returns the blob id of the data, or -1 on error.
+ */
+static int64_t
+clippor_database_ref_existing_data(
+    ClipporDatabase *self, const char *data_id, GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(error == NULL || *error == NULL);
+
+    if (data_id == NULL)
     {
         g_set_error(
-            error, CLIPPOR_DATABASE_ERROR, CLIPPOR_DATABASE_ERROR_PREPARE,
-            "Failed stepping statement '%s': %s", statement,
-            sqlite3_errmsg(self->handle)
+            error, CLIPPOR_DATABASE_ERROR, CLIPPOR_DATABASE_ERROR_FAILED,
+            "Data is not in memory and has no data id"
         );
-        goto fail;
+        return -1;
     }
 
-    if (!clippor_database_serialize_mime_types(
-            self, id, clippor_entry_get_mime_types(entry), error
-        ))
-        goto fail;
+    const char *statement = "UPDATE Blobs SET Ref_count = Ref_count + 1 "
+                            "WHERE Digest = to_digest(?) RETURNING Blob_id;";
+    sqlite3_stmt *stmt;
+    int ret;
 
-    gboolean f_ret = TRUE;
+    PREPARE(-1);
 
-    if (FALSE)
-fail:
-        f_ret = FALSE;
+    sqlite3_bind_text(stmt, 1, data_id, -1, SQLITE_STATIC);
 
-    if (f_ret)
-        statement = "COMMIT;";
+    ret = sqlite3_step(stmt);
+
+    if (ret == SQLITE_DONE)
+    {
+        g_set_error(
+            error, CLIPPOR_DATABASE_ERROR, CLIPPOR_DATABASE_ERROR_ROW_NOT_EXIST,
+            "Data '%s' does not exist", data_id
+        );
+        RESET(stmt);
+        return -1;
+    }
+    else if (ret != SQLITE_ROW)
+        STEP_ERROR(-1);
+
+    int64_t blob_id = sqlite3_column_int64(stmt, 0);
+
+    RESET(stmt);
+
+    return blob_id;
+}
+
+/*
+ * Remove data that is stored outside of the database.
+ */
+static void
+clippor_database_remove_data_file(ClipporDatabase *self, const char *data_id)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(data_id != NULL);
+
+    if (self->flags & CLIPPOR_DATABASE_IN_MEMORY)
+        clippor_memory_store_remove(self->store, data_id);
     else
-        statement = "ROLLBACK TRANSACTION;";
+    {
+        g_autofree char *path =
+            g_strdup_printf("%s/data/%s", self->location_dir, data_id);
 
-    EXEC(FALSE);
+        g_unlink(path);
+    }
+}
+
+/*
+ * Unreferences the data with "blob_id" by one, if it reaches zero, then it
+ * removes the row and the associated data file from the filesystem.
+ */
+static gboolean
+clippor_database_unref_data(
+    ClipporDatabase *self, int64_t blob_id, GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(error == NULL || *error == NULL);
+
+    const char *statement =
+        "UPDATE Blobs "
+        "SET Ref_count = Ref_count - 1 "
+        "WHERE Blob_id = ? "
+        "RETURNING Ref_count, Contents IS NULL AND Segment IS NULL, "
+        "to_data_id(Digest);";
+    sqlite3_stmt *stmt;
+    int ret;
+
+    PREPARE(FALSE);
+
+    sqlite3_bind_int64(stmt, 1, blob_id);
+
+    ret = sqlite3_step(stmt);
+
+    if (ret == SQLITE_ROW)
+    {
+        int ref_count = sqlite3_column_int(stmt, 0);
+        gboolean in_file = sqlite3_column_int(stmt, 1);
+        g_autofree char *data_id =
+            g_strdup((const char *)sqlite3_column_text(stmt, 2));
+
+        RESET(stmt);
+
+        if (ref_count <= 0)
+        {
+            // Delete row and remove data file. Inline and packed data go away
+            // with the row.
+            if (in_file)
+                clippor_database_remove_data_file(self, data_id);
+
+            statement = "DELETE FROM Blobs WHERE Blob_id = ?;";
+
+            PREPARE(FALSE);
+
+            sqlite3_bind_int64(stmt, 1, blob_id);
+
+            STEP_NO_ROW(FALSE);
+        }
+
+        return TRUE;
+    }
+    else if (ret != SQLITE_DONE)
+        STEP_ERROR(FALSE);
+
+    RESET(stmt);
+    return TRUE;
+}
+
+/*
+ * Removes mime type rows of the entry at "position" whose mime type doesn't
+ * exist in the hash table. If "all" is TRUE then just removes all of them and
+ * ignores "mime_types".
+ */
+static gboolean
+clippor_database_cleanup_mime_types(
+    ClipporDatabase *self, int64_t position, GHashTable *mime_types,
+    gboolean all, GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(all || mime_types != NULL);
+    g_assert(error == NULL || *error == NULL);
+
+    const char *statement =
+        "SELECT Mime_type_id, Name, Blob_id FROM Entry_mime_types "
+        "JOIN Mime_type_names USING (Mime_type_id) WHERE Position = ?;";
+    const char *statement2 = "DELETE FROM Entry_mime_types "
+                             "WHERE Position = ? AND Mime_type_id = ?;";
+    sqlite3_stmt *stmt, *stmt2;
+    int ret;
+
+    PREPARE(FALSE);
+
+    stmt2 = clippor_database_get_statement(self, statement2, error);
+
+    if (stmt2 == NULL)
+        return FALSE;
+
+    sqlite3_bind_int64(stmt, 1, position);
+
+    while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+        int64_t mime_type_id = sqlite3_column_int64(stmt, 0);
+        const char *mime_type = (const char *)sqlite3_column_text(stmt, 1);
+        int64_t blob_id = sqlite3_column_int64(stmt, 2);
+
+        if (all || !g_hash_table_contains(mime_types, mime_type))
+        {
+            // Delete mime type row first to avoid foriegn key restriction
+            sqlite3_bind_int64(stmt2, 1, position);
+            sqlite3_bind_int64(stmt2, 2, mime_type_id);
+
+            ret = sqlite3_step(stmt2);
+
+            RESET(stmt2);
+
+            if (!clippor_database_unref_data(self, blob_id, error))
+            {
+                RESET(stmt);
+
+                g_prefix_error(
+                    error, "Failed cleaning up entry at position %ld: ",
+                    position
+                );
+                return FALSE;
+            }
+        }
+    }
+
+    if (ret != SQLITE_DONE)
+        STEP_ERROR(FALSE);
+
+    RESET(stmt);
+
+    return TRUE;
+}
+
+/*
+ * Returns the id of "mime_type" in the Mime_type_names table, adding it if it
+ * isn't there yet, or -1 on error.
+ */
+static int64_t
+clippor_database_get_mime_type_id(
+    ClipporDatabase *self, const char *mime_type, GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(mime_type != NULL);
+    g_assert(error == NULL || *error == NULL);
+
+    // Almost every mime type has been seen before, so look it up first instead
+    // of always writing to the table.
+    const char *statement =
+        "SELECT Mime_type_id FROM Mime_type_names WHERE Name = ?;";
+    sqlite3_stmt *stmt;
+    int ret;
+
+    PREPARE(-1);
+
+    sqlite3_bind_text(stmt, 1, mime_type, -1, SQLITE_STATIC);
+
+    ret = sqlite3_step(stmt);
+
+    if (ret == SQLITE_DONE)
+    {
+        RESET(stmt);
+
+        statement = "INSERT INTO Mime_type_names (Name) VALUES (?) "
+                    "RETURNING Mime_type_id;";
+        PREPARE(-1);
+
+        sqlite3_bind_text(stmt, 1, mime_type, -1, SQLITE_STATIC);
+
+        ret = sqlite3_step(stmt);
+    }
+
+    if (ret != SQLITE_ROW)
+        STEP_ERROR(-1);
+
+    int64_t mime_type_id = sqlite3_column_int64(stmt, 0);
+
+    RESET(stmt);
+
+    return mime_type_id;
+}
+
+/*
+ * Given an entry at "position", for each of its mime types, create a new row in
+ * the Entry_mime_types table, and for every piece of data, create a new row in
+ * the Blobs table, or increase the reference count if it already exists. Data
+ * ids that the entry already carries are reused instead of being computed
+ * again.
+ *
+ * If mime type already exists in the table, update it, or if
+ * it exists in the database but not in the entry, remove it.
+ */
+static gboolean
+clippor_database_serialize_mime_types(
+    ClipporDatabase *self, ClipporEntry *entry, int64_t position,
+    GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(CLIPPOR_IS_ENTRY(entry));
+    g_assert(error == NULL || *error == NULL);
+
+    const char *id = clippor_entry_get_id(entry);
+    GHashTable *mime_types = clippor_entry_get_mime_types(entry);
+
+    g_autofree char *data_dir_path =
+        g_strdup_printf("%s/data", self->location_dir);
+
+    if (!(self->flags & CLIPPOR_DATABASE_IN_MEMORY) &&
+        g_mkdir_with_parents(data_dir_path, 0755) == -1)
+    {
+        g_set_error(
+            error, CLIPPOR_DATABASE_ERROR, CLIPPOR_DATABASE_ERROR_DATA_DIR,
+            "Failed creating directory '%s'", data_dir_path
+        );
+        return FALSE;
+    }
+
+    // Remove deleted mime types first
+    if (!clippor_database_cleanup_mime_types(
+            self, position, mime_types, FALSE, error
+        ))
+    {
+        g_prefix_error(error, "Failed serializing mime types: ");
+        return FALSE;
+    }
+
+    const char *statement =
+        "INSERT INTO Entry_mime_types (Position, Mime_type_id, Blob_id) "
+        "VALUES (?, ?, ?) ON CONFLICT DO UPDATE SET Blob_id = ?;";
+    sqlite3_stmt *stmt;
+    int ret;
+
+    PREPARE(FALSE);
+
+    GHashTableIter iter;
+    const char *mime_type;
+
+    g_hash_table_iter_init(&iter, mime_types);
+
+    while (g_hash_table_iter_next(&iter, (void **)&mime_type, NULL))
+    {
+        g_autoptr(GBytes) bytes = clippor_entry_peek_data(entry, mime_type);
+        const char *known_id = clippor_entry_get_data_id(entry, mime_type);
+        int64_t blob_id, mime_type_id;
+
+        // If the data isn't in memory, then it must already be in the database
+        if (bytes != NULL)
+            blob_id = clippor_database_ref_data(self, bytes, known_id, error);
+        else
+            blob_id =
+                clippor_database_ref_existing_data(self, known_id, error);
+
+        if (blob_id == -1 ||
+            (mime_type_id = clippor_database_get_mime_type_id(
+                 self, mime_type, error
+             )) == -1)
+        {
+            g_prefix_error(
+                error, "Failed serializing entry with id '%s': ", id
+            );
+            return FALSE;
+        }
+
+        sqlite3_bind_int64(stmt, 1, position);
+        sqlite3_bind_int64(stmt, 2, mime_type_id);
+        sqlite3_bind_int64(stmt, 3, blob_id);
+        sqlite3_bind_int64(stmt, 4, blob_id);
+
+        ret = sqlite3_step(stmt);
+
+        if (ret != SQLITE_DONE)
+            STEP_ERROR(FALSE);
+
+        RESET(stmt);
+    }
+
+    return TRUE;
+}
+
+// Maximum number of bytes of text that is indexed for each entry
+#define SEARCH_MAX_TEXT (64 * 1024)
+
+/*
+ * Add the text of the entry at "position" to the search index, replacing the
+ * existing text if any. Entries without any text are ignored.
+ */
+static gboolean
+clippor_database_index_entry(
+    ClipporDatabase *self, ClipporEntry *entry, int64_t position,
+    GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(CLIPPOR_IS_ENTRY(entry));
+    g_assert(error == NULL || *error == NULL);
+
+    const char *mime_type = clippor_entry_get_text_mime_type(entry);
+
+    if (mime_type == NULL)
+        return TRUE;
+
+    // If the data isn't in memory, then the entry was already indexed when it
+    // was first serialized.
+    g_autoptr(GBytes) bytes = clippor_entry_peek_data(entry, mime_type);
+
+    if (bytes == NULL)
+        return TRUE;
+
+    const char *statement =
+        "INSERT OR REPLACE INTO Search (rowid, Text) VALUES (?, ?);";
+    sqlite3_stmt *stmt;
+    int ret;
+
+    PREPARE(FALSE);
+
+    size_t sz;
+    const char *data = g_bytes_get_data(bytes, &sz);
+    g_autofree char *text = g_utf8_make_valid(data, MIN(sz, SEARCH_MAX_TEXT));
+
+    sqlite3_bind_int64(stmt, 1, position);
+    sqlite3_bind_text(stmt, 2, text, -1, SQLITE_STATIC);
+
+    STEP_NO_ROW(FALSE);
+
+    return TRUE;
+}
+
+static int
+compare_strings(const void *a, const void *b)
+{
+    return strcmp(*(const char **)a, *(const char **)b);
+}
+
+/*
+ * Return a checksum over the sorted (mime type, data id) pairs of the entry,
+ * so that entries with the same contents have the same fingerprint. Returns
+ * NULL if the entry has no mime types or the data id of one can't be known.
+ */
+static char *
+clippor_database_get_fingerprint(ClipporDatabase *self, ClipporEntry *entry)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(CLIPPOR_IS_ENTRY(entry));
+
+    ClipporChecksumType type = clippor_database_get_checksum_type(self);
+    GHashTable *mime_types = clippor_entry_get_mime_types(entry);
+    uint len;
+    g_autofree const char **keys =
+        (const char **)g_hash_table_get_keys_as_array(mime_types, &len);
+
+    if (len == 0)
+        return NULL;
+
+    qsort(keys, len, sizeof(*keys), compare_strings);
+
+    g_autoptr(ClipporChecksum) checksum = clippor_checksum_new(type);
+
+    for (uint i = 0; i < len; i++)
+    {
+        const char *data_id = clippor_entry_get_data_id(entry, keys[i]);
+        g_autofree char *computed_id = NULL;
+
+        if (data_id == NULL)
+        {
+            g_autoptr(GBytes) bytes = clippor_entry_peek_data(entry, keys[i]);
+
+            if (bytes == NULL)
+                return NULL;
+
+            computed_id = clippor_checksum_compute_for_bytes(type, bytes);
+            data_id = computed_id;
+        }
+
+        // Include the terminating NUL bytes so pairs can't run into each other
+        clippor_checksum_update(
+            checksum, (const uint8_t *)keys[i], strlen(keys[i]) + 1
+        );
+        clippor_checksum_update(
+            checksum, (const uint8_t *)data_id, strlen(data_id) + 1
+        );
+    }
+
+    return clippor_checksum_get_string(checksum);
+}
+
+/*
+ * Set the size of the entry at "position" to the total size of the data its
+ * mime types refer to. Data shared between mime types is only counted once.
+ */
+static gboolean
+clippor_database_update_entry_size(
+    ClipporDatabase *self, int64_t position, GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(error == NULL || *error == NULL);
+
+    const char *statement =
+        "UPDATE Entries SET Size = ("
+        "   SELECT IFNULL(SUM(Size), 0) FROM Blobs WHERE Blob_id IN ("
+        "       SELECT Blob_id FROM Entry_mime_types WHERE Position = ?"
+        "   )"
+        ") WHERE Position = ?;";
+    sqlite3_stmt *stmt;
+    int ret;
+
+    PREPARE(FALSE);
+
+    sqlite3_bind_int64(stmt, 1, position);
+    sqlite3_bind_int64(stmt, 2, position);
+
+    STEP_NO_ROW(FALSE);
+
+    return TRUE;
+}
+
+/*
+ * Commit the current transaction if "commit" is TRUE, otherwise roll it back.
+ * It is rolled back as well if committing fails. Failing to roll back is only
+ * logged, since "error" is already set with the reason for it. Returns FALSE
+ * if the transaction was rolled back.
+ */
+static gboolean
+clippor_database_end_transaction(
+    ClipporDatabase *self, gboolean commit, GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+
+    const char *statement = "COMMIT;";
+    sqlite3_stmt *stmt;
+    int ret;
+
+    if (commit)
+    {
+        stmt = clippor_database_get_statement(self, statement, error);
+
+        if (stmt == NULL)
+            goto rollback;
+
+        ret = sqlite3_step(stmt);
+        sqlite3_reset(stmt);
+
+        if (ret == SQLITE_DONE)
+            return TRUE;
+
+        g_set_error(
+            error, CLIPPOR_DATABASE_ERROR, CLIPPOR_DATABASE_ERROR_EXEC,
+            "Failed execing statement '%s': %s", statement,
+            sqlite3_errmsg(self->handle)
+        );
+    }
+
+rollback:
+    // SQLite may have rolled back the transaction on its own already
+    if (sqlite3_get_autocommit(self->handle))
+        return FALSE;
+
+    if (sqlite3_exec(
+            self->handle, "ROLLBACK TRANSACTION;", NULL, NULL, NULL
+        ) != SQLITE_OK)
+        g_warning(
+            "Failed rolling back transaction: %s", sqlite3_errmsg(self->handle)
+        );
+
+    return FALSE;
+}
+
+/*
+ * Serialize an entry into the database. If the entry already exists, it is
+ * updated. The UPSERT clause is used so foreign key restrictions won't be
+ * violated.
+ */
+gboolean
+clippor_database_serialize_entry(
+    ClipporDatabase *self, ClipporEntry *entry, GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(CLIPPOR_IS_ENTRY(entry));
+    g_assert(error == NULL || *error == NULL);
+
+    g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&self->lock);
+
+    if (!clippor_database_wait_compacted(self, error))
+        return FALSE;
+
+    const char *statement = "BEGIN TRANSACTION;";
+    sqlite3_stmt *stmt;
+    int ret;
+
+    EXEC(FALSE);
+
+    // The preview is only known if the text is in memory, which it always is
+    // when the entry is first serialized.
+    statement = "INSERT INTO Entries"
+                "(Id, Creation_time, Last_used_time, Flags, Clipboard,"
+                " Fingerprint, Content, Preview)"
+                "VALUES (?, ?, ?, ?, ?, ?, ?, ?)"
+                "ON CONFLICT DO UPDATE SET "
+                "Creation_time = ?, Last_used_time = ?, Flags = ?, "
+                "Fingerprint = ?, Content = ?, Preview = IFNULL(?, Preview) "
+                "RETURNING Position;";
+
+    stmt = clippor_database_get_statement(self, statement, error);
+
+    if (stmt == NULL)
+        goto fail;
+
+    const char *cb_label = clippor_entry_get_clipboard(entry);
+
+    const char *id = clippor_entry_get_id(entry);
+    int64_t creation_time = clippor_entry_get_creation_time(entry);
+    int64_t last_used_time = clippor_entry_get_last_used_time(entry);
+    ClipporEntryFlags flags = clippor_entry_get_flags(entry);
+    g_autofree char *fingerprint =
+        clippor_database_get_fingerprint(self, entry);
+    ClipporEntryContent content = clippor_entry_get_content(entry);
+    const char *preview = clippor_entry_get_preview(entry);
+
+    sqlite3_bind_text(stmt, 1, id, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, creation_time);
+    sqlite3_bind_int64(stmt, 3, last_used_time);
+    sqlite3_bind_int(stmt, 4, flags);
+    sqlite3_bind_text(stmt, 5, cb_label, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 6, fingerprint, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 7, content);
+    sqlite3_bind_text(stmt, 8, preview, -1, SQLITE_STATIC);
+
+    sqlite3_bind_int64(stmt, 9, creation_time);
+    sqlite3_bind_int64(stmt, 10, last_used_time);
+    sqlite3_bind_int(stmt, 11, flags);
+    sqlite3_bind_text(stmt, 12, fingerprint, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 13, content);
+    sqlite3_bind_text(stmt, 14, preview, -1, SQLITE_STATIC);
+
+    ret = sqlite3_step(stmt);
+
+    int64_t position = sqlite3_column_int64(stmt, 0);
+
+    RESET(stmt);
+
+    if (ret != SQLITE_ROW)
+    {
+        g_set_error(
+            error, CLIPPOR_DATABASE_ERROR, CLIPPOR_DATABASE_ERROR_STEP,
+            "Failed stepping statement '%s': %s", statement,
+            sqlite3_errmsg(self->handle)
+        );
+        goto fail;
+    }
+
+    if (!clippor_database_serialize_mime_types(
+            self, entry, position, error
+        ) ||
+        !clippor_database_update_entry_size(self, position, error) ||
+        !clippor_database_index_entry(self, entry, position, error))
+        goto fail;
+
+    // Data files must be durable before the rows that refer to them are, so
+    // that a crash never leaves a row without its file.
+    if (self->blob_writer != NULL)
+    {
+        uint pending = clippor_blob_writer_get_pending(self->blob_writer);
+
+        if (!clippor_blob_writer_commit(self->blob_writer, error))
+            goto fail;
+
+        if (pending > 0)
+        {
+            self->stats.blob_batches++;
+            self->stats.blobs_written += pending;
+        }
+    }
+    if (self->pack != NULL && !clippor_pack_sync(self->pack, error))
+        goto fail;
+
+    gboolean f_ret = TRUE;
+
+    if (FALSE)
+fail:
+        f_ret = FALSE;
+
+    f_ret = clippor_database_end_transaction(self, f_ret, error);
+
+    if (!f_ret && self->blob_writer != NULL)
+        clippor_blob_writer_discard(self->blob_writer);
+
+    // Data of the entry can now be loaded from the database if it is released
+    if (f_ret)
+        clippor_entry_set_database(entry, self);
+
+    // Data ids of the entry aren't known here, so it is cached again once it is
+    // deserialized instead.
+    clippor_database_cache_invalidate(self, clippor_entry_get_id(entry));
+
+    return f_ret;
+}
+
+/*
+ * Move the entry "old_id" at "old_position" to the top of its clipboard under
+ * the id "id". Its mime types and data references are kept as is. Must be
+ * called inside a transaction.
+ */
+static gboolean
+clippor_database_move_entry(
+    ClipporDatabase *self, const char *old_id, int64_t old_position,
+    const char *id, int64_t last_used_time, GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(old_id != NULL);
+    g_assert(id != NULL);
+    g_assert(error == NULL || *error == NULL);
+
+    // Insert the new row first, so that the mime types can be pointed to it
+    // without breaking the foreign key.
+    const char *statement =
+        "INSERT INTO Entries "
+        "(Id, Creation_time, Last_used_time, Flags, Clipboard, Fingerprint, "
+        "Size, Content, Preview) "
+        "SELECT ?, Creation_time, ?, Flags, Clipboard, Fingerprint, Size, "
+        "Content, Preview "
+        "FROM Entries WHERE Id = ? RETURNING Position;";
+    sqlite3_stmt *stmt;
+    int ret;
+
+    PREPARE(FALSE);
+
+    sqlite3_bind_text(stmt, 1, id, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, last_used_time);
+    sqlite3_bind_text(stmt, 3, old_id, -1, SQLITE_STATIC);
+
+    if ((ret = sqlite3_step(stmt)) != SQLITE_ROW)
+        STEP_ERROR(FALSE);
+
+    int64_t position = sqlite3_column_int64(stmt, 0);
+
+    RESET(stmt);
+
+    statement = "UPDATE Entry_mime_types SET Position = ? WHERE Position = ?;";
+    PREPARE(FALSE);
+
+    sqlite3_bind_int64(stmt, 1, position);
+    sqlite3_bind_int64(stmt, 2, old_position);
+    STEP_NO_ROW(FALSE);
+
+    statement =
+        "INSERT INTO Search (rowid, Text) SELECT ?, Text FROM Search "
+        "WHERE rowid = ?;";
+    PREPARE(FALSE);
+
+    sqlite3_bind_int64(stmt, 1, position);
+    sqlite3_bind_int64(stmt, 2, old_position);
+    STEP_NO_ROW(FALSE);
+
+    statement = "DELETE FROM Search WHERE rowid = ?;";
+    PREPARE(FALSE);
+
+    sqlite3_bind_int64(stmt, 1, old_position);
+    STEP_NO_ROW(FALSE);
+
+    statement = "DELETE FROM Entries WHERE Id = ?;";
+    PREPARE(FALSE);
+
+    sqlite3_bind_text(stmt, 1, old_id, -1, SQLITE_STATIC);
+    STEP_NO_ROW(FALSE);
+
+    return TRUE;
+}
+
+/*
+ * If another entry with the same contents as "entry" exists in its clipboard,
+ * move it to the top under the id of "entry" and set its last used time to the
+ * one of "entry", instead of adding a new entry. Its creation time and flags
+ * are kept. Returns 1 if an entry was promoted, 0 if there is none, and -1 on
+ * error.
+ */
+int
+clippor_database_promote_entry(
+    ClipporDatabase *self, ClipporEntry *entry, GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(CLIPPOR_IS_ENTRY(entry));
+    g_assert(error == NULL || *error == NULL);
+
+    g_autofree char *fingerprint =
+        clippor_database_get_fingerprint(self, entry);
+
+    if (fingerprint == NULL)
+        return 0;
+
+    g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&self->lock);
+
+    if (!clippor_database_wait_compacted(self, error))
+        return -1;
+
+    const char *statement = "BEGIN TRANSACTION;";
+    sqlite3_stmt *stmt;
+    int ret;
+
+    EXEC(-1);
+
+    const char *id = clippor_entry_get_id(entry);
+    g_autofree char *old_id = NULL;
+    int64_t old_position = 0;
+
+    statement = "SELECT Id, Position FROM Entries "
+                "WHERE Clipboard = ? AND Fingerprint = ? AND Id != ? "
+                "ORDER BY Position DESC LIMIT 1;";
+    stmt = clippor_database_get_statement(self, statement, error);
+
+    if (stmt == NULL)
+        goto fail;
+
+    sqlite3_bind_text(
+        stmt, 1, clippor_entry_get_clipboard(entry), -1, SQLITE_STATIC
+    );
+    sqlite3_bind_text(stmt, 2, fingerprint, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 3, id, -1, SQLITE_STATIC);
+
+    ret = sqlite3_step(stmt);
+
+    if (ret == SQLITE_ROW)
+    {
+        old_id = g_strdup((const char *)sqlite3_column_text(stmt, 0));
+        old_position = sqlite3_column_int64(stmt, 1);
+    }
+
+    RESET(stmt);
+
+    if (ret != SQLITE_ROW && ret != SQLITE_DONE)
+    {
+        g_set_error(
+            error, CLIPPOR_DATABASE_ERROR, CLIPPOR_DATABASE_ERROR_STEP,
+            "Failed stepping statement '%s': %s", statement,
+            sqlite3_errmsg(self->handle)
+        );
+        goto fail;
+    }
+
+    if (old_id != NULL &&
+        !clippor_database_move_entry(
+            self, old_id, old_position, id,
+            clippor_entry_get_last_used_time(entry), error
+        ))
+        goto fail;
+
+    gboolean f_ret = TRUE;
+
+    if (FALSE)
+fail:
+        f_ret = FALSE;
+
+    f_ret = clippor_database_end_transaction(self, f_ret, error);
+
+    if (!f_ret)
+    {
+        g_prefix_error(error, "Failed promoting entry '%s': ", id);
+        return -1;
+    }
+    if (old_id == NULL)
+        return 0;
+
+    g_debug("Promoted entry '%s' to '%s'", old_id, id);
+    clippor_entry_set_database(entry, self);
+
+    // The promoted entry keeps its creation time and flags, so don't cache
+    // "entry" as is.
+    clippor_database_cache_invalidate(self, old_id);
+    clippor_database_cache_invalidate(self, id);
+
+    return 1;
+}
+
+/*
+ * Load data that is stored outside of the database.
+ */
+static GBytes *
+clippor_database_load_data_file(
+    ClipporDatabase *self, const char *data_id, GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(data_id != NULL);
+    g_assert(error == NULL || *error == NULL);
+
+    if (self->flags & CLIPPOR_DATABASE_IN_MEMORY)
+    {
+        if (clippor_memory_store_get_size(self->store, data_id) == -1)
+        {
+            g_set_error(
+                error, CLIPPOR_DATABASE_ERROR,
+                CLIPPOR_DATABASE_ERROR_ROW_NOT_EXIST,
+                "Data '%s' does not exist", data_id
+            );
+            return NULL;
+        }
+        return clippor_memory_store_lookup(self->store, data_id, error);
+    }
+
+    // Map the file instead of reading it, so pages are only loaded when the
+    // data is actually used, and can be dropped by the kernel when memory is
+    // low. Data files are never modified after they are created, and unlinking
+    // one keeps the mapping valid, so this is safe.
+    g_autofree char *path =
+        g_strdup_printf("%s/data/%s", self->location_dir, data_id);
+    GMappedFile *file = g_mapped_file_new(path, FALSE, error);
+
+    if (file == NULL)
+    {
+        g_prefix_error(error, "Failed loading file '%s': ", path);
+        return NULL;
+    }
+
+    GBytes *bytes = g_mapped_file_get_bytes(file);
+
+    g_mapped_file_unref(file);
+
+    return bytes;
+}
+
+/*
+ * Return size of data that is stored outside of the database, or -1 on error.
+ */
+static int64_t
+clippor_database_get_data_file_size(
+    ClipporDatabase *self, const char *data_id, GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(data_id != NULL);
+    g_assert(error == NULL || *error == NULL);
+
+    if (self->flags & CLIPPOR_DATABASE_IN_MEMORY)
+    {
+        int64_t size = clippor_memory_store_get_size(self->store, data_id);
+
+        if (size != -1)
+            return size;
+    }
+    else
+    {
+        g_autofree char *path =
+            g_strdup_printf("%s/data/%s", self->location_dir, data_id);
+        GStatBuf buf;
+
+        if (g_stat(path, &buf) == 0)
+            return buf.st_size;
+    }
+
+    g_set_error(
+        error, CLIPPOR_DATABASE_ERROR, CLIPPOR_DATABASE_ERROR_ROW_NOT_EXIST,
+        "Data '%s' does not exist", data_id
+    );
+    return -1;
+}
+
+/*
+ * Add the mime type in the current row of "stmt" to the entry. The row should
+ * contain the mime type, data id, Contents, and Size columns in order,
+ * starting at column "col". Data stored outside of the database is not loaded,
+ * only the reference to it is, so that it can be loaded later when it is
+ * actually needed.
+ */
+static gboolean
+clippor_database_add_mime_type_row(
+    ClipporDatabase *self, ClipporEntry *entry, sqlite3_stmt *stmt, int col,
+    GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(CLIPPOR_IS_ENTRY(entry));
+    g_assert(stmt != NULL);
+    g_assert(error == NULL || *error == NULL);
+
+    const char *mime_type = (const char *)sqlite3_column_text(stmt, col);
+    const char *data_id = (const char *)sqlite3_column_text(stmt, col + 1);
+
+    // Small data is stored in the row itself, so we might as well keep it
+    if (sqlite3_column_type(stmt, col + 2) != SQLITE_NULL)
+    {
+        const void *contents = sqlite3_column_blob(stmt, col + 2);
+        g_autoptr(GBytes) bytes =
+            g_bytes_new(contents, sqlite3_column_bytes(stmt, col + 2));
+
+        clippor_entry_add_mime_type_with_id(entry, mime_type, bytes, data_id);
+        return TRUE;
+    }
+
+    int64_t size;
+
+    if (sqlite3_column_type(stmt, col + 3) != SQLITE_NULL)
+        size = sqlite3_column_int64(stmt, col + 3);
+    else
+        size = clippor_database_get_data_file_size(self, data_id, error);
+
+    if (size == -1)
+        return FALSE;
+
+    clippor_entry_add_mime_type_lazy(entry, mime_type, data_id, size);
+
+    return TRUE;
+}
+
+/*
+ * Add the mime types of the entry at "position", using "reader" if it isn't
+ * NULL.
+ */
+static gboolean
+clippor_database_load_mime_types(
+    ClipporDatabase *self, DatabaseReader *reader, ClipporEntry *entry,
+    int64_t position, GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(CLIPPOR_IS_ENTRY(entry));
+    g_assert(error == NULL || *error == NULL);
+
+    const char *statement =
+        "SELECT Name, to_data_id(Digest), Contents, Size "
+        "FROM Entry_mime_types JOIN Mime_type_names USING (Mime_type_id) "
+        "JOIN Blobs USING (Blob_id) WHERE Position = ?;";
+    sqlite3_stmt *stmt;
+    int ret;
+
+    READ_PREPARE(FALSE);
+
+    sqlite3_bind_int64(stmt, 1, position);
+
+    while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+        if (!clippor_database_add_mime_type_row(self, entry, stmt, 0, error))
+        {
+            RESET(stmt);
+            return FALSE;
+        }
+    }
+
+    if (ret != SQLITE_DONE)
+        STEP_ERROR(FALSE);
+
+    RESET(stmt);
+
+    return TRUE;
+}
+
+/*
+ * Create a new entry from the current row of "stmt". The row should contain the
+ * Id, Creation_time, Last_used_time, Flags, Clipboard, and Preview columns in
+ * order, starting at column "col". They may be followed by other columns.
+ */
+static ClipporEntry *
+entry_new_from_row(sqlite3_stmt *stmt, int col)
+{
+    const char *id = (const char *)sqlite3_column_text(stmt, col);
+    int64_t creation_time = sqlite3_column_int64(stmt, col + 1);
+    int64_t last_used_time = sqlite3_column_int64(stmt, col + 2);
+    ClipporEntryFlags flags = sqlite3_column_int(stmt, col + 3);
+    const char *cb = (const char *)sqlite3_column_text(stmt, col + 4);
+    const char *preview = (const char *)sqlite3_column_text(stmt, col + 5);
+
+    ClipporEntry *entry = clippor_entry_new_full(
+        cb, id, creation_time, last_used_time, flags
+    );
+
+    if (preview != NULL)
+        clippor_entry_set_preview(entry, preview);
+
+    return entry;
+}
+
+/*
+ * Load the entry in the current row of "stmt" and add it to the entry cache,
+ * unless a write changed the cache after "generation" was read.
+ */
+static ClipporEntry *
+clippor_database_load_entry(
+    ClipporDatabase *self, DatabaseReader *reader, sqlite3_stmt *stmt,
+    uint64_t generation, GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(stmt != NULL);
+    g_assert(error == NULL || *error == NULL);
+
+    // Position comes after the columns of the entry
+    ClipporEntry *entry = entry_new_from_row(stmt, 0);
+    int64_t position = sqlite3_column_int64(stmt, 6);
+
+    if (!clippor_database_load_mime_types(
+            self, reader, entry, position, error
+        ))
+    {
+        g_object_unref(entry);
+        return NULL;
+    }
+
+    clippor_entry_set_database(entry, self);
+
+    READ_LOCK();
+    if (generation == self->entry_cache_generation)
+        clippor_database_cache_insert(self, entry);
+    READ_UNLOCK();
+
+    return entry;
+}
+
+/*
+ * Return the data with the given data id if it is stored inside the database
+ * or in a segment, using "reader" if it isn't NULL. Otherwise NULL is returned
+ * and "in_file" is set to TRUE. The lock must be held if "reader" is NULL.
+ */
+static GBytes *
+clippor_database_get_contents(
+    ClipporDatabase *self, DatabaseReader *reader, const char *data_id,
+    gboolean *in_file, GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(data_id != NULL);
+    g_assert(in_file != NULL);
+    g_assert(error == NULL || *error == NULL);
+
+    const char *statement =
+        "SELECT Contents, Segment, Segment_offset, Size FROM Blobs "
+        "WHERE Digest = to_digest(?);";
+    sqlite3_stmt *stmt;
+    int ret;
+
+    READ_PREPARE(NULL);
+
+    sqlite3_bind_text(stmt, 1, data_id, -1, SQLITE_STATIC);
+
+    ret = sqlite3_step(stmt);
+
+    if (ret == SQLITE_DONE)
+    {
+        g_set_error(
+            error, CLIPPOR_DATABASE_ERROR, CLIPPOR_DATABASE_ERROR_ROW_NOT_EXIST,
+            "Data '%s' does not exist", data_id
+        );
+        RESET(stmt);
+        return NULL;
+    }
+    else if (ret != SQLITE_ROW)
+        STEP_ERROR(NULL);
+
+    GBytes *bytes = NULL;
+
+    *in_file = FALSE;
+
+    if (sqlite3_column_type(stmt, 0) != SQLITE_NULL)
+    {
+        const void *contents = sqlite3_column_blob(stmt, 0);
+
+        bytes = g_bytes_new(contents, sqlite3_column_bytes(stmt, 0));
+    }
+    // Segments are mapped, so reading from them never blocks on a read call
+    else if (sqlite3_column_type(stmt, 1) != SQLITE_NULL)
+    {
+        if (self->pack == NULL)
+            g_set_error(
+                error, CLIPPOR_DATABASE_ERROR, CLIPPOR_DATABASE_ERROR_FAILED,
+                "Data '%s' is in a segment, but there are no segments",
+                data_id
+            );
+        else
+            bytes = clippor_pack_read(
+                self->pack, sqlite3_column_int64(stmt, 1),
+                sqlite3_column_int64(stmt, 2), sqlite3_column_int64(stmt, 3),
+                error
+            );
+    }
+    else
+        *in_file = TRUE;
+
+    RESET(stmt);
+
+    return bytes;
+}
+
+/*
+ * Load the data with the given data id using "reader", or the writer's
+ * connection if it is NULL.
+ */
+static GBytes *
+clippor_database_read_data(
+    ClipporDatabase *self, DatabaseReader *reader, const char *data_id,
+    GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(data_id != NULL);
+    g_assert(error == NULL || *error == NULL);
+
+    g_autoptr(GMutexLocker) locker =
+        reader == NULL ? g_mutex_locker_new(&self->lock) : NULL;
+    GError *err = NULL;
+    GBytes *bytes = NULL;
+
+    // A reader may see where the data was before the writer moved it and
+    // removed the old file or segment, so look again in a new read transaction.
+    for (int i = 0; i < 2 && bytes == NULL; i++)
+    {
+        gboolean in_file = FALSE;
+
+        g_clear_error(&err);
+        bytes = clippor_database_get_contents(
+            self, reader, data_id, &in_file, &err
+        );
+
+        if (in_file)
+            bytes = clippor_database_load_data_file(self, data_id, &err);
+
+        if (!g_error_matches(err, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+            break;
+    }
+
+    if (bytes == NULL)
+        g_propagate_error(error, err);
+
+    return bytes;
+}
+
+/*
+ * Load the data with the given data id.
+ */
+GBytes *
+clippor_database_load_data(
+    ClipporDatabase *self, const char *data_id, GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(data_id != NULL);
+    g_assert(error == NULL || *error == NULL);
+
+    DatabaseReader *reader;
+
+    if (!clippor_database_acquire_reader(self, &reader, error))
+        return NULL;
+
+    GBytes *bytes = clippor_database_read_data(self, reader, data_id, error);
+
+    clippor_database_release_reader(self, reader);
+
+    return bytes;
+}
+
+/*
+ * Turn the query into an FTS5 expression where each word is quoted, so that
+ * characters in it aren't interpreted as FTS5 syntax. Every word must match,
+ * and the last one may only be the start of a word.
+ */
+static char *
+search_query_to_match(const char *query)
+{
+    g_auto(GStrv) words = g_strsplit_set(query, " \t\n", -1);
+    GString *match = g_string_new(NULL);
+
+    for (int i = 0; words[i] != NULL; i++)
+    {
+        if (*words[i] == 0)
+            continue;
+
+        // Quotes are escaped by doubling them
+        g_auto(GStrv) parts = g_strsplit(words[i], "\"", -1);
+        g_autofree char *escaped = g_strjoinv("\"\"", parts);
+
+        if (match->len > 0)
+            g_string_append_c(match, ' ');
+        g_string_append_printf(match, "\"%s\"", escaped);
+    }
+
+    if (match->len > 0)
+        g_string_append_c(match, '*');
+
+    return g_string_free(match, FALSE);
+}
+
+void
+clippor_search_result_free(ClipporSearchResult *result)
+{
+    g_assert(result != NULL);
+
+    g_free(result->id);
+    g_free(result->snippet);
+    g_free(result);
+}
+
+/*
+ * Search the text of the entries in clipboard "cb" using "reader", or the
+ * writer's connection if it is NULL.
+ */
+static GPtrArray *
+clippor_database_read_search(
+    ClipporDatabase *self, DatabaseReader *reader, const char *cb,
+    const char *query, int64_t n, GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(cb != NULL);
+    g_assert(query != NULL);
+    g_assert(n > 0);
+    g_assert(error == NULL || *error == NULL);
+
+    g_autoptr(GPtrArray) results = g_ptr_array_new_with_free_func(
+        (GDestroyNotify)clippor_search_result_free
+    );
+    g_autofree char *match = search_query_to_match(query);
+
+    if (*match == 0)
+        return g_steal_pointer(&results);
+
+    g_autoptr(GMutexLocker) locker =
+        reader == NULL ? g_mutex_locker_new(&self->lock) : NULL;
+
+    const char *statement =
+        "SELECT Id, snippet(Search, 0, '', '', '...', 16) "
+        "FROM Search JOIN Entries ON Entries.Position = Search.rowid "
+        "WHERE Search MATCH ? AND Clipboard = ? "
+        "ORDER BY rank LIMIT ?;";
+    sqlite3_stmt *stmt;
+    int ret;
+
+    READ_PREPARE(NULL);
+
+    sqlite3_bind_text(stmt, 1, match, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, cb, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 3, n);
+
+    while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+        ClipporSearchResult *result = g_new(ClipporSearchResult, 1);
+
+        result->id = g_strdup((const char *)sqlite3_column_text(stmt, 0));
+        result->snippet = g_strdup((const char *)sqlite3_column_text(stmt, 1));
+
+        g_ptr_array_add(results, result);
+    }
+
+    if (ret != SQLITE_DONE)
+        STEP_ERROR(NULL);
+
+    RESET(stmt);
+
+    return g_steal_pointer(&results);
+}
+
+/*
+ * Search the text of the entries in clipboard "cb". Returns an array of up to
+ * "n" ClipporSearchResult structs, with the best matches first.
+ */
+GPtrArray *
+clippor_database_search(
+    ClipporDatabase *self, const char *cb, const char *query, int64_t n,
+    GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(error == NULL || *error == NULL);
+
+    DatabaseReader *reader;
+
+    if (!clippor_database_acquire_reader(self, &reader, error))
+        return NULL;
+
+    GPtrArray *results =
+        clippor_database_read_search(self, reader, cb, query, n, error);
+
+    clippor_database_release_reader(self, reader);
+
+    return results;
+}
+
+/*
+ * Load the entry at "index" of clipboard "cb" using "reader", or the writer's
+ * connection if it is NULL. The position of the entry is looked up in the
+ * (Clipboard, Position) index first, so only the entry itself is read from the
+ * table. Index zero is a single seek to the end of the index, while deeper
+ * ones still step over the index entries before them, so history should be
+ * paged through with clippor_database_deserialize_entries() instead.
+ */
+static ClipporEntry *
+clippor_database_read_entry_at_index(
+    ClipporDatabase *self, DatabaseReader *reader, const char *cb,
+    int64_t index, GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(index >= 0);
+    g_assert(error == NULL || *error == NULL);
+
+    g_autoptr(GMutexLocker) locker =
+        reader == NULL ? g_mutex_locker_new(&self->lock) : NULL;
+
+    // Must be read before the snapshot of the reader is taken
+    READ_LOCK();
+    uint64_t generation = self->entry_cache_generation;
+    READ_UNLOCK();
+
+    const char *statement =
+        "SELECT Id, Creation_time, Last_used_time, Flags, Clipboard, Preview, "
+        "Position FROM Entries WHERE Position = ("
+        "   SELECT Position FROM Entries WHERE Clipboard = ? "
+        "   ORDER BY Position DESC LIMIT 1 OFFSET ?"
+        ");";
+    sqlite3_stmt *stmt;
+    int ret;
+
+    READ_PREPARE(NULL);
+
+    sqlite3_bind_text(stmt, 1, cb, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, index);
+
+    ret = sqlite3_step(stmt);
+
+    if (ret == SQLITE_ROW)
+    {
+        READ_LOCK();
+        ClipporEntry *entry = clippor_database_cache_lookup(
+            self, (const char *)sqlite3_column_text(stmt, 0)
+        );
+        READ_UNLOCK();
+
+        if (entry == NULL)
+            entry = clippor_database_load_entry(
+                self, reader, stmt, generation, error
+            );
+
+        RESET(stmt);
+
+        if (entry == NULL)
+            g_prefix_error(
+                error, "Failed loading entry at index %ld for clipboard '%s'",
+                index, cb
+            );
+
+        return entry;
+    }
+    else if (ret == SQLITE_DONE)
+    {
+        g_set_error(
+            error, CLIPPOR_DATABASE_ERROR, CLIPPOR_DATABASE_ERROR_ROW_NOT_EXIST,
+            "No entry exists at index %ld", index
+        );
+    }
+    else
+        STEP_ERROR(NULL);
+
+    RESET(stmt);
+
+    return NULL;
+}
+
+/*
+ * Deserialize entry from database at given index that is associated with
+ * given clipboard label.
+ */
+ClipporEntry *
+clippor_database_deserialize_entry_at_index(
+    ClipporDatabase *self, const char *cb, int64_t index, GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(error == NULL || *error == NULL);
+
+    DatabaseReader *reader;
+
+    if (!clippor_database_acquire_reader(self, &reader, error))
+        return NULL;
+
+    ClipporEntry *entry =
+        clippor_database_read_entry_at_index(self, reader, cb, index, error);
+
+    clippor_database_release_reader(self, reader);
+
+    return entry;
+}
+
+/*
+ * Load the entry with "id" using "reader", or the writer's connection if it is
+ * NULL.
+ */
+static ClipporEntry *
+clippor_database_read_entry_with_id(
+    ClipporDatabase *self, DatabaseReader *reader, const char *id,
+    GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(id != NULL);
+    g_assert(error == NULL || *error == NULL);
+
+    g_autoptr(GMutexLocker) locker =
+        reader == NULL ? g_mutex_locker_new(&self->lock) : NULL;
+
+    READ_LOCK();
+    ClipporEntry *cached = clippor_database_cache_lookup(self, id);
+    uint64_t generation = self->entry_cache_generation;
+    READ_UNLOCK();
+
+    if (cached != NULL)
+        return cached;
+
+    const char *statement =
+        "SELECT Id, Creation_time, Last_used_time, Flags, Clipboard, Preview, "
+        "Position FROM Entries WHERE Id = ?;";
+    sqlite3_stmt *stmt;
+    int ret;
+
+    READ_PREPARE(NULL);
+
+    sqlite3_bind_text(stmt, 1, id, -1, SQLITE_STATIC);
+
+    ret = sqlite3_step(stmt);
+
+    if (ret == SQLITE_ROW)
+    {
+        ClipporEntry *entry =
+            clippor_database_load_entry(self, reader, stmt, generation, error);
+
+        RESET(stmt);
+
+        if (entry == NULL)
+            g_prefix_error(error, "Failed loading entry with id '%s': ", id);
+
+        return entry;
+    }
+    else if (ret == SQLITE_DONE)
+    {
+        g_set_error(
+            error, CLIPPOR_DATABASE_ERROR, CLIPPOR_DATABASE_ERROR_ROW_NOT_EXIST,
+            "No entry exists with id '%s'", id
+        );
+    }
+    else
+        STEP_ERROR(NULL);
+
+    RESET(stmt);
+
+    return NULL;
+}
+
+/*
+ * Deserialize entry from database with matching id.
+ */
+ClipporEntry *
+clippor_database_deserialize_entry_with_id(
+    ClipporDatabase *self, const char *id, GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(error == NULL || *error == NULL);
+
+    DatabaseReader *reader;
+
+    if (!clippor_database_acquire_reader(self, &reader, error))
+        return NULL;
+
+    ClipporEntry *entry =
+        clippor_database_read_entry_with_id(self, reader, id, error);
+
+    clippor_database_release_reader(self, reader);
+
+    return entry;
+}
+
+/*
+ * Load a page of entries of clipboard "cb" using "reader", or the writer's
+ * connection if it is NULL.
+ */
+static GPtrArray *
+clippor_database_read_entries(
+    ClipporDatabase *self, DatabaseReader *reader, const char *cb, int64_t n,
+    int64_t *cursor, GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(cb != NULL);
+    g_assert(n > 0);
+    g_assert(cursor != NULL);
+    g_assert(error == NULL || *error == NULL);
+
+    g_autoptr(GMutexLocker) locker =
+        reader == NULL ? g_mutex_locker_new(&self->lock) : NULL;
+
+    // Rows of the same entry are next to each other since they are ordered by
+    // position.
+    const char *statement =
+        "WITH Page AS ("
+        "   SELECT Position, Id, Creation_time, Last_used_time, Flags, "
+        "   Clipboard, Preview FROM Entries "
+        "   WHERE Clipboard = ? AND Position < ? "
+        "   ORDER BY Position DESC LIMIT ?"
+        ") "
+        "SELECT Page.*, Name, to_data_id(Digest), Contents, Size FROM Page "
+        "LEFT JOIN Entry_mime_types USING (Position) "
+        "LEFT JOIN Mime_type_names USING (Mime_type_id) "
+        "LEFT JOIN Blobs USING (Blob_id) "
+        "ORDER BY Position DESC;";
+    sqlite3_stmt *stmt;
+    int ret;
+
+    READ_PREPARE(NULL);
+
+    sqlite3_bind_text(stmt, 1, cb, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, *cursor == -1 ? G_MAXINT64 : *cursor);
+    sqlite3_bind_int64(stmt, 3, n);
+
+    g_autoptr(GPtrArray) entries =
+        g_ptr_array_new_with_free_func(g_object_unref);
+    ClipporEntry *entry = NULL;
+    int64_t position = -1;
+
+    while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+        int64_t row_position = sqlite3_column_int64(stmt, 0);
+
+        if (row_position != position)
+        {
+            position = row_position;
+            entry = entry_new_from_row(stmt, 1);
+            g_ptr_array_add(entries, entry);
+        }
+
+        // Entry may not have any mime types
+        if (sqlite3_column_type(stmt, 7) == SQLITE_NULL)
+            continue;
+
+        if (!clippor_database_add_mime_type_row(self, entry, stmt, 7, error))
+        {
+            g_prefix_error(
+                error, "Failed loading entries for clipboard '%s': ", cb
+            );
+            RESET(stmt);
+            return NULL;
+        }
+    }
+
+    if (ret != SQLITE_DONE)
+        STEP_ERROR(NULL);
+
+    RESET(stmt);
+
+    for (uint i = 0; i < entries->len; i++)
+        clippor_entry_set_database(entries->pdata[i], self);
+
+    // If we got less than requested, then there are no more entries left
+    *cursor = (int64_t)entries->len < n ? -1 : position;
+
+    return g_steal_pointer(&entries);
+}
+
+/*
+ * Return an array of up to "n" entries of clipboard "cb", from most recent to
+ * oldest, loaded together with their mime types in a single query. "cursor"
+ * should point to -1 to start from the most recent entry. On return it is set
+ * to where the next page starts, or -1 if there are no more entries. Paging
+ * is done using the position of the entries, so every page costs the same.
+ */
+GPtrArray *
+clippor_database_deserialize_entries(
+    ClipporDatabase *self, const char *cb, int64_t n, int64_t *cursor,
+    GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(error == NULL || *error == NULL);
+
+    DatabaseReader *reader;
+
+    if (!clippor_database_acquire_reader(self, &reader, error))
+        return NULL;
+
+    GPtrArray *entries =
+        clippor_database_read_entries(self, reader, cb, n, cursor, error);
+
+    clippor_database_release_reader(self, reader);
+
+    return entries;
+}
+
+/*
+ * Run a single statement that doesn't return any rows.
+ */
+static gboolean
+clippor_database_exec(
+    ClipporDatabase *self, const char *statement, GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(statement != NULL);
+    g_assert(error == NULL || *error == NULL);
+
+    int ret;
+
+    EXEC(FALSE);
+
+    return TRUE;
+}
+
+/*
+ * Remove the stored data for each data id in "data_ids". Should only be called
+ * after the rows for them have been removed from the Blobs table.
+ */
+static void
+clippor_database_remove_data(ClipporDatabase *self, GPtrArray *data_ids)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(data_ids != NULL);
+
+    for (uint i = 0; i < data_ids->len; i++)
+        clippor_database_remove_data_file(self, data_ids->pdata[i]);
+}
+
+/*
+ * Remove data rows that are not referenced anymore. Only data that is stored
+ * outside the database needs to be removed afterwards, so only those ids are
+ * added to "removed". If "freed" is not NULL, the size of the removed data is
+ * added to it. Must be called inside a transaction.
+ */
+static gboolean
+clippor_database_remove_unreferenced(
+    ClipporDatabase *self, GPtrArray *removed, uint64_t *freed, GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(removed != NULL);
+    g_assert(error == NULL || *error == NULL);
+
+    const char *statement =
+        "DELETE FROM Blobs WHERE Ref_count <= 0 "
+        "RETURNING to_data_id(Digest), Contents IS NULL AND Segment IS NULL, "
+        "Size;";
+    sqlite3_stmt *stmt;
+    int ret;
+
+    PREPARE(FALSE);
+
+    while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+        if (sqlite3_column_int(stmt, 1))
+            g_ptr_array_add(
+                removed, g_strdup((const char *)sqlite3_column_text(stmt, 0))
+            );
+        if (freed != NULL)
+            *freed += sqlite3_column_int64(stmt, 2);
+    }
+
+    if (ret != SQLITE_DONE)
+        STEP_ERROR(FALSE);
+    RESET(stmt);
+
+    return TRUE;
+}
+
+/*
+ * Remove every entry whose id is in the Trimmed table, along with its mime
+ * types and data references. The ids of data that are no longer referenced are
+ * added to "removed". Must be called inside a transaction.
+ */
+static gboolean
+clippor_database_remove_trimmed(
+    ClipporDatabase *self, GPtrArray *removed, GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(removed != NULL);
+    g_assert(error == NULL || *error == NULL);
+
+    // Drop the data references held by every mime type of the entries, then
+    // remove the mime types and entries themselves.
+    if (!clippor_database_exec(
+            self,
+            "UPDATE Blobs SET Ref_count = Ref_count - t.Count "
+            "FROM ("
+            "   SELECT Blob_id, COUNT(*) AS Count "
+            "   FROM temp.Trimmed CROSS JOIN Entry_mime_types USING (Position) "
+            "   GROUP BY Blob_id"
+            ") AS t WHERE Blobs.Blob_id = t.Blob_id;",
+            error
+        ) ||
+        !clippor_database_exec(
+            self,
+            "DELETE FROM Entry_mime_types "
+            "WHERE Position IN (SELECT Position FROM temp.Trimmed);",
+            error
+        ) ||
+        !clippor_database_exec(
+            self,
+            "DELETE FROM Search "
+            "WHERE rowid IN (SELECT Position FROM temp.Trimmed);",
+            error
+        ) ||
+        !clippor_database_exec(
+            self,
+            "DELETE FROM Entries "
+            "WHERE Position IN (SELECT Position FROM temp.Trimmed);",
+            error
+        ))
+        return FALSE;
+
+    const char *statement = "DELETE FROM temp.Trimmed RETURNING Id;";
+    sqlite3_stmt *stmt;
+    int ret;
+
+    PREPARE(FALSE);
+
+    while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+        clippor_database_cache_invalidate(
+            self, (const char *)sqlite3_column_text(stmt, 0)
+        );
+
+    if (ret != SQLITE_DONE)
+        STEP_ERROR(FALSE);
+    RESET(stmt);
+
+    return clippor_database_remove_unreferenced(self, removed, NULL, error);
+}
+
+/*
+ * Add the entries selected by "statement" to the Trimmed table and remove them
+ * from the database. "text" is bound to the first parameter and "n" to the
+ * second one, if they are not NULL and -1 respectively. Returns the number of
+ * entries removed, or -1 on error.
+ */
+static int64_t
+clippor_database_remove_entries(
+    ClipporDatabase *self, const char *statement, const char *text, int64_t n,
+    GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(statement != NULL);
+    g_assert(error == NULL || *error == NULL);
+
+    const char *select_statement = statement;
+    sqlite3_stmt *stmt;
+    int64_t changes = 0;
+    int ret;
+
+    statement = "BEGIN TRANSACTION;";
+
+    EXEC(-1);
+
+    g_autoptr(GPtrArray) removed = g_ptr_array_new_with_free_func(g_free);
+
+    statement = select_statement;
+    stmt = clippor_database_get_statement(self, statement, error);
+
+    if (stmt == NULL)
+        goto fail;
+
+    if (text != NULL)
+        sqlite3_bind_text(stmt, 1, text, -1, SQLITE_STATIC);
+    if (n != -1)
+        sqlite3_bind_int64(stmt, 2, n);
+
+    ret = sqlite3_step(stmt);
+    RESET(stmt);
+
+    if (ret != SQLITE_DONE)
+    {
+        g_set_error(
+            error, CLIPPOR_DATABASE_ERROR, CLIPPOR_DATABASE_ERROR_STEP,
+            "Failed stepping statement '%s': %s", statement,
+            sqlite3_errmsg(self->handle)
+        );
+        goto fail;
+    }
+
+    changes = sqlite3_changes(self->handle);
+
+    if (changes > 0 && !clippor_database_remove_trimmed(self, removed, error))
+        goto fail;
+
+    gboolean f_ret = TRUE;
+
+    if (FALSE)
+fail:
+        f_ret = FALSE;
+
+    f_ret = clippor_database_end_transaction(self, f_ret, error);
+
+    // Only remove the data once we know the rows are gone for good
+    if (f_ret && removed->len > 0)
+    {
+        g_debug("Removing %u unreferenced data", removed->len);
+        clippor_database_remove_data(self, removed);
+    }
+
+    return f_ret ? changes : -1;
+}
+
+/*
+ * Remove older entries for clipboard "cb" in the database until "n" entries
+ * are left. All surplus entries, their mime types and data references are
+ * removed using a fixed number of statements, then the data that is no longer
+ * referenced is removed in one batch after the transaction is committed. The
+ * number of entries of each clipboard is kept by triggers, so the surplus ones
+ * are found starting from the oldest entry.
+ */
+gboolean
+clippor_database_trim_entries(
+    ClipporDatabase *self, const char *cb, int64_t n, GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(cb != NULL);
+    g_assert(n >= 0);
+    g_assert(error == NULL || *error == NULL);
+
+    g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&self->lock);
+
+    if (!clippor_database_wait_compacted(self, error))
+        return FALSE;
+
+    // Collect ids of every entry past the first "n" ones. A negative limit
+    // means no limit, so it must not go below zero.
+    int64_t ret = clippor_database_remove_entries(
+        self,
+        "INSERT INTO temp.Trimmed (Position, Id) "
+        "SELECT Position, Id FROM Entries WHERE Clipboard = ?1 "
+        "ORDER BY Position LIMIT MAX(IFNULL(("
+        "   SELECT Count FROM Clipboard_sizes WHERE Clipboard = ?1"
+        "), 0) - ?2, 0);",
+        cb, n, error
+    );
+
+    if (ret == -1)
+    {
+        g_prefix_error(error, "Failed trimming clipboard '%s': ", cb);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+// Maximum number of entries removed by one step of trimming
+#define TRIM_BATCH 256
+
+/*
+ * Remove up to TRIM_BATCH of the oldest entries of clipboard "cb" that are past
+ * the first "n" ones. Returns the number of entries removed, which is less
+ * than TRIM_BATCH once the clipboard is trimmed, or -1 on error.
+ */
+static int64_t
+clippor_database_trim_entries_step(
+    ClipporDatabase *self, const char *cb, int64_t n, GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(cb != NULL);
+    g_assert(n >= 0);
+    g_assert(error == NULL || *error == NULL);
+
+    g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&self->lock);
+
+    if (!clippor_database_wait_compacted(self, error))
+        return -1;
+
+    // Same as clippor_database_trim_entries(), so only the entries that are
+    // removed are looked at.
+    int64_t ret = clippor_database_remove_entries(
+        self,
+        "INSERT INTO temp.Trimmed (Position, Id) "
+        "SELECT Position, Id FROM Entries WHERE Clipboard = ?1 "
+        "ORDER BY Position LIMIT MIN(MAX(IFNULL(("
+        "   SELECT Count FROM Clipboard_sizes WHERE Clipboard = ?1"
+        "), 0) - ?2, 0), " G_STRINGIFY(TRIM_BATCH) ");",
+        cb, n, error
+    );
+
+    if (ret == -1)
+        g_prefix_error(error, "Failed trimming clipboard '%s': ", cb);
+
+    return ret;
+}
+
+// Statements that filter entries by their flags, and the index on sensitive
+// entries, use these values directly
+G_STATIC_ASSERT(CLIPPOR_ENTRY_FLAG_STARRED == 1);
+G_STATIC_ASSERT(CLIPPOR_ENTRY_FLAG_SENSITIVE == 2);
+
+/*
+ * Remove the oldest unstarred entries of clipboard "cb" until the total size of
+ * its entries is "max_bytes" or less. Its most recent entry is never removed,
+ * even if it is larger than that on its own. The total is kept up to date by
+ * triggers, so only the entries that are removed and the starred ones between
+ * them are looked at.
+ */
+static gboolean
+clippor_database_trim_size(
+    ClipporDatabase *self, const char *cb, int64_t max_bytes, GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(cb != NULL);
+    g_assert(max_bytes > 0);
+    g_assert(error == NULL || *error == NULL);
+
+    g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&self->lock);
+
+    if (!clippor_database_wait_compacted(self, error))
+        return FALSE;
+
+    const char *statement =
+        "SELECT Size FROM Clipboard_sizes WHERE Clipboard = ?;";
+    sqlite3_stmt *stmt;
+    int64_t excess = 0;
+    int ret;
+
+    PREPARE(FALSE);
+
+    sqlite3_bind_text(stmt, 1, cb, -1, SQLITE_STATIC);
+
+    if ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+        excess = sqlite3_column_int64(stmt, 0) - max_bytes;
+    else if (ret != SQLITE_DONE)
+        STEP_ERROR(FALSE);
+    RESET(stmt);
+
+    if (excess <= 0)
+        return TRUE;
+
+    // Find the newest entry that has to go, starting from the oldest one
+    statement =
+        "SELECT Position, Size FROM Entries "
+        "WHERE Clipboard = ?1 AND Flags & ?2 = 0 AND Position < ("
+        "   SELECT MAX(Position) FROM Entries WHERE Clipboard = ?1"
+        ") ORDER BY Position;";
+    int64_t last = -1;
+
+    PREPARE(FALSE);
+
+    sqlite3_bind_text(stmt, 1, cb, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, CLIPPOR_ENTRY_FLAG_STARRED);
+
+    while (excess > 0 && (ret = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+        last = sqlite3_column_int64(stmt, 0);
+        excess -= sqlite3_column_int64(stmt, 1);
+    }
+
+    if (excess > 0 && ret != SQLITE_DONE)
+        STEP_ERROR(FALSE);
+    RESET(stmt);
+
+    if (last == -1)
+        return TRUE;
+
+    int64_t removed = clippor_database_remove_entries(
+        self,
+        "INSERT INTO temp.Trimmed (Position, Id) "
+        "SELECT Position, Id FROM Entries "
+        "WHERE Clipboard = ? AND Position <= ? AND Flags & 1 = 0;",
+        cb, last, error
+    );
+
+    if (removed == -1)
+    {
+        g_prefix_error(error, "Failed trimming clipboard '%s': ", cb);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/*
+ * Set "time" to the first column of the row "statement" selects for clipboard
+ * "cb", or -1 if there is none.
+ */
+static gboolean
+clippor_database_get_oldest(
+    ClipporDatabase *self, const char *statement, const char *cb,
+    int64_t *time, GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(statement != NULL);
+    g_assert(cb != NULL);
+    g_assert(time != NULL);
+    g_assert(error == NULL || *error == NULL);
+
+    sqlite3_stmt *stmt;
+    int ret;
+
+    PREPARE(FALSE);
+
+    sqlite3_bind_text(stmt, 1, cb, -1, SQLITE_STATIC);
+
+    if ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+        *time = sqlite3_column_int64(stmt, 0);
+    else if (ret == SQLITE_DONE)
+        *time = -1;
+    else
+        STEP_ERROR(FALSE);
+    RESET(stmt);
+
+    return TRUE;
+}
+
+/*
+ * Remove the unstarred entries of clipboard "cb" that were last used more than
+ * "max_age" microseconds ago, and the sensitive ones that were last used more
+ * than "sensitive_age" ago. Either may be zero for no limit. Promoting an entry
+ * updates its last used time, so copying the same contents again starts its
+ * age over. The most recent entry is never removed. Last used times are
+ * indexed, so only the entries that expired are looked at. Returns the time at
+ * which the next entry expires, zero if none will, or -1 on error.
+ */
+int64_t
+clippor_database_expire_entries(
+    ClipporDatabase *self, const char *cb, int64_t max_age,
+    int64_t sensitive_age, GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(cb != NULL);
+    g_assert(max_age >= 0);
+    g_assert(sensitive_age >= 0);
+    g_assert(error == NULL || *error == NULL);
+
+    g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&self->lock);
+
+    if (!clippor_database_wait_compacted(self, error))
+        return -1;
+
+    int64_t now = g_get_real_time(), next = 0, oldest;
+
+    // The most recent entry is left alone, since it may still be the selection
+    if (max_age > 0)
+    {
+        if (clippor_database_remove_entries(
+                self,
+                "INSERT INTO temp.Trimmed (Position, Id) "
+                "SELECT Position, Id FROM Entries "
+                "WHERE Clipboard = ?1 AND Last_used_time <= ?2 "
+                "AND Flags & 1 = 0 AND Position < ("
+                "   SELECT MAX(Position) FROM Entries WHERE Clipboard = ?1"
+                ");",
+                cb, now - max_age, error
+            ) == -1 ||
+            !clippor_database_get_oldest(
+                self,
+                "SELECT Last_used_time FROM Entries "
+                "WHERE Clipboard = ?1 AND Flags & 1 = 0 AND Position < ("
+                "   SELECT MAX(Position) FROM Entries WHERE Clipboard = ?1"
+                ") ORDER BY Last_used_time LIMIT 1;",
+                cb, &oldest, error
+            ))
+            goto fail;
+
+        if (oldest != -1)
+            next = oldest + max_age;
+    }
+
+    if (sensitive_age > 0)
+    {
+        if (clippor_database_remove_entries(
+                self,
+                "INSERT INTO temp.Trimmed (Position, Id) "
+                "SELECT Position, Id FROM Entries "
+                "WHERE Clipboard = ?1 AND Last_used_time <= ?2 "
+                "AND Flags & 2 != 0 AND Flags & 1 = 0 AND Position < ("
+                "   SELECT MAX(Position) FROM Entries WHERE Clipboard = ?1"
+                ");",
+                cb, now - sensitive_age, error
+            ) == -1 ||
+            !clippor_database_get_oldest(
+                self,
+                "SELECT Last_used_time FROM Entries "
+                "WHERE Clipboard = ?1 AND Flags & 2 != 0 AND Flags & 1 = 0 "
+                "AND Position < ("
+                "   SELECT MAX(Position) FROM Entries WHERE Clipboard = ?1"
+                ") ORDER BY Last_used_time LIMIT 1;",
+                cb, &oldest, error
+            ))
+            goto fail;
+
+        if (oldest != -1 && (next == 0 || oldest + sensitive_age < next))
+            next = oldest + sensitive_age;
+    }
+
+    return next;
+fail:
+    g_prefix_error(error, "Failed expiring entries of clipboard '%s': ", cb);
+    return -1;
+}
+
+/*
+ * Add a new entry to the database and trim its clipboard to "max_entries", and
+ * to "max_bytes" unless it is zero. If an entry with the same contents already
+ * exists, it is promoted instead using clippor_database_promote_entry(), and
+ * no trimming is needed. At most TRIM_BATCH entries are trimmed, so that a
+ * lowered "max_entries" doesn't make this take long. The rest is left for
+ * clippor_database_trim_entries_async().
+ */
+gboolean
+clippor_database_add_entry(
+    ClipporDatabase *self, ClipporEntry *entry, int64_t max_entries,
+    int64_t max_bytes, GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(CLIPPOR_IS_ENTRY(entry));
+    g_assert(max_entries >= 0);
+    g_assert(max_bytes >= 0);
+    g_assert(error == NULL || *error == NULL);
+
+    int ret = clippor_database_promote_entry(self, entry, error);
+
+    if (ret == -1)
+        return FALSE;
+    else if (ret == 1)
+        return TRUE;
+
+    const char *cb = clippor_entry_get_clipboard(entry);
+
+    return clippor_database_serialize_entry(self, entry, error) &&
+           clippor_database_trim_entries_step(self, cb, max_entries, error) !=
+               -1 &&
+           (max_bytes == 0 ||
+            clippor_database_trim_size(self, cb, max_bytes, error));
+}
+
+/*
+ * Remove entry with matching id from the database.
+ */
+gboolean
+clippor_database_delete_entry(
+    ClipporDatabase *self, const char *id, GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(id != NULL);
+    g_assert(error == NULL || *error == NULL);
+
+    g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&self->lock);
+
+    if (!clippor_database_wait_compacted(self, error))
+        return FALSE;
+
+    int64_t ret = clippor_database_remove_entries(
+        self,
+        "INSERT INTO temp.Trimmed (Position, Id) "
+        "SELECT Position, Id FROM Entries WHERE Id = ?;",
+        id, -1, error
+    );
+
+    if (ret == -1)
+    {
+        g_prefix_error(error, "Failed deleting entry with id '%s': ", id);
+        return FALSE;
+    }
+    else if (ret == 0)
+    {
+        g_set_error(
+            error, CLIPPOR_DATABASE_ERROR, CLIPPOR_DATABASE_ERROR_ROW_NOT_EXIST,
+            "No entry exists with id '%s'", id
+        );
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+#define GC_BATCH_SIZE 256
+#define GC_STEP_TIME (2 * G_TIME_SPAN_MILLISECOND)
+
+/*
+ * Set the reference count of the next GC_BATCH_SIZE data rows after the
+ * cursor to the number of mime types that use them, then remove the ones that
+ * are not used by any. Returns 1 once every row has been checked, 0 if there
+ * are more, and -1 on error.
+ */
+static int
+clippor_database_gc_repair_refcounts(
+    ClipporDatabase *self, DatabaseGC *gc, GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(gc != NULL);
+    g_assert(error == NULL || *error == NULL);
+
+    const char *statement = "SELECT MAX(Blob_id) FROM ("
+                            "   SELECT Blob_id FROM Blobs WHERE Blob_id > ? "
+                            "   ORDER BY Blob_id LIMIT ?"
+                            ");";
+    sqlite3_stmt *stmt;
+    int ret;
+
+    PREPARE(-1);
+
+    sqlite3_bind_int64(stmt, 1, gc->cursor);
+    sqlite3_bind_int(stmt, 2, GC_BATCH_SIZE);
+
+    if ((ret = sqlite3_step(stmt)) != SQLITE_ROW)
+        STEP_ERROR(-1);
+
+    gboolean done = sqlite3_column_type(stmt, 0) == SQLITE_NULL;
+    int64_t last = sqlite3_column_int64(stmt, 0);
+
+    RESET(stmt);
+
+    if (done)
+        return 1;
+
+    statement = "BEGIN TRANSACTION;";
+    EXEC(-1);
+
+    g_autoptr(GPtrArray) removed = g_ptr_array_new_with_free_func(g_free);
+    uint64_t freed = 0;
+
+    statement = "UPDATE Blobs SET Ref_count = t.Count "
+                "FROM ("
+                "   SELECT Blob_id, ("
+                "       SELECT COUNT(*) FROM Entry_mime_types AS m "
+                "       WHERE m.Blob_id = b.Blob_id"
+                "   ) AS Count "
+                "   FROM Blobs AS b WHERE Blob_id > ? AND Blob_id <= ?"
+                ") AS t "
+                "WHERE Blobs.Blob_id = t.Blob_id AND Ref_count != t.Count;";
+    stmt = clippor_database_get_statement(self, statement, error);
+
+    if (stmt == NULL)
+        goto fail;
+
+    sqlite3_bind_int64(stmt, 1, gc->cursor);
+    sqlite3_bind_int64(stmt, 2, last);
+
+    ret = sqlite3_step(stmt);
+    RESET(stmt);
+
+    if (ret != SQLITE_DONE)
+    {
+        g_set_error(
+            error, CLIPPOR_DATABASE_ERROR, CLIPPOR_DATABASE_ERROR_STEP,
+            "Failed stepping statement '%s': %s", statement,
+            sqlite3_errmsg(self->handle)
+        );
+        goto fail;
+    }
+
+    int changes = sqlite3_changes(self->handle);
+
+    if (changes > 0)
+        g_debug("Repaired reference count of %d data", changes);
+
+    if (!clippor_database_remove_unreferenced(self, removed, &freed, error))
+        goto fail;
+
+    gboolean f_ret = TRUE;
+
+    if (FALSE)
+fail:
+        f_ret = FALSE;
+
+    f_ret = clippor_database_end_transaction(self, f_ret, error);
+
+    if (!f_ret)
+        return -1;
+
+    clippor_database_remove_data(self, removed);
+
+    gc->reclaimed += freed;
+    gc->cursor = last;
+
+    return 0;
+}
+
+/*
+ * Remove the file "name" in the data directory if there is no data row that
+ * refers to it. Returns -1 on error.
+ */
+static int
+clippor_database_gc_check_file(
+    ClipporDatabase *self, DatabaseGC *gc, const char *name, GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(gc != NULL);
+    g_assert(name != NULL);
+    g_assert(error == NULL || *error == NULL);
+
+    const char *statement =
+        "SELECT 1 FROM Blobs "
+        "WHERE Digest = to_digest(?) AND Contents IS NULL "
+        "AND Segment IS NULL;";
+    sqlite3_stmt *stmt;
+    int ret;
+
+    PREPARE(-1);
+
+    sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+
+    ret = sqlite3_step(stmt);
+
+    if (ret != SQLITE_ROW && ret != SQLITE_DONE)
+        STEP_ERROR(-1);
+    RESET(stmt);
+
+    if (ret == SQLITE_ROW)
+        return 0;
+
+    g_autofree char *path =
+        g_strdup_printf("%s/data/%s", self->location_dir, name);
+    GStatBuf st;
+
+    if (g_stat(path, &st) == 0 && g_unlink(path) == 0)
+    {
+        g_debug("Removed orphaned data file '%s'", name);
+        gc->reclaimed += st.st_size;
+    }
+
+    return 0;
+}
+
+/*
+ * Do a single step of garbage collection, which runs until GC_STEP_TIME has
+ * passed or the current phase is finished. First the reference count of every
+ * data row is repaired, then files in the data directory that no row refers to
+ * are removed. Returns 1 once garbage collection is complete, 0 if there is
+ * more to do, and -1 on error.
+ */
+static int
+clippor_database_gc_step(ClipporDatabase *self, DatabaseGC *gc, GError **error)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(gc != NULL);
+    g_assert(error == NULL || *error == NULL);
+
+    g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&self->lock);
+
+    if (!clippor_database_wait_compacted(self, error))
+        return -1;
+    int64_t deadline = g_get_monotonic_time() + GC_STEP_TIME;
+
+    if (gc->phase == GC_PHASE_REFCOUNTS)
+    {
+        do
+        {
+            int ret = clippor_database_gc_repair_refcounts(self, gc, error);
+
+            if (ret == -1)
+                return -1;
+            else if (ret == 1)
+            {
+                gc->phase = GC_PHASE_FILES;
+                break;
+            }
+        } while (g_get_monotonic_time() < deadline);
+
+        return 0;
+    }
+
+    // Data in memory is removed together with its row, so there is nothing
+    // that can be left behind.
+    if (self->flags & CLIPPOR_DATABASE_IN_MEMORY)
+        return 1;
+
+    if (gc->dir == NULL)
+    {
+        g_autofree char *data_dir_path =
+            g_strdup_printf("%s/data", self->location_dir);
+        g_autoptr(GError) dir_error = NULL;
+
+        gc->dir = g_dir_open(data_dir_path, 0, &dir_error);
+
+        if (gc->dir == NULL)
+        {
+            // Nothing has been stored in a file yet
+            if (g_error_matches(dir_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+                return 1;
+
+            g_propagate_error(error, g_steal_pointer(&dir_error));
+            return -1;
+        }
+    }
+
+    do
+    {
+        const char *name = g_dir_read_name(gc->dir);
+
+        if (name == NULL)
+            return 1;
+
+        if (clippor_database_gc_check_file(self, gc, name, error) == -1)
+            return -1;
+    } while (g_get_monotonic_time() < deadline);
+
+    return 0;
+}
+
+/*
+ * Repair the reference counts of data, and remove data that isn't referenced
+ * anymore along with files in the data directory that don't belong to any
+ * data. Returns the number of bytes reclaimed, or -1 on error.
+ */
+int64_t
+clippor_database_collect_garbage(ClipporDatabase *self, GError **error)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(error == NULL || *error == NULL);
+
+    DatabaseGC gc = {.phase = GC_PHASE_REFCOUNTS, .cursor = 0};
+    int ret;
+
+    while ((ret = clippor_database_gc_step(self, &gc, error)) == 0)
+        ;
+
+    g_clear_pointer(&gc.dir, g_dir_close);
+
+    if (ret == -1)
+    {
+        g_prefix_error_literal(error, "Failed collecting garbage: ");
+        return -1;
+    }
+
+    return gc.reclaimed;
+}
+
+#define MAINTENANCE_IDLE_TIME (30 * G_TIME_SPAN_SECOND)
+#define MAINTENANCE_STEP_TIME (5 * G_TIME_SPAN_MILLISECOND)
+
+/*
+ * Copy as much of the WAL file back into the database as possible without
+ * waiting for readers. Must be called with the lock held, which is released
+ * while checkpointing, since copying a large WAL file and syncing the database
+ * can take a while. A connection of its own is used for it, so that the handle
+ * can be used in the meantime. Returns the number of pages checkpointed, or -1
+ * on error.
+ */
+static int64_t
+clippor_database_checkpoint(ClipporDatabase *self, GError **error)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(error == NULL || *error == NULL);
+
+    // There is no WAL file, and another connection would not even open the
+    // same database.
+    if (self->flags & CLIPPOR_DATABASE_IN_MEMORY)
+        return 0;
+
+    int ret;
+
+    if (self->checkpointer == NULL)
+    {
+        ret = sqlite3_open_v2(
+            self->location, &self->checkpointer,
+            SQLITE_OPEN_READWRITE | SQLITE_OPEN_FULLMUTEX, NULL
+        );
+
+        if (ret != SQLITE_OK)
+        {
+            g_set_error(
+                error, CLIPPOR_DATABASE_ERROR, CLIPPOR_DATABASE_ERROR_OPEN,
+                "Failed opening database for checkpointing: %s",
+                sqlite3_errmsg(self->checkpointer)
+            );
+            g_clear_pointer(&self->checkpointer, sqlite3_close);
+            return -1;
+        }
+    }
+
+    int log, checkpointed;
+
+    g_mutex_unlock(&self->lock);
+    ret = sqlite3_wal_checkpoint_v2(
+        self->checkpointer, NULL, SQLITE_CHECKPOINT_PASSIVE, &log,
+        &checkpointed
+    );
+    g_mutex_lock(&self->lock);
+
+    if (ret != SQLITE_OK)
+    {
+        g_set_error(
+            error, CLIPPOR_DATABASE_ERROR, CLIPPOR_DATABASE_ERROR_EXEC,
+            "Failed checkpointing database: %s",
+            sqlite3_errmsg(self->checkpointer)
+        );
+        return -1;
+    }
+
+    // Both are -1 if the database is not in WAL mode
+    return MAX(checkpointed, 0);
+}
+
+/*
+ * Give free pages back to the filesystem until there are none left or
+ * "deadline" is reached. "done" is set to TRUE if there are no free pages left.
+ * Returns the number of pages freed, or -1 on error.
+ */
+static int64_t
+clippor_database_incremental_vacuum(
+    ClipporDatabase *self, int64_t deadline, gboolean *done, GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(done != NULL);
+    g_assert(error == NULL || *error == NULL);
+
+    const char *statement = "PRAGMA incremental_vacuum;";
+    sqlite3_stmt *stmt;
+    int64_t pages = 0;
+    int ret;
+
+    PREPARE(-1);
+
+    // Each step frees a single page
+    while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+        pages++;
+
+        if (g_get_monotonic_time() >= deadline)
+            break;
+    }
+
+    if (ret != SQLITE_ROW && ret != SQLITE_DONE)
+        STEP_ERROR(-1);
+    RESET(stmt);
+
+    *done = ret == SQLITE_DONE;
+
+    return pages;
+}
+
+// Segments with less than this fraction of their bytes still live are compacted
+#define PACK_COMPACT_RATIO 0.5
+#define PACK_COMPACT_BATCH 64
+
+typedef struct
+{
+    int64_t blob_id;
+    int64_t offset;
+    int64_t size;
+} PackedBlob;
+
+/*
+ * Move the live data of the segment with the smallest fraction of live bytes
+ * to the current segment until "deadline" is reached, if that fraction is
+ * below PACK_COMPACT_RATIO. Segments without any live data are removed. "done"
+ * is set to TRUE once there is nothing left to compact. Returns the number of
+ * bytes moved, or -1 on error.
+ */
+static int64_t
+clippor_database_compact_segments(
+    ClipporDatabase *self, int64_t deadline, gboolean *done, GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(done != NULL);
+    g_assert(error == NULL || *error == NULL);
+
+    *done = TRUE;
+
+    if (self->pack == NULL)
+        return 0;
+
+    int64_t current = clippor_pack_get_current_segment(self->pack);
+    g_autoptr(GArray) removed = g_array_new(FALSE, FALSE, sizeof(int64_t));
+    g_autoptr(GArray) blobs = g_array_new(FALSE, FALSE, sizeof(PackedBlob));
+    int64_t moved = 0, segment = -1;
+
+    const char *statement = "BEGIN TRANSACTION;";
+    sqlite3_stmt *stmt;
+    int ret;
+
+    EXEC(-1);
+
+    // Segments that nothing lives in anymore can just be removed
+    statement = "DELETE FROM Segments WHERE Live <= 0 AND Segment_id != ? "
+                "RETURNING Segment_id;";
+    stmt = clippor_database_get_statement(self, statement, error);
+
+    if (stmt == NULL)
+        goto fail;
+
+    sqlite3_bind_int64(stmt, 1, current);
+
+    while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+        int64_t id = sqlite3_column_int64(stmt, 0);
+
+        g_array_append_val(removed, id);
+    }
+    RESET(stmt);
+
+    if (ret != SQLITE_DONE)
+        goto step_fail;
+
+    statement = "SELECT Segment_id FROM Segments "
+                "WHERE Segment_id != ? "
+                "AND Live < Size * " G_STRINGIFY(PACK_COMPACT_RATIO) " "
+                "ORDER BY Live * 1.0 / Size LIMIT 1;";
+    stmt = clippor_database_get_statement(self, statement, error);
+
+    if (stmt == NULL)
+        goto fail;
+
+    sqlite3_bind_int64(stmt, 1, current);
+
+    if ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+        segment = sqlite3_column_int64(stmt, 0);
+    RESET(stmt);
+
+    if (ret != SQLITE_ROW && ret != SQLITE_DONE)
+        goto step_fail;
+
+    statement = "SELECT Blob_id, Segment_offset, Size FROM Blobs "
+                "WHERE Segment = ? LIMIT " G_STRINGIFY(PACK_COMPACT_BATCH) ";";
+
+    while (segment != -1 && g_get_monotonic_time() < deadline)
+    {
+        stmt = clippor_database_get_statement(self, statement, error);
+
+        if (stmt == NULL)
+            goto fail;
+
+        sqlite3_bind_int64(stmt, 1, segment);
+
+        // Rows are collected first, since moving them changes their segment
+        g_array_set_size(blobs, 0);
+
+        while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+        {
+            PackedBlob blob = {
+                .blob_id = sqlite3_column_int64(stmt, 0),
+                .offset = sqlite3_column_int64(stmt, 1),
+                .size = sqlite3_column_int64(stmt, 2)
+            };
+
+            g_array_append_val(blobs, blob);
+        }
+        RESET(stmt);
+
+        if (ret != SQLITE_DONE)
+            goto step_fail;
+        if (blobs->len == 0)
+            break;
+
+        // Once its data is moved, the segment is removed in the next step
+        *done = FALSE;
+
+        for (uint i = 0; i < blobs->len; i++)
+        {
+            PackedBlob *blob = &g_array_index(blobs, PackedBlob, i);
+            g_autoptr(GBytes) bytes = clippor_pack_read(
+                self->pack, segment, blob->offset, blob->size, error
+            );
+
+            if (bytes == NULL ||
+                !clippor_database_pack_data(self, blob->blob_id, bytes, error))
+                goto fail;
+
+            moved += blob->size;
+        }
+    }
+
+    // Moved data must be durable before the old copies can be removed
+    if (!clippor_pack_sync(self->pack, error))
+        goto fail;
+
+    gboolean f_ret = TRUE;
+
+    if (FALSE)
+    {
+step_fail:
+        g_set_error(
+            error, CLIPPOR_DATABASE_ERROR, CLIPPOR_DATABASE_ERROR_STEP,
+            "Failed stepping statement '%s': %s", statement,
+            sqlite3_errmsg(self->handle)
+        );
+fail:
+        f_ret = FALSE;
+    }
+
+    f_ret = clippor_database_end_transaction(self, f_ret, error);
+
+    if (!f_ret)
+        return -1;
+
+    for (uint i = 0; i < removed->len; i++)
+        clippor_pack_remove_segment(
+            self->pack, g_array_index(removed, int64_t, i)
+        );
+
+    return moved;
+}
+
+/*
+ * Run a single maintenance step, then set "step" to the one that should be run
+ * next. Steps are bounded by MAINTENANCE_STEP_TIME where possible, so that
+ * other jobs aren't delayed by much.
+ */
+static gboolean
+clippor_database_maintain(
+    ClipporDatabase *self, MaintenanceStep *step, GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(step != NULL);
+    g_assert(error == NULL || *error == NULL);
+
+    g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&self->lock);
+
+    if (!clippor_database_wait_compacted(self, error))
+        return FALSE;
+
+    int64_t start = g_get_monotonic_time();
+    ClipporDatabaseMaintenanceStats *stats;
+    int64_t pages = 0;
+    gboolean done = FALSE;
+
+    switch (*step)
+    {
+    case MAINTENANCE_CHECKPOINT:
+        stats = &self->stats.checkpoint;
+        pages = clippor_database_checkpoint(self, error);
+        *step = MAINTENANCE_PACK;
+        break;
+    case MAINTENANCE_PACK:
+        stats = &self->stats.pack;
+        pages = clippor_database_compact_segments(
+            self, start + MAINTENANCE_STEP_TIME, &done, error
+        );
+        if (done)
+            *step = MAINTENANCE_VACUUM;
+        break;
+    case MAINTENANCE_VACUUM:
+        stats = &self->stats.vacuum;
+        pages = clippor_database_incremental_vacuum(
+            self, start + MAINTENANCE_STEP_TIME, &done, error
+        );
+        if (done)
+            *step = MAINTENANCE_OPTIMIZE;
+        break;
+    case MAINTENANCE_OPTIMIZE:
+        stats = &self->stats.optimize;
+        if (!clippor_database_exec(self, "PRAGMA optimize;", error))
+            pages = -1;
+        *step = MAINTENANCE_DONE;
+        break;
+    default:
+        g_assert_not_reached();
+    }
+
+    if (pages == -1)
+    {
+        *step = MAINTENANCE_DONE;
+        return FALSE;
+    }
+
+    stats->runs++;
+    stats->time += g_get_monotonic_time() - start;
+    stats->pages += pages;
+
+    return TRUE;
+}
+
+/*
+ * Checkpoint the WAL file, compact segments, give free pages back to the
+ * filesystem and let SQLite update its statistics. This is normally done in
+ * the writer thread once no jobs have been queued for MAINTENANCE_IDLE_TIME.
+ */
+gboolean
+clippor_database_run_maintenance(ClipporDatabase *self, GError **error)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(error == NULL || *error == NULL);
+
+    MaintenanceStep step = MAINTENANCE_CHECKPOINT;
+
+    while (step != MAINTENANCE_DONE)
+    {
+        if (!clippor_database_maintain(self, &step, error))
+        {
+            g_prefix_error_literal(error, "Failed maintaining database: ");
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static void
+database_job_free(DatabaseJob *job)
+{
+    g_clear_object(&job->task);
+    g_clear_object(&job->entry);
+    g_free(job->str);
+
+    if (job->gc != NULL)
+    {
+        g_clear_pointer(&job->gc->dir, g_dir_close);
+        g_free(job->gc);
+    }
+    g_free(job);
+}
+
+/*
+ * Runs in the writer thread. Takes jobs off the queue and runs them until it
+ * receives a stop job.
+ */
+static void *
+clippor_database_writer_func(ClipporDatabase *self)
+{
+    // If something was written since the last time maintenance was done
+    gboolean dirty = FALSE;
+    MaintenanceStep step = MAINTENANCE_CHECKPOINT;
+    // If a job came in between two steps of maintenance
+    gboolean interrupted = FALSE;
+    // Number of unfinished jobs that were put back at the end of the queue
+    uint requeued = 0;
+
+    while (TRUE)
+    {
+        DatabaseJob *job;
+        GError *error = NULL;
+        gboolean ret = TRUE;
+
+        // Once nothing has been queued for a while, do maintenance one step at
+        // a time, so that a new job only has to wait for a single step. If a
+        // job came in between two steps, wait until it has been quiet for that
+        // long again before doing the next one.
+        if (!dirty)
+            job = g_async_queue_pop(self->jobs);
+        else if (step == MAINTENANCE_CHECKPOINT || interrupted)
+            job = g_async_queue_timeout_pop(self->jobs, MAINTENANCE_IDLE_TIME);
+        else
+            job = g_async_queue_try_pop(self->jobs);
+
+        if (job == NULL)
+        {
+            interrupted = FALSE;
+
+            if (!clippor_database_maintain(self, &step, &error))
+            {
+                g_warning("Failed maintaining database: %s", error->message);
+                g_clear_error(&error);
+            }
+            if (step == MAINTENANCE_DONE)
+            {
+                dirty = FALSE;
+                step = MAINTENANCE_CHECKPOINT;
+            }
+            continue;
+        }
+
+        if (step != MAINTENANCE_CHECKPOINT)
+            interrupted = TRUE;
+
+        if (job->requeued)
+        {
+            job->requeued = FALSE;
+            requeued--;
+        }
+
+        if (job->type == DATABASE_JOB_STOP)
+        {
+            database_job_free(job);
+            break;
+        }
+
+        if (job->type == DATABASE_JOB_COMPACT)
+        {
+            int compact_ret = clippor_database_compact_step(self, &error);
+
+            // Nothing else can be done before every row is moved, so keep the
+            // job in front of the queue. Each batch still releases the lock.
+            if (compact_ret == 0)
+            {
+                job->n++;
+                g_async_queue_push_front(self->jobs, job);
+                continue;
+            }
+
+            g_mutex_lock(&self->lock);
+
+            if (compact_ret == 1 && clippor_database_migrate(self, &error))
+                g_debug(
+                    "Moved entries to compact schema in %ld batches",
+                    job->n + 1
+                );
+            else
+            {
+                g_warning("%s", error->message);
+                self->compact_error = error;
+            }
+
+            g_atomic_int_set(&self->compacting, FALSE);
+            g_cond_broadcast(&self->compacted);
+            g_mutex_unlock(&self->lock);
+
+            database_job_free(job);
+            continue;
+        }
+
+        if (job->type == DATABASE_JOB_FLUSH)
+        {
+            DatabaseFlush *flush = job->data;
+
+            // Jobs that were queued before the flush may have been put back
+            // behind it, so wait for them as well.
+            if (requeued > 0)
+            {
+                g_async_queue_push(self->jobs, job);
+                continue;
+            }
+
+            g_mutex_lock(&flush->lock);
+            flush->done = TRUE;
+            g_cond_signal(&flush->cond);
+            g_mutex_unlock(&flush->lock);
+
+            database_job_free(job);
+            continue;
+        }
+
+        if (g_task_return_error_if_cancelled(job->task))
+        {
+            database_job_free(job);
+            continue;
+        }
+
+        // Start maintenance over once we are idle again
+        dirty = TRUE;
+        step = MAINTENANCE_CHECKPOINT;
+
+        if (job->type == DATABASE_JOB_GC)
+        {
+            int gc_ret = clippor_database_gc_step(self, job->gc, &error);
+
+            // Put the job back at the end of the queue, so that jobs that were
+            // queued in the meantime don't have to wait for it to finish.
+            if (gc_ret == 0)
+            {
+                job->requeued = TRUE;
+                requeued++;
+                g_async_queue_push(self->jobs, job);
+                continue;
+            }
+
+            if (gc_ret == 1)
+                g_task_return_int(job->task, job->gc->reclaimed);
+            else
+            {
+                g_prefix_error_literal(&error, "Failed collecting garbage: ");
+                g_task_return_error(job->task, error);
+            }
+
+            database_job_free(job);
+            continue;
+        }
+
+        if (job->type == DATABASE_JOB_TRIM)
+        {
+            int64_t removed = clippor_database_trim_entries_step(
+                self, job->str, job->n, &error
+            );
+
+            if (removed > 0)
+            {
+                job->trimmed += removed;
+                g_debug(
+                    "Trimmed %ld entries of clipboard '%s' so far",
+                    job->trimmed, job->str
+                );
+            }
+
+            // Same as garbage collection, let other jobs go in between
+            if (removed == TRIM_BATCH)
+            {
+                job->requeued = TRUE;
+                requeued++;
+                g_async_queue_push(self->jobs, job);
+                continue;
+            }
+
+            if (removed != -1)
+                g_task_return_int(job->task, job->trimmed);
+            else
+                g_task_return_error(job->task, error);
+
+            database_job_free(job);
+            continue;
+        }
+
+        if (job->type == DATABASE_JOB_EXPIRE)
+        {
+            int64_t next = clippor_database_expire_entries(
+                self, job->str, job->max_age, job->sensitive_age, &error
+            );
+
+            if (next != -1)
+                g_task_return_int(job->task, next);
+            else
+                g_task_return_error(job->task, error);
+
+            database_job_free(job);
+            continue;
+        }
+
+        switch (job->type)
+        {
+        case DATABASE_JOB_SERIALIZE:
+            ret = clippor_database_serialize_entry(self, job->entry, &error);
+            break;
+        case DATABASE_JOB_ADD:
+            ret = clippor_database_add_entry(
+                self, job->entry, job->n, job->max_bytes, &error
+            );
+            break;
+        case DATABASE_JOB_DELETE:
+            ret = clippor_database_delete_entry(self, job->str, &error);
+            break;
+        default:
+            g_assert_not_reached();
+        }
+
+        if (ret)
+            g_task_return_boolean(job->task, TRUE);
+        else
+            g_task_return_error(job->task, error);
+
+        database_job_free(job);
+    }
+
+    return NULL;
+}
+
+/*
+ * Queue a job for the writer thread. A GTask is created for it using the
+ * given callback, which is called in the thread default main context of the
+ * caller once the job is done.
+ */
+static void
+clippor_database_push_job(
+    ClipporDatabase *self, DatabaseJob *job, void *source_tag,
+    GCancellable *cancellable, GAsyncReadyCallback callback, void *user_data
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(job != NULL);
+
+    job->task = g_task_new(self, cancellable, callback, user_data);
+    g_task_set_source_tag(job->task, source_tag);
+
+    g_async_queue_push(self->jobs, job);
+}
+
+static gboolean
+clippor_database_job_finish(
+    ClipporDatabase *self, GAsyncResult *result, void *source_tag,
+    GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(g_task_is_valid(result, self));
+    g_assert(g_task_get_source_tag(G_TASK(result)) == source_tag);
+    g_assert(error == NULL || *error == NULL);
+
+    return g_task_propagate_boolean(G_TASK(result), error);
+}
+
+/*
+ * Same as clippor_database_serialize_entry, but done in the writer thread.
+ * "entry" should not be modified until the operation is finished.
+ */
+void
+clippor_database_serialize_entry_async(
+    ClipporDatabase *self, ClipporEntry *entry, GCancellable *cancellable,
+    GAsyncReadyCallback callback, void *user_data
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(CLIPPOR_IS_ENTRY(entry));
+
+    DatabaseJob *job = g_new0(DatabaseJob, 1);
+
+    job->type = DATABASE_JOB_SERIALIZE;
+    job->entry = g_object_ref(entry);
+
+    clippor_database_push_job(
+        self, job, clippor_database_serialize_entry_async, cancellable,
+        callback, user_data
+    );
+}
+
+gboolean
+clippor_database_serialize_entry_finish(
+    ClipporDatabase *self, GAsyncResult *result, GError **error
+)
+{
+    return clippor_database_job_finish(
+        self, result, clippor_database_serialize_entry_async, error
+    );
+}
+
+/*
+ * Same as clippor_database_add_entry, but done in the writer thread. "entry"
+ * should not be modified until the operation is finished.
+ */
+void
+clippor_database_add_entry_async(
+    ClipporDatabase *self, ClipporEntry *entry, int64_t max_entries,
+    int64_t max_bytes, GCancellable *cancellable, GAsyncReadyCallback callback,
+    void *user_data
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(CLIPPOR_IS_ENTRY(entry));
+    g_assert(max_entries >= 0);
+    g_assert(max_bytes >= 0);
+
+    DatabaseJob *job = g_new0(DatabaseJob, 1);
+
+    job->type = DATABASE_JOB_ADD;
+    job->entry = g_object_ref(entry);
+    job->n = max_entries;
+    job->max_bytes = max_bytes;
+
+    clippor_database_push_job(
+        self, job, clippor_database_add_entry_async, cancellable, callback,
+        user_data
+    );
+}
+
+gboolean
+clippor_database_add_entry_finish(
+    ClipporDatabase *self, GAsyncResult *result, GError **error
+)
+{
+    return clippor_database_job_finish(
+        self, result, clippor_database_add_entry_async, error
+    );
+}
+
+/*
+ * Same as clippor_database_collect_garbage, but done in the writer thread in
+ * small steps, so that other jobs can run in between them.
+ */
+void
+clippor_database_collect_garbage_async(
+    ClipporDatabase *self, GCancellable *cancellable,
+    GAsyncReadyCallback callback, void *user_data
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+
+    DatabaseJob *job = g_new0(DatabaseJob, 1);
+
+    job->type = DATABASE_JOB_GC;
+    job->gc = g_new0(DatabaseGC, 1);
+    job->gc->phase = GC_PHASE_REFCOUNTS;
+
+    clippor_database_push_job(
+        self, job, clippor_database_collect_garbage_async, cancellable,
+        callback, user_data
+    );
+}
+
+/*
+ * Returns the number of bytes reclaimed, or -1 on error.
+ */
+int64_t
+clippor_database_collect_garbage_finish(
+    ClipporDatabase *self, GAsyncResult *result, GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(g_task_is_valid(result, self));
+    g_assert(
+        g_task_get_source_tag(G_TASK(result)) ==
+        clippor_database_collect_garbage_async
+    );
+    g_assert(error == NULL || *error == NULL);
+
+    return g_task_propagate_int(G_TASK(result), error);
+}
+
+/*
+ * Same as clippor_database_expire_entries, but done in the writer thread.
+ */
+void
+clippor_database_expire_entries_async(
+    ClipporDatabase *self, const char *cb, int64_t max_age,
+    int64_t sensitive_age, GCancellable *cancellable,
+    GAsyncReadyCallback callback, void *user_data
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(cb != NULL);
+    g_assert(max_age >= 0);
+    g_assert(sensitive_age >= 0);
+
+    DatabaseJob *job = g_new0(DatabaseJob, 1);
+
+    job->type = DATABASE_JOB_EXPIRE;
+    job->str = g_strdup(cb);
+    job->max_age = max_age;
+    job->sensitive_age = sensitive_age;
+
+    clippor_database_push_job(
+        self, job, clippor_database_expire_entries_async, cancellable,
+        callback, user_data
+    );
+}
+
+/*
+ * Returns the time at which the next entry expires, zero if none will, or -1
+ * on error.
+ */
+int64_t
+clippor_database_expire_entries_finish(
+    ClipporDatabase *self, GAsyncResult *result, GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(g_task_is_valid(result, self));
+    g_assert(
+        g_task_get_source_tag(G_TASK(result)) ==
+        clippor_database_expire_entries_async
+    );
+    g_assert(error == NULL || *error == NULL);
 
-    return f_ret;
+    return g_task_propagate_int(G_TASK(result), error);
 }
 
-static gboolean
-clippor_database_load_mime_types(
-    ClipporDatabase *self, ClipporEntry *entry, GError **error
+/*
+ * Same as clippor_database_trim_entries, but done in the writer thread. The
+ * entries are removed in batches of TRIM_BATCH, with other jobs done in
+ * between, so that trimming many entries doesn't hold them up.
+ */
+void
+clippor_database_trim_entries_async(
+    ClipporDatabase *self, const char *cb, int64_t n, GCancellable *cancellable,
+    GAsyncReadyCallback callback, void *user_data
 )
 {
     g_assert(CLIPPOR_IS_DATABASE(self));
-    g_assert(CLIPPOR_IS_ENTRY(entry));
-    g_assert(error == NULL || *error == NULL);
-
-    const char *statement = "SELECT Mime_type, Data_id FROM Mime_types "
-                            "WHERE Id = ?;";
-    sqlite3_stmt *stmt;
-    int ret;
+    g_assert(cb != NULL);
+    g_assert(n >= 0);
 
-    PREPARE(FALSE);
+    DatabaseJob *job = g_new0(DatabaseJob, 1);
 
-    sqlite3_bind_text(stmt, 1, clippor_entry_get_id(entry), -1, SQLITE_STATIC);
+    job->type = DATABASE_JOB_TRIM;
+    job->str = g_strdup(cb);
+    job->n = n;
 
-    // Temporarily store data with their data_id, so we can avoid loading the
-    // same data file again creating duplicate GBytes.
-    g_autoptr(GHashTable) store = g_hash_table_new_full(
-        g_str_hash, g_str_equal, NULL, (GDestroyNotify)g_bytes_unref
+    clippor_database_push_job(
+        self, job, clippor_database_trim_entries_async, cancellable, callback,
+        user_data
     );
+}
 
-    while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
-    {
-        const char *mime_type = (const char *)sqlite3_column_text(stmt, 0);
-        const char *data_id = (const char *)sqlite3_column_text(stmt, 1);
+/*
+ * Returns the number of entries removed, or -1 on error.
+ */
+int64_t
+clippor_database_trim_entries_finish(
+    ClipporDatabase *self, GAsyncResult *result, GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(g_task_is_valid(result, self));
+    g_assert(
+        g_task_get_source_tag(G_TASK(result)) ==
+        clippor_database_trim_entries_async
+    );
+    g_assert(error == NULL || *error == NULL);
 
-        // Check if we already loaded the same data before
-        if (g_hash_table_contains(store, data_id))
-        {
-            clippor_entry_add_mime_type(
-                entry, mime_type, g_hash_table_lookup(store, data_id)
-            );
-            continue;
-        }
+    return g_task_propagate_int(G_TASK(result), error);
+}
 
-        g_autofree char *path =
-            g_strdup_printf("%s/data/%s", self->location_dir, data_id);
-        size_t sz;
-        char *contents;
+/*
+ * Same as clippor_database_delete_entry, but done in the writer thread.
+ */
+void
+clippor_database_delete_entry_async(
+    ClipporDatabase *self, const char *id, GCancellable *cancellable,
+    GAsyncReadyCallback callback, void *user_data
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(id != NULL);
 
-        if (!g_file_get_contents(path, &contents, &sz, error))
-        {
-            g_prefix_error(error, "Failed loading file '%s'", path);
-            sqlite3_finalize(stmt);
-            return FALSE;
-        }
+    DatabaseJob *job = g_new0(DatabaseJob, 1);
 
-        GBytes *bytes = g_bytes_new_take(contents, sz);
+    job->type = DATABASE_JOB_DELETE;
+    job->str = g_strdup(id);
 
-        clippor_entry_add_mime_type(entry, mime_type, bytes);
-        g_hash_table_insert(store, (char *)data_id, bytes);
-    }
+    clippor_database_push_job(
+        self, job, clippor_database_delete_entry_async, cancellable, callback,
+        user_data
+    );
+}
 
-    sqlite3_finalize(stmt);
+gboolean
+clippor_database_delete_entry_finish(
+    ClipporDatabase *self, GAsyncResult *result, GError **error
+)
+{
+    return clippor_database_job_finish(
+        self, result, clippor_database_delete_entry_async, error
+    );
+}
 
-    return TRUE;
+static void
+read_job_free(ReadJob *job)
+{
+    g_free(job->cb);
+    g_free(job->str);
+    g_free(job);
 }
 
-static ClipporEntry *
-clippor_database_load_entry(
-    ClipporDatabase *self, sqlite3_stmt *stmt, GError **error
+/*
+ * Runs in a worker thread. Does the read of "job" with a reader from the pool.
+ */
+static void
+clippor_database_read_thread(
+    GTask *task, ClipporDatabase *self, ReadJob *job,
+    GCancellable *cancellable G_GNUC_UNUSED
 )
 {
-    g_assert(CLIPPOR_IS_DATABASE(self));
-    g_assert(stmt != NULL);
-    g_assert(error == NULL || *error == NULL);
+    if (g_task_return_error_if_cancelled(task))
+        return;
 
-    const char *id = (const char *)sqlite3_column_text(stmt, 0);
-    int64_t creation_time = sqlite3_column_int64(stmt, 1);
-    int64_t last_used_time = sqlite3_column_int64(stmt, 2);
-    ClipporEntryFlags flags = sqlite3_column_int(stmt, 3);
-    const char *cb = (const char *)sqlite3_column_text(stmt, 4);
+    GError *error = NULL;
+    DatabaseReader *reader;
+    void *result = NULL;
+    GDestroyNotify free_func = NULL;
 
-    ClipporEntry *entry =
-        clippor_entry_new_full(cb, id, creation_time, last_used_time, flags);
+    if (!clippor_database_acquire_reader(self, &reader, &error))
+    {
+        g_task_return_error(task, error);
+        return;
+    }
 
-    if (!clippor_database_load_mime_types(self, entry, error))
+    switch (job->type)
     {
-        g_object_unref(entry);
-        return NULL;
+    case READ_JOB_SEARCH:
+        result = clippor_database_read_search(
+            self, reader, job->cb, job->str, job->n, &error
+        );
+        free_func = (GDestroyNotify)g_ptr_array_unref;
+        break;
+    case READ_JOB_ENTRIES:
+        result = clippor_database_read_entries(
+            self, reader, job->cb, job->n, &job->cursor, &error
+        );
+        free_func = (GDestroyNotify)g_ptr_array_unref;
+        break;
+    case READ_JOB_ENTRY:
+        result =
+            clippor_database_read_entry_with_id(self, reader, job->str, &error);
+        free_func = g_object_unref;
+        break;
+    case READ_JOB_ENTRY_AT_INDEX:
+        result = clippor_database_read_entry_at_index(
+            self, reader, job->cb, job->n, &error
+        );
+        free_func = g_object_unref;
+        break;
+    case READ_JOB_DATA:
+        result = clippor_database_read_data(self, reader, job->str, &error);
+        free_func = (GDestroyNotify)g_bytes_unref;
+        break;
+    default:
+        g_assert_not_reached();
     }
 
-    return entry;
+    clippor_database_release_reader(self, reader);
+
+    if (result != NULL)
+        g_task_return_pointer(task, result, free_func);
+    else
+        g_task_return_error(task, error);
 }
 
 /*
- * Deserialize entry from database at given index that is associated with
- * given clipboard label.
+ * Run "job" in a worker thread. The callback is called in the thread default
+ * main context of the caller once it is done.
  */
-ClipporEntry *
-clippor_database_deserialize_entry_at_index(
-    ClipporDatabase *self, const char *cb, int64_t index, GError **error
+static void
+clippor_database_push_read(
+    ClipporDatabase *self, ReadJob *job, void *source_tag,
+    GCancellable *cancellable, GAsyncReadyCallback callback, void *user_data
 )
 {
     g_assert(CLIPPOR_IS_DATABASE(self));
-    g_assert(index >= 0);
-    g_assert(error == NULL || *error == NULL);
-
-    const char *statement =
-        "SELECT Id, Creation_time, Last_used_time, Flags, Clipboard "
-        "FROM Entries WHERE Clipboard = ? "
-        "ORDER BY Position DESC LIMIT 1 OFFSET ?;";
-    sqlite3_stmt *stmt;
-    int ret;
+    g_assert(job != NULL);
 
-    PREPARE(NULL);
+    g_autoptr(GTask) task = g_task_new(self, cancellable, callback, user_data);
 
-    sqlite3_bind_text(stmt, 1, cb, -1, SQLITE_STATIC);
-    sqlite3_bind_int(stmt, 2, index);
+    g_task_set_source_tag(task, source_tag);
+    g_task_set_task_data(task, job, (GDestroyNotify)read_job_free);
+    g_task_run_in_thread(task, (GTaskThreadFunc)clippor_database_read_thread);
+}
 
-    ret = sqlite3_step(stmt);
+static void *
+clippor_database_read_finish(
+    ClipporDatabase *self, GAsyncResult *result, void *source_tag,
+    GError **error
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(g_task_is_valid(result, self));
+    g_assert(g_task_get_source_tag(G_TASK(result)) == source_tag);
+    g_assert(error == NULL || *error == NULL);
 
-    if (ret == SQLITE_ROW)
-    {
-        ClipporEntry *entry = clippor_database_load_entry(self, stmt, error);
+    return g_task_propagate_pointer(G_TASK(result), error);
+}
 
-        sqlite3_finalize(stmt);
+/*
+ * Same as clippor_database_search, but done in a worker thread without waiting
+ * for the writer.
+ */
+void
+clippor_database_search_async(
+    ClipporDatabase *self, const char *cb, const char *query, int64_t n,
+    GCancellable *cancellable, GAsyncReadyCallback callback, void *user_data
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(cb != NULL);
+    g_assert(query != NULL);
+    g_assert(n > 0);
 
-        if (entry == NULL)
-            g_prefix_error(
-                error, "Failed loading entry at index %ld for clipboard '%s'",
-                index, cb
-            );
+    ReadJob *job = g_new0(ReadJob, 1);
 
-        return entry;
-    }
-    else if (ret == SQLITE_DONE)
-    {
-        g_set_error(
-            error, CLIPPOR_DATABASE_ERROR, CLIPPOR_DATABASE_ERROR_ROW_NOT_EXIST,
-            "No entry exists at index %ld", index
-        );
-    }
-    else
-        STEP_ERROR(NULL);
+    job->type = READ_JOB_SEARCH;
+    job->cb = g_strdup(cb);
+    job->str = g_strdup(query);
+    job->n = n;
 
-    sqlite3_finalize(stmt);
+    clippor_database_push_read(
+        self, job, clippor_database_search_async, cancellable, callback,
+        user_data
+    );
+}
 
-    return NULL;
+GPtrArray *
+clippor_database_search_finish(
+    ClipporDatabase *self, GAsyncResult *result, GError **error
+)
+{
+    return clippor_database_read_finish(
+        self, result, clippor_database_search_async, error
+    );
 }
 
 /*
- * Deserialize entry from database with matching id.
+ * Same as clippor_database_deserialize_entries, but done in a worker thread
+ * without waiting for the writer. The cursor for the next page is returned by
+ * clippor_database_deserialize_entries_finish().
  */
-ClipporEntry *
-clippor_database_deserialize_entry_with_id(
-    ClipporDatabase *self, const char *id, GError **error
+void
+clippor_database_deserialize_entries_async(
+    ClipporDatabase *self, const char *cb, int64_t n, int64_t cursor,
+    GCancellable *cancellable, GAsyncReadyCallback callback, void *user_data
 )
 {
     g_assert(CLIPPOR_IS_DATABASE(self));
-    g_assert(id != NULL);
-    g_assert(error == NULL || *error == NULL);
-
-    const char *statement =
-        "SELECT Id, Creation_time, Last_used_time, Flags, Clipboard "
-        "FROM Entries WHERE Id = ?;";
-    sqlite3_stmt *stmt;
-    int ret;
-
-    PREPARE(NULL);
+    g_assert(cb != NULL);
+    g_assert(n > 0);
 
-    sqlite3_bind_text(stmt, 1, id, -1, SQLITE_STATIC);
+    ReadJob *job = g_new0(ReadJob, 1);
 
-    ret = sqlite3_step(stmt);
+    job->type = READ_JOB_ENTRIES;
+    job->cb = g_strdup(cb);
+    job->n = n;
+    job->cursor = cursor;
 
-    if (ret == SQLITE_ROW)
-    {
-        ClipporEntry *entry = clippor_database_load_entry(self, stmt, error);
+    clippor_database_push_read(
+        self, job, clippor_database_deserialize_entries_async, cancellable,
+        callback, user_data
+    );
+}
 
-        sqlite3_finalize(stmt);
+GPtrArray *
+clippor_database_deserialize_entries_finish(
+    ClipporDatabase *self, GAsyncResult *result, int64_t *cursor,
+    GError **error
+)
+{
+    g_assert(cursor != NULL);
 
-        if (entry == NULL)
-            g_prefix_error(error, "Failed loading entry with id '%s': ", id);
+    GPtrArray *entries = clippor_database_read_finish(
+        self, result, clippor_database_deserialize_entries_async, error
+    );
 
-        return entry;
-    }
-    else if (ret == SQLITE_DONE)
+    if (entries != NULL)
     {
-        g_set_error(
-            error, CLIPPOR_DATABASE_ERROR, CLIPPOR_DATABASE_ERROR_ROW_NOT_EXIST,
-            "No entry exists with id '%s'", id
-        );
-    }
-    else
-        STEP_ERROR(NULL);
+        ReadJob *job = g_task_get_task_data(G_TASK(result));
 
-    sqlite3_finalize(stmt);
+        *cursor = job->cursor;
+    }
 
-    return NULL;
+    return entries;
 }
 
 /*
- * Return an array of entries between start and end. "start" must be less than
- * or equal to "end". "start" must be greater than or equal to 0, and if -1 is
- * passed for "end", it is assumed to be the index of the last entry.
+ * Same as clippor_database_deserialize_entry_with_id, but done in a worker
+ * thread without waiting for the writer.
  */
-GPtrArray *
-clippor_database_deserialize_entries(
-    ClipporDatabase *self, int64_t start, int64_t end, GError **error
+void
+clippor_database_deserialize_entry_with_id_async(
+    ClipporDatabase *self, const char *id, GCancellable *cancellable,
+    GAsyncReadyCallback callback, void *user_data
 )
 {
     g_assert(CLIPPOR_IS_DATABASE(self));
-    g_assert(start <= end);
-    g_assert(start >= 0);
-    g_assert(end >= -1);
-    g_assert(error == NULL || *error == NULL);
+    g_assert(id != NULL);
 
-    return NULL;
+    ReadJob *job = g_new0(ReadJob, 1);
+
+    job->type = READ_JOB_ENTRY;
+    job->str = g_strdup(id);
+
+    clippor_database_push_read(
+        self, job, clippor_database_deserialize_entry_with_id_async,
+        cancellable, callback, user_data
+    );
+}
+
+ClipporEntry *
+clippor_database_deserialize_entry_with_id_finish(
+    ClipporDatabase *self, GAsyncResult *result, GError **error
+)
+{
+    return clippor_database_read_finish(
+        self, result, clippor_database_deserialize_entry_with_id_async, error
+    );
 }
 
 /*
- * Remove older entries in the datbaase until "n" entries are left.
+ * Same as clippor_database_deserialize_entry_at_index, but done in a worker
+ * thread without waiting for the writer.
  */
-gboolean
-clippor_database_trim_entries(
-    ClipporDatabase *self, const char *cb, int64_t n, GError **error
+void
+clippor_database_deserialize_entry_at_index_async(
+    ClipporDatabase *self, const char *cb, int64_t index,
+    GCancellable *cancellable, GAsyncReadyCallback callback, void *user_data
 )
 {
     g_assert(CLIPPOR_IS_DATABASE(self));
     g_assert(cb != NULL);
-    g_assert(error == NULL || *error == NULL);
+    g_assert(index >= 0);
 
-    const char *statement = "BEGIN TRANSACTION;", *statement2;
-    char *err_msg;
-    sqlite3_stmt *stmt, *stmt2;
-    int ret;
+    ReadJob *job = g_new0(ReadJob, 1);
 
-    EXEC(FALSE);
+    job->type = READ_JOB_ENTRY_AT_INDEX;
+    job->cb = g_strdup(cb);
+    job->n = index;
 
-    statement = "SELECT Id FROM Entries "
-                "WHERE Position NOT IN ("
-                "   SELECT Position FROM Entries "
-                "   ORDER BY Position DESC "
-                "   LIMIT ?"
-                ");";
-    statement2 = "DELETE FROM Entries WHERE Id = ?;";
+    clippor_database_push_read(
+        self, job, clippor_database_deserialize_entry_at_index_async,
+        cancellable, callback, user_data
+    );
+}
 
-    ret = sqlite3_prepare_v2(self->handle, statement, -1, &stmt, NULL);
+ClipporEntry *
+clippor_database_deserialize_entry_at_index_finish(
+    ClipporDatabase *self, GAsyncResult *result, GError **error
+)
+{
+    return clippor_database_read_finish(
+        self, result, clippor_database_deserialize_entry_at_index_async, error
+    );
+}
 
-    if (ret != SQLITE_OK)
-    {
-        g_set_error(
-            error, (clippor_database_error_quark()),
-            CLIPPOR_DATABASE_ERROR_PREPARE,
-            "Failed preparing statement '%s': %s", statement,
-            sqlite3_errmsg(self->handle)
-        );
-        goto fail;
-    }
+/*
+ * Same as clippor_database_load_data, but done in a worker thread without
+ * waiting for the writer. Data files are mapped there as well, so their pages
+ * are still only loaded when the data is actually used.
+ */
+void
+clippor_database_load_data_async(
+    ClipporDatabase *self, const char *data_id, GCancellable *cancellable,
+    GAsyncReadyCallback callback, void *user_data
+)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(data_id != NULL);
 
-    ret = sqlite3_prepare_v2(self->handle, statement2, -1, &stmt2, NULL);
+    ReadJob *job = g_new0(ReadJob, 1);
 
-    if (ret != SQLITE_OK)
-    {
-        sqlite3_finalize(stmt);
-        g_set_error(
-            error, (clippor_database_error_quark()),
-            CLIPPOR_DATABASE_ERROR_PREPARE,
-            "Failed preparing statement '%s': %s", statement2,
-            sqlite3_errmsg(self->handle)
-        );
-        goto fail;
-    }
+    job->type = READ_JOB_DATA;
+    job->str = g_strdup(data_id);
 
-    sqlite3_bind_int64(stmt, 1, n + 1);
+    clippor_database_push_read(
+        self, job, clippor_database_load_data_async, cancellable, callback,
+        user_data
+    );
+}
 
-    while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
-    {
-        const char *id = (const char *)sqlite3_column_text(stmt, 0);
+/*
+ * Returns a new reference to the loaded data, or NULL on error.
+ */
+GBytes *
+clippor_database_load_data_finish(
+    ClipporDatabase *self, GAsyncResult *result, GError **error
+)
+{
+    return clippor_database_read_finish(
+        self, result, clippor_database_load_data_async, error
+    );
+}
 
-        // Remove mime types first to avoid foreign key restriction
-        if (!clippor_database_cleanup_mime_types(self, id, NULL, TRUE, error))
-        {
-loop_fail:
-            sqlite3_finalize(stmt);
-            sqlite3_finalize(stmt2);
-            goto fail;
-        }
+/*
+ * Block until every job queued before this call has been done by the writer
+ * thread, including garbage collections and trims that are done in several
+ * steps. Note that the callbacks of the jobs are still only called when the
+ * main context of the caller is iterated.
+ */
+void
+clippor_database_flush(ClipporDatabase *self)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
 
-        // Remove row
-        sqlite3_bind_text(stmt2, 1, id, -1, SQLITE_STATIC);
-        ret = sqlite3_step(stmt2);
+    DatabaseFlush flush = {.done = FALSE};
+    DatabaseJob *job = g_new0(DatabaseJob, 1);
 
-        if (ret != SQLITE_DONE)
-        {
-            g_set_error(
-                error, (clippor_database_error_quark()),
-                CLIPPOR_DATABASE_ERROR_STEP,
-                "Failed stepping statement '%s': %s", statement2,
-                sqlite3_errmsg(self->handle)
-            );
-            goto loop_fail;
-        }
+    g_mutex_init(&flush.lock);
+    g_cond_init(&flush.cond);
 
-        sqlite3_clear_bindings(stmt2);
-        sqlite3_reset(stmt2);
-    }
+    job->type = DATABASE_JOB_FLUSH;
+    job->data = &flush;
 
-    sqlite3_finalize(stmt);
-    sqlite3_finalize(stmt2);
+    g_async_queue_push(self->jobs, job);
 
-    if (ret != SQLITE_DONE)
-    {
-        g_set_error(
-            error, (clippor_database_error_quark()),
-            CLIPPOR_DATABASE_ERROR_STEP, "Failed stepping statement '%s': %s",
-            statement, sqlite3_errmsg(self->handle)
-        );
-        goto fail;
-    }
+    g_mutex_lock(&flush.lock);
+    while (!flush.done)
+        g_cond_wait(&flush.cond, &flush.lock);
+    g_mutex_unlock(&flush.lock);
 
-    gboolean f_ret = TRUE;
+    g_mutex_clear(&flush.lock);
+    g_cond_clear(&flush.cond);
+}
 
-    if (FALSE)
-fail:
-        f_ret = FALSE;
+/*
+ * Copy the current statistics of the database into "stats".
+ */
+void
+clippor_database_get_stats(ClipporDatabase *self, ClipporDatabaseStats *stats)
+{
+    g_assert(CLIPPOR_IS_DATABASE(self));
+    g_assert(stats != NULL);
 
-    if (f_ret)
-        statement = "COMMIT;";
-    else
-        statement = "ROLLBACK TRANSACTION;";
+    g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&self->lock);
 
-    EXEC(FALSE);
+    *stats = self->stats;
 
-    return f_ret;
+    if (self->store != NULL)
+        clippor_memory_store_get_stats(self->store, &stats->store);
 }
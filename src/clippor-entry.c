@@ -1,5 +1,7 @@
 #include "clippor-entry.h"
 #include "clippor-clipboard.h"
+#include "clippor-database.h"
+#include <gio/gio.h>
 #include <glib-object.h>
 #include <glib.h>
 #include <stdint.h>
@@ -9,6 +11,15 @@
  * database.
  */
 
+// Data for one or more mime types of an entry. Mime types that have the same
+// data share the same EntryData.
+typedef struct
+{
+    char *data_id; // NULL if not known
+    int64_t size;
+    GBytes *bytes; // NULL if not loaded yet or released
+} EntryData;
+
 struct _ClipporEntry
 {
     GObject parent_instance;
@@ -18,20 +29,69 @@ struct _ClipporEntry
     int64_t last_used_time;
     ClipporEntryFlags flags;
 
-    GHashTable *mime_types; // Each key is a mime type and the value is a GBytes
-                            // object containing the data
+    GHashTable *mime_types; // Each key is a mime type and the value is an
+                            // EntryData
+
+    // Database that data can be loaded from, if it isn't in memory. NULL if
+    // entry hasn't been stored in a database yet.
+    ClipporDatabase *db;
+
+    // One line summary of the text of the entry. NULL if not known yet, and
+    // never changed once it is set.
+    char *preview;
+
+    // Protects "db", "preview" and the "bytes" member of each EntryData. The
+    // mime types themselves are not changed after the entry is created.
+    GMutex lock;
 
     char *cb; // Label of clipboard
 };
 
 G_DEFINE_TYPE(ClipporEntry, clippor_entry, G_TYPE_OBJECT)
 
+// Mime types to take the text of an entry from, in order of preference. If
+// there are none, then any "text/" mime type is used.
+static const char *text_mime_types[] = {
+    "text/plain;charset=utf-8", "UTF8_STRING", "text/plain"
+};
+
+// Maximum number of characters in the preview of an entry, and the number of
+// bytes of text that are looked at to make it.
+#define PREVIEW_LENGTH 100
+#define PREVIEW_MAX_TEXT 4096
+
+static void
+entry_data_clear(EntryData *data)
+{
+    g_free(data->data_id);
+    g_clear_pointer(&data->bytes, g_bytes_unref);
+}
+
+static void
+entry_data_unref(EntryData *data)
+{
+    g_rc_box_release_full(data, (GDestroyNotify)entry_data_clear);
+}
+
+static EntryData *
+entry_data_new(GBytes *bytes, const char *data_id, int64_t size)
+{
+    EntryData *data = g_rc_box_new0(EntryData);
+
+    data->data_id = g_strdup(data_id);
+    data->size = size;
+    data->bytes = bytes == NULL ? NULL : g_bytes_ref(bytes);
+
+    return data;
+}
+
 static void
 clippor_entry_dispose(GObject *object)
 {
     ClipporEntry *self = CLIPPOR_ENTRY(object);
 
     g_clear_pointer(&self->mime_types, g_hash_table_unref);
+    g_clear_object(&self->db);
 
     G_OBJECT_CLASS(clippor_entry_parent_class)->dispose(object);
 }
@@ -43,6 +103,8 @@ clippor_entry_finalize(GObject *object)
 
     g_free(self->id);
     g_free(self->cb);
+    g_free(self->preview);
+    g_mutex_clear(&self->lock);
 
     G_OBJECT_CLASS(clippor_entry_parent_class)->finalize(object);
 }
@@ -60,8 +122,9 @@ static void
 clippor_entry_init(ClipporEntry *self)
 {
     self->mime_types = g_hash_table_new_full(
-        g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_bytes_unref
+        g_str_hash, g_str_equal, g_free, (GDestroyNotify)entry_data_unref
     );
+    g_mutex_init(&self->lock);
 }
 
 ClipporEntry *
@@ -112,31 +175,195 @@ clippor_entry_new(ClipporClipboard *cb)
 static gboolean
 compare_mime_type_data(void *key G_GNUC_UNUSED, void *value, void *user_data)
 {
-    return g_bytes_compare(value, user_data) == 0;
+    EntryData *data = value;
+
+    return data->bytes != NULL && g_bytes_compare(data->bytes, user_data) == 0;
+}
+
+static gboolean
+compare_mime_type_data_id(
+    void *key G_GNUC_UNUSED, void *value, void *user_data
+)
+{
+    EntryData *data = value;
+
+    return g_strcmp0(data->data_id, user_data) == 0;
+}
+
+/*
+ * Add mime type to entry, with "data" being the data for it, and "data_id" the
+ * data id of "data". If "data" is NULL, then it will be loaded from the
+ * database using "data_id" when it is needed.
+ */
+static void
+clippor_entry_add_data(
+    ClipporEntry *self, const char *mime_type, GBytes *data,
+    const char *data_id, int64_t size
+)
+{
+    // Check if mime type with same data already exists, if so then use that
+    // instead. Comparing data ids is much cheaper than comparing the data.
+    EntryData *entry_data;
+
+    if (data_id != NULL)
+        entry_data = g_hash_table_find(
+            self->mime_types, compare_mime_type_data_id, (char *)data_id
+        );
+    else
+        entry_data =
+            g_hash_table_find(self->mime_types, compare_mime_type_data, data);
+
+    if (entry_data == NULL)
+        entry_data = entry_data_new(data, data_id, size);
+    else
+        g_rc_box_acquire(entry_data);
+
+    g_hash_table_insert(self->mime_types, g_strdup(mime_type), entry_data);
 }
 
 void
 clippor_entry_add_mime_type(
     ClipporEntry *self, const char *mime_type, GBytes *data
 )
+{
+    clippor_entry_add_mime_type_with_id(self, mime_type, data, NULL);
+}
+
+/*
+ * Same as clippor_entry_add_mime_type(), but also stores the data id of "data"
+ * so that it doesn't have to be computed again when the entry is serialized.
+ * "data_id" may be NULL if it isn't known.
+ */
+void
+clippor_entry_add_mime_type_with_id(
+    ClipporEntry *self, const char *mime_type, GBytes *data,
+    const char *data_id
+)
 {
     g_assert(CLIPPOR_IS_ENTRY(self));
     g_assert(mime_type != NULL);
     g_assert(data != NULL);
 
-    // Check if mime type with same data already exists, if so then use that
-    // instead.
-    GBytes *bytes =
-        g_hash_table_find(self->mime_types, compare_mime_type_data, data);
+    clippor_entry_add_data(
+        self, mime_type, data, data_id, g_bytes_get_size(data)
+    );
+}
 
-    if (bytes == NULL)
-        bytes = data;
+/*
+ * Add mime type whose data is only loaded from the database of the entry once
+ * it is needed.
+ */
+void
+clippor_entry_add_mime_type_lazy(
+    ClipporEntry *self, const char *mime_type, const char *data_id,
+    int64_t size
+)
+{
+    g_assert(CLIPPOR_IS_ENTRY(self));
+    g_assert(mime_type != NULL);
+    g_assert(data_id != NULL);
+    g_assert(size >= 0);
+
+    clippor_entry_add_data(self, mime_type, NULL, data_id, size);
+}
+
+/*
+ * Create a new entry with the same id, times, flags, mime types and preview as
+ * "self". Data that is in memory is shared with the copy, but the database is
+ * not set.
+ */
+ClipporEntry *
+clippor_entry_copy(ClipporEntry *self)
+{
+    g_assert(CLIPPOR_IS_ENTRY(self));
 
-    g_hash_table_insert(
-        self->mime_types, g_strdup(mime_type), g_bytes_ref(bytes)
+    ClipporEntry *copy = clippor_entry_new_full(
+        self->cb, self->id, self->creation_time, self->last_used_time,
+        self->flags
     );
+    g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&self->lock);
+
+    GHashTableIter iter;
+    const char *mime_type;
+    EntryData *data;
+
+    g_hash_table_iter_init(&iter, self->mime_types);
+
+    while (g_hash_table_iter_next(&iter, (void **)&mime_type, (void **)&data))
+        clippor_entry_add_data(
+            copy, mime_type, data->bytes, data->data_id, data->size
+        );
+
+    copy->preview = g_strdup(self->preview);
+
+    return copy;
+}
+
+/*
+ * Set the database that data not in memory is loaded from.
+ */
+void
+clippor_entry_set_database(ClipporEntry *self, ClipporDatabase *db)
+{
+    g_assert(CLIPPOR_IS_ENTRY(self));
+    g_assert(db == NULL || CLIPPOR_IS_DATABASE(db));
+
+    g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&self->lock);
+
+    g_set_object(&self->db, db);
 }
 
+/*
+ * Set the preview of the entry, if it doesn't have one yet. Used when the
+ * preview was computed earlier, so that the text doesn't have to be loaded.
+ */
+void
+clippor_entry_set_preview(ClipporEntry *self, const char *preview)
+{
+    g_assert(CLIPPOR_IS_ENTRY(self));
+    g_assert(preview != NULL);
+
+    g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&self->lock);
+
+    if (self->preview == NULL)
+        self->preview = g_strdup(preview);
+}
+
+/*
+ * Drop the data of each mime type that can be loaded again from the database.
+ * Returns the number of bytes released.
+ */
+uint64_t
+clippor_entry_release_data(ClipporEntry *self)
+{
+    g_assert(CLIPPOR_IS_ENTRY(self));
+
+    g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&self->lock);
+    uint64_t released = 0;
+
+    if (self->db == NULL)
+        return 0;
+
+    GHashTableIter iter;
+    EntryData *data;
+
+    g_hash_table_iter_init(&iter, self->mime_types);
+
+    while (g_hash_table_iter_next(&iter, NULL, (void **)&data))
+    {
+        if (data->bytes == NULL || data->data_id == NULL)
+            continue;
+
+        released += g_bytes_get_size(data->bytes);
+        g_clear_pointer(&data->bytes, g_bytes_unref);
+    }
+
+    return released;
+}
+
+/*
+ * Mime types are keys, values are private to the entry.
+ */
 GHashTable *
 clippor_entry_get_mime_types(ClipporEntry *self)
 {
@@ -145,13 +372,354 @@ clippor_entry_get_mime_types(ClipporEntry *self)
     return self->mime_types;
 }
 
+/*
+ * Returns the data for "mime_type", or NULL if it does not exist or could not
+ * be loaded. If the data isn't in memory, then it is loaded from the database.
+ * Returns a new reference.
+ */
 GBytes *
 clippor_entry_get_data(ClipporEntry *self, const char *mime_type)
 {
     g_assert(CLIPPOR_IS_ENTRY(self));
     g_assert(mime_type != NULL);
 
-    return g_hash_table_lookup(self->mime_types, mime_type);
+    EntryData *data = g_hash_table_lookup(self->mime_types, mime_type);
+
+    if (data == NULL)
+        return NULL;
+
+    g_autoptr(ClipporDatabase) db = NULL;
+
+    // Don't hold the lock while loading, since the database may lock the entry
+    // while holding its own lock.
+    g_mutex_lock(&self->lock);
+
+    if (data->bytes != NULL)
+    {
+        GBytes *bytes = g_bytes_ref(data->bytes);
+
+        g_mutex_unlock(&self->lock);
+        return bytes;
+    }
+    if (self->db != NULL)
+        db = g_object_ref(self->db);
+
+    g_mutex_unlock(&self->lock);
+
+    if (db == NULL)
+        return NULL;
+
+    g_autoptr(GError) error = NULL;
+    GBytes *bytes = clippor_database_load_data(db, data->data_id, &error);
+
+    if (bytes == NULL)
+    {
+        g_warning(
+            "Failed loading data for mime type '%s': %s", mime_type,
+            error->message
+        );
+        return NULL;
+    }
+
+    g_mutex_lock(&self->lock);
+    if (data->bytes == NULL)
+        data->bytes = g_bytes_ref(bytes);
+    g_mutex_unlock(&self->lock);
+
+    return bytes;
+}
+
+static void
+clippor_entry_load_data_callback(
+    ClipporDatabase *db, GAsyncResult *result, GTask *task
+)
+{
+    ClipporEntry *self = g_task_get_source_object(task);
+    EntryData *data = g_task_get_task_data(task);
+    GError *error = NULL;
+    GBytes *bytes = clippor_database_load_data_finish(db, result, &error);
+
+    if (bytes == NULL)
+    {
+        g_task_return_error(task, error);
+        g_object_unref(task);
+        return;
+    }
+
+    g_mutex_lock(&self->lock);
+    if (data->bytes == NULL)
+        data->bytes = g_bytes_ref(bytes);
+    g_mutex_unlock(&self->lock);
+
+    g_task_return_pointer(task, bytes, (GDestroyNotify)g_bytes_unref);
+    g_object_unref(task);
+}
+
+/*
+ * Same as clippor_entry_get_data(), but if the data has to be loaded from the
+ * database, it is done without blocking.
+ */
+void
+clippor_entry_get_data_async(
+    ClipporEntry *self, const char *mime_type, GCancellable *cancellable,
+    GAsyncReadyCallback callback, void *user_data
+)
+{
+    g_assert(CLIPPOR_IS_ENTRY(self));
+    g_assert(mime_type != NULL);
+
+    GTask *task = g_task_new(self, cancellable, callback, user_data);
+    EntryData *data = g_hash_table_lookup(self->mime_types, mime_type);
+    g_autoptr(ClipporDatabase) db = NULL;
+    GBytes *bytes = NULL;
+
+    g_task_set_source_tag(task, clippor_entry_get_data_async);
+
+    if (data != NULL)
+    {
+        g_mutex_lock(&self->lock);
+
+        if (data->bytes != NULL)
+            bytes = g_bytes_ref(data->bytes);
+        else if (self->db != NULL)
+            db = g_object_ref(self->db);
+
+        g_mutex_unlock(&self->lock);
+    }
+
+    if (db == NULL)
+    {
+        // Mime type doesn't exist if "bytes" is NULL
+        g_task_return_pointer(task, bytes, (GDestroyNotify)g_bytes_unref);
+        g_object_unref(task);
+        return;
+    }
+
+    g_task_set_task_data(
+        task, g_rc_box_acquire(data), (GDestroyNotify)entry_data_unref
+    );
+
+    clippor_database_load_data_async(
+        db, data->data_id, cancellable,
+        (GAsyncReadyCallback)clippor_entry_load_data_callback, task
+    );
+}
+
+/*
+ * Returns a new reference to the data, or NULL if the mime type does not exist
+ * or the data could not be loaded, in which case "error" is set.
+ */
+GBytes *
+clippor_entry_get_data_finish(
+    ClipporEntry *self, GAsyncResult *result, GError **error
+)
+{
+    g_assert(CLIPPOR_IS_ENTRY(self));
+    g_assert(g_task_is_valid(result, self));
+    g_assert(
+        g_task_get_source_tag(G_TASK(result)) == clippor_entry_get_data_async
+    );
+    g_assert(error == NULL || *error == NULL);
+
+    return g_task_propagate_pointer(G_TASK(result), error);
+}
+
+/*
+ * Same as clippor_entry_get_data() but returns NULL instead of loading the data
+ * if it is not in memory.
+ */
+GBytes *
+clippor_entry_peek_data(ClipporEntry *self, const char *mime_type)
+{
+    g_assert(CLIPPOR_IS_ENTRY(self));
+    g_assert(mime_type != NULL);
+
+    EntryData *data = g_hash_table_lookup(self->mime_types, mime_type);
+
+    if (data == NULL)
+        return NULL;
+
+    g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&self->lock);
+
+    return data->bytes == NULL ? NULL : g_bytes_ref(data->bytes);
+}
+
+/*
+ * Returns the data id of the data for "mime_type", or NULL if it is not known.
+ */
+const char *
+clippor_entry_get_data_id(ClipporEntry *self, const char *mime_type)
+{
+    g_assert(CLIPPOR_IS_ENTRY(self));
+    g_assert(mime_type != NULL);
+
+    EntryData *data = g_hash_table_lookup(self->mime_types, mime_type);
+
+    return data == NULL ? NULL : data->data_id;
+}
+
+/*
+ * Returns the size of the data for "mime_type", or -1 if it does not exist.
+ */
+int64_t
+clippor_entry_get_data_size(ClipporEntry *self, const char *mime_type)
+{
+    g_assert(CLIPPOR_IS_ENTRY(self));
+    g_assert(mime_type != NULL);
+
+    EntryData *data = g_hash_table_lookup(self->mime_types, mime_type);
+
+    return data == NULL ? -1 : data->size;
+}
+
+/*
+ * Returns the mime type that the text of the entry is taken from, or NULL if it
+ * doesn't have any text.
+ */
+const char *
+clippor_entry_get_text_mime_type(ClipporEntry *self)
+{
+    g_assert(CLIPPOR_IS_ENTRY(self));
+
+    for (uint i = 0; i < G_N_ELEMENTS(text_mime_types); i++)
+        if (g_hash_table_contains(self->mime_types, text_mime_types[i]))
+            return text_mime_types[i];
+
+    GHashTableIter iter;
+    const char *mime_type;
+
+    g_hash_table_iter_init(&iter, self->mime_types);
+
+    while (g_hash_table_iter_next(&iter, (void **)&mime_type, NULL))
+        if (g_str_has_prefix(mime_type, "text/"))
+            return mime_type;
+
+    return NULL;
+}
+
+/*
+ * Returns what kind of contents the entry has. A list of files also has text,
+ * and an image may have text describing it, so those are checked first.
+ */
+ClipporEntryContent
+clippor_entry_get_content(ClipporEntry *self)
+{
+    g_assert(CLIPPOR_IS_ENTRY(self));
+
+    if (g_hash_table_contains(self->mime_types, "text/uri-list"))
+        return CLIPPOR_ENTRY_CONTENT_URI_LIST;
+
+    GHashTableIter iter;
+    const char *mime_type;
+
+    g_hash_table_iter_init(&iter, self->mime_types);
+
+    while (g_hash_table_iter_next(&iter, (void **)&mime_type, NULL))
+        if (g_str_has_prefix(mime_type, "image/"))
+            return CLIPPOR_ENTRY_CONTENT_IMAGE;
+
+    if (clippor_entry_get_text_mime_type(self) != NULL)
+        return CLIPPOR_ENTRY_CONTENT_TEXT;
+
+    return CLIPPOR_ENTRY_CONTENT_OTHER;
+}
+
+/*
+ * Returns the start of "bytes" as valid UTF-8 on a single line, with every run
+ * of whitespace and control characters replaced by a single space. This is the
+ * preview of an entry whose text is "bytes".
+ */
+char *
+clippor_entry_make_preview(GBytes *bytes)
+{
+    g_assert(bytes != NULL);
+
+    size_t sz;
+    const char *data = g_bytes_get_data(bytes, &sz);
+
+    if (sz == 0)
+        return g_strdup("");
+
+    g_autofree char *text = g_utf8_make_valid(data, MIN(sz, PREVIEW_MAX_TEXT));
+    GString *preview = g_string_new(NULL);
+    gboolean space = FALSE;
+    uint len = 0;
+
+    for (const char *p = text; *p != '\0' && len < PREVIEW_LENGTH;
+         p = g_utf8_next_char(p))
+    {
+        gunichar c = g_utf8_get_char(p);
+
+        if (g_unichar_isspace(c) || g_unichar_iscntrl(c))
+        {
+            // Leading whitespace is dropped
+            space = preview->len > 0;
+            continue;
+        }
+        if (space)
+        {
+            g_string_append_c(preview, ' ');
+            len++;
+            space = FALSE;
+        }
+        g_string_append_unichar(preview, c);
+        len++;
+    }
+
+    return g_string_free(preview, FALSE);
+}
+
+/*
+ * Returns a one line summary of the text of the entry, at most PREVIEW_LENGTH
+ * characters long. It is made from the data if it is in memory, otherwise NULL
+ * is returned unless the preview was set before. The entry owns the string.
+ */
+const char *
+clippor_entry_get_preview(ClipporEntry *self)
+{
+    g_assert(CLIPPOR_IS_ENTRY(self));
+
+    g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&self->lock);
+
+    if (self->preview != NULL)
+        return self->preview;
+
+    const char *mime_type = clippor_entry_get_text_mime_type(self);
+
+    if (mime_type == NULL)
+        return NULL;
+
+    EntryData *data = g_hash_table_lookup(self->mime_types, mime_type);
+
+    if (data->bytes == NULL)
+        return NULL;
+
+    self->preview = clippor_entry_make_preview(data->bytes);
+
+    return self->preview;
+}
+
+/*
+ * Returns the total size of the data of the entry. Data shared between mime
+ * types is only counted once.
+ */
+int64_t
+clippor_entry_get_size(ClipporEntry *self)
+{
+    g_assert(CLIPPOR_IS_ENTRY(self));
+
+    g_autoptr(GHashTable) seen = g_hash_table_new(NULL, NULL);
+    GHashTableIter iter;
+    EntryData *data;
+    int64_t size = 0;
+
+    g_hash_table_iter_init(&iter, self->mime_types);
+
+    while (g_hash_table_iter_next(&iter, NULL, (void **)&data))
+        if (g_hash_table_add(seen, data))
+            size += data->size;
+
+    return size;
 }
 
 const char *
@@ -0,0 +1,459 @@
+#define _GNU_SOURCE // For fallocate() and O_TMPFILE
+#include "clippor-memory-store.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdint.h>
+#include <unistd.h>
+
+/*
+ * Stores the data of an in-memory database. Data is kept in memory until the
+ * total size goes over the budget, after which the least recently used data is
+ * written to an unlinked spill file and dropped from memory. The spill file is
+ * created in a directory on disk rather than in the temporary directory, which
+ * is often a tmpfs that is backed by memory itself. It is read back and kept in
+ * memory again when it is used. Data larger than the whole budget is only ever
+ * kept in the file.
+ *
+ * The spill file is only ever appended to, so spill_end only grows. Data that
+ * is read back keeps its region, and is not written again when it is spilled
+ * the next time. Removed data has its region punched out with
+ * FALLOC_FL_PUNCH_HOLE, which gives the space back to the filesystem, but its
+ * offsets are never reused. The file is sparse rather than compacted.
+ */
+
+typedef struct
+{
+    char *id;
+    GBytes *bytes; // NULL if only in the spill file
+    uint64_t size;
+    int64_t offset; // Offset in the spill file, or -1 if not written to it
+    GList link; // Link in the LRU queue, only used while in memory
+} StoreItem;
+
+struct _ClipporMemoryStore
+{
+    GHashTable *items; // Id -> StoreItem
+    GQueue lru; // Items in memory, most recently used first
+
+    uint64_t budget; // Zero means no limit
+
+    char *spill_dir; // Directory the spill file is created in
+    int spill_fd; // -1 if not created yet
+    int64_t spill_end; // Offset to write the next data at
+
+    ClipporMemoryStoreStats stats;
+};
+
+static void
+store_item_free(StoreItem *item)
+{
+    g_free(item->id);
+    if (item->bytes != NULL)
+        g_bytes_unref(item->bytes);
+    g_free(item);
+}
+
+/*
+ * Create a store that keeps "budget" bytes of data in memory, and spills the
+ * rest to a file in "spill_dir". If "spill_dir" is NULL, the clippor directory
+ * in the user cache directory is used.
+ */
+ClipporMemoryStore *
+clippor_memory_store_new(uint64_t budget, const char *spill_dir)
+{
+    ClipporMemoryStore *self = g_new0(ClipporMemoryStore, 1);
+
+    self->items = g_hash_table_new_full(
+        g_str_hash, g_str_equal, NULL, (GDestroyNotify)store_item_free
+    );
+    g_queue_init(&self->lru);
+
+    self->budget = budget;
+    self->spill_fd = -1;
+
+    if (spill_dir == NULL)
+        self->spill_dir =
+            g_build_filename(g_get_user_cache_dir(), "clippor", NULL);
+    else
+        self->spill_dir = g_strdup(spill_dir);
+
+    return self;
+}
+
+void
+clippor_memory_store_free(ClipporMemoryStore *self)
+{
+    g_assert(self != NULL);
+
+    g_hash_table_unref(self->items);
+
+    if (self->spill_fd != -1)
+        close(self->spill_fd);
+    g_free(self->spill_dir);
+    g_free(self);
+}
+
+/*
+ * Create the spill file. It is never linked into the directory if the file
+ * system supports O_TMPFILE, otherwise it is removed right after it is
+ * created. Either way it is gone once we close it.
+ */
+static gboolean
+clippor_memory_store_open_spill(ClipporMemoryStore *self, GError **error)
+{
+    g_assert(self != NULL);
+    g_assert(self->spill_fd == -1);
+    g_assert(error == NULL || *error == NULL);
+
+    if (g_mkdir_with_parents(self->spill_dir, 0700) == -1)
+    {
+        int saved_errno = errno;
+
+        g_set_error(
+            error, G_FILE_ERROR, g_file_error_from_errno(saved_errno),
+            "Failed creating directory '%s': %s", self->spill_dir,
+            g_strerror(saved_errno)
+        );
+        return FALSE;
+    }
+
+    int fd = open(self->spill_dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+
+    if (fd == -1 && (errno == EOPNOTSUPP || errno == EISDIR))
+    {
+        g_autofree char *path =
+            g_build_filename(self->spill_dir, "store-XXXXXX", NULL);
+
+        fd = g_mkstemp_full(path, O_RDWR | O_CLOEXEC, 0600);
+
+        if (fd != -1)
+            g_unlink(path);
+    }
+
+    if (fd == -1)
+    {
+        int saved_errno = errno;
+
+        g_set_error(
+            error, G_FILE_ERROR, g_file_error_from_errno(saved_errno),
+            "Failed creating spill file in '%s': %s", self->spill_dir,
+            g_strerror(saved_errno)
+        );
+        return FALSE;
+    }
+
+    self->spill_fd = fd;
+
+    return TRUE;
+}
+
+/*
+ * Write the data of the item to the end of the spill file, creating it if
+ * needed.
+ */
+static gboolean
+clippor_memory_store_write_item(
+    ClipporMemoryStore *self, StoreItem *item, GError **error
+)
+{
+    g_assert(self != NULL);
+    g_assert(item != NULL);
+    g_assert(item->bytes != NULL);
+    g_assert(error == NULL || *error == NULL);
+
+    if (self->spill_fd == -1 && !clippor_memory_store_open_spill(self, error))
+        return FALSE;
+
+    const uint8_t *data = g_bytes_get_data(item->bytes, NULL);
+    uint64_t written = 0;
+
+    while (written < item->size)
+    {
+        ssize_t r = pwrite(
+            self->spill_fd, data + written, item->size - written,
+            self->spill_end + written
+        );
+
+        if (r == -1 && errno == EINTR)
+            continue;
+        else if (r == -1)
+        {
+            int saved_errno = errno;
+
+            g_set_error(
+                error, G_FILE_ERROR, g_file_error_from_errno(saved_errno),
+                "Failed writing to spill file: %s", g_strerror(saved_errno)
+            );
+            return FALSE;
+        }
+        written += r;
+    }
+
+    item->offset = self->spill_end;
+    self->spill_end += item->size;
+    self->stats.spills++;
+
+    return TRUE;
+}
+
+/*
+ * Drop the data of the item from memory, writing it to the spill file first if
+ * it isn't there yet. If that fails, the data is kept in memory.
+ */
+static gboolean
+clippor_memory_store_spill_item(ClipporMemoryStore *self, StoreItem *item)
+{
+    g_assert(self != NULL);
+    g_assert(item != NULL);
+
+    g_autoptr(GError) error = NULL;
+
+    if (item->offset == -1 &&
+        !clippor_memory_store_write_item(self, item, &error))
+    {
+        g_warning("Failed spilling data '%s': %s", item->id, error->message);
+        return FALSE;
+    }
+
+    g_queue_unlink(&self->lru, &item->link);
+    g_clear_pointer(&item->bytes, g_bytes_unref);
+
+    self->stats.resident -= item->size;
+    self->stats.spilled += item->size;
+
+    return TRUE;
+}
+
+/*
+ * Spill the least recently used data until we are within the budget again.
+ */
+static void
+clippor_memory_store_enforce_budget(ClipporMemoryStore *self)
+{
+    g_assert(self != NULL);
+
+    while (self->budget > 0 && self->stats.resident > self->budget &&
+           self->lru.tail != NULL)
+    {
+        if (!clippor_memory_store_spill_item(self, self->lru.tail->data))
+            break;
+    }
+}
+
+void
+clippor_memory_store_set_budget(ClipporMemoryStore *self, uint64_t budget)
+{
+    g_assert(self != NULL);
+
+    self->budget = budget;
+    clippor_memory_store_enforce_budget(self);
+}
+
+/*
+ * Keep the data of the item in memory and mark it as the most recently used.
+ */
+static void
+clippor_memory_store_keep_item(
+    ClipporMemoryStore *self, StoreItem *item, GBytes *bytes
+)
+{
+    g_assert(self != NULL);
+    g_assert(item != NULL);
+    g_assert(item->bytes == NULL);
+
+    item->bytes = g_bytes_ref(bytes);
+    item->link.data = item;
+    g_queue_push_head_link(&self->lru, &item->link);
+
+    self->stats.resident += item->size;
+}
+
+/*
+ * Add data to the store under "id". Does nothing if "id" already exists, since
+ * the id is derived from the data.
+ */
+void
+clippor_memory_store_insert(
+    ClipporMemoryStore *self, const char *id, GBytes *bytes
+)
+{
+    g_assert(self != NULL);
+    g_assert(id != NULL);
+    g_assert(bytes != NULL);
+
+    if (g_hash_table_contains(self->items, id))
+        return;
+
+    StoreItem *item = g_new0(StoreItem, 1);
+
+    item->id = g_strdup(id);
+    item->size = g_bytes_get_size(bytes);
+    item->offset = -1;
+
+    g_hash_table_insert(self->items, item->id, item);
+    clippor_memory_store_keep_item(self, item, bytes);
+
+    // Don't push everything else out of memory for data that won't fit anyway
+    if (self->budget > 0 && item->size > self->budget &&
+        clippor_memory_store_spill_item(self, item))
+        return;
+
+    clippor_memory_store_enforce_budget(self);
+}
+
+/*
+ * Read the data of the item back from the spill file.
+ */
+static GBytes *
+clippor_memory_store_read_item(
+    ClipporMemoryStore *self, StoreItem *item, GError **error
+)
+{
+    g_assert(self != NULL);
+    g_assert(item != NULL);
+    g_assert(item->offset != -1);
+    g_assert(error == NULL || *error == NULL);
+
+    uint8_t *data = g_malloc(item->size);
+    uint64_t got = 0;
+
+    while (got < item->size)
+    {
+        ssize_t r = pread(
+            self->spill_fd, data + got, item->size - got, item->offset + got
+        );
+
+        if (r == -1 && errno == EINTR)
+            continue;
+        else if (r <= 0)
+        {
+            int saved_errno = r == 0 ? EIO : errno;
+
+            g_set_error(
+                error, G_FILE_ERROR, g_file_error_from_errno(saved_errno),
+                "Failed reading data '%s' from spill file: %s", item->id,
+                g_strerror(saved_errno)
+            );
+            g_free(data);
+            return NULL;
+        }
+        got += r;
+    }
+
+    self->stats.reloads++;
+
+    return g_bytes_new_take(data, item->size);
+}
+
+/*
+ * Returns a new reference to the data with the given id, reading it back from
+ * the spill file if needed. Returns NULL if it does not exist or could not be
+ * read.
+ */
+GBytes *
+clippor_memory_store_lookup(
+    ClipporMemoryStore *self, const char *id, GError **error
+)
+{
+    g_assert(self != NULL);
+    g_assert(id != NULL);
+    g_assert(error == NULL || *error == NULL);
+
+    StoreItem *item = g_hash_table_lookup(self->items, id);
+
+    if (item == NULL)
+    {
+        g_set_error(
+            error, G_FILE_ERROR, G_FILE_ERROR_NOENT, "Data '%s' does not exist",
+            id
+        );
+        return NULL;
+    }
+
+    if (item->bytes != NULL)
+    {
+        g_queue_unlink(&self->lru, &item->link);
+        g_queue_push_head_link(&self->lru, &item->link);
+
+        return g_bytes_ref(item->bytes);
+    }
+
+    GBytes *bytes = clippor_memory_store_read_item(self, item, error);
+
+    if (bytes == NULL)
+        return NULL;
+
+    // Keep it in memory again since it is being used. Its copy in the spill
+    // file stays valid, so it doesn't need to be written again when spilled.
+    if (self->budget == 0 || item->size <= self->budget)
+    {
+        self->stats.spilled -= item->size;
+        clippor_memory_store_keep_item(self, item, bytes);
+        clippor_memory_store_enforce_budget(self);
+    }
+
+    return bytes;
+}
+
+/*
+ * Returns the size of the data with the given id, or -1 if it does not exist.
+ */
+int64_t
+clippor_memory_store_get_size(ClipporMemoryStore *self, const char *id)
+{
+    g_assert(self != NULL);
+    g_assert(id != NULL);
+
+    StoreItem *item = g_hash_table_lookup(self->items, id);
+
+    return item == NULL ? -1 : (int64_t)item->size;
+}
+
+void
+clippor_memory_store_remove(ClipporMemoryStore *self, const char *id)
+{
+    g_assert(self != NULL);
+    g_assert(id != NULL);
+
+    StoreItem *item = g_hash_table_lookup(self->items, id);
+
+    if (item == NULL)
+        return;
+
+    if (item->bytes != NULL)
+    {
+        g_queue_unlink(&self->lru, &item->link);
+        self->stats.resident -= item->size;
+    }
+    else
+        self->stats.spilled -= item->size;
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+    // Give the space back to the filesystem. Nothing else is ever written
+    // there, so the file just becomes sparse.
+    if (item->offset != -1 && item->size > 0 &&
+        fallocate(
+            self->spill_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+            item->offset, item->size
+        ) == -1)
+        g_debug(
+            "Failed punching hole for data '%s' in spill file: %s", id,
+            g_strerror(errno)
+        );
+#endif
+
+    g_hash_table_remove(self->items, id);
+}
+
+void
+clippor_memory_store_get_stats(
+    ClipporMemoryStore *self, ClipporMemoryStoreStats *stats
+)
+{
+    g_assert(self != NULL);
+    g_assert(stats != NULL);
+
+    *stats = self->stats;
+}
@@ -0,0 +1,359 @@
+#include "clippor-pack.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Stores data by appending it to segment files, instead of creating a file for
+ * each piece of data. Segments are named after their number, and data is only
+ * appended to the newest one, until it would grow past the segment size and a
+ * new one is started. Data is read through a mapping of the whole segment, so
+ * the returned bytes are slices of it. Segments are never modified in place.
+ * The database keeps track of which data lives where, and moves live data out
+ * of segments that are mostly dead so that they can be removed. Only reading
+ * and removing segments may be done from any thread, everything else must be
+ * done by a single thread at a time.
+ */
+
+struct _ClipporPack
+{
+    char *dir;
+    uint64_t segment_size;
+
+    int64_t current; // Segment being appended to, zero if none yet
+    int fd; // -1 if "current" isn't open
+    int64_t end; // Offset the next data is appended at
+    gboolean dirty; // If "fd" has data that isn't synced yet
+    gboolean dir_dirty; // If a segment was created since the last sync
+
+    GHashTable *mappings; // Segment number -> GBytes of the mapped segment
+    GMutex lock; // Protects "mappings"
+};
+
+static char *
+clippor_pack_get_path(ClipporPack *self, int64_t segment)
+{
+    return g_strdup_printf("%s/%" PRId64, self->dir, segment);
+}
+
+/*
+ * Open "segment" for appending, creating it if it doesn't exist yet.
+ */
+static gboolean
+clippor_pack_open_segment(ClipporPack *self, int64_t segment, GError **error)
+{
+    g_assert(self != NULL);
+    g_assert(self->fd == -1);
+    g_assert(error == NULL || *error == NULL);
+
+    g_autofree char *path = clippor_pack_get_path(self, segment);
+    int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    struct stat st;
+
+    if (fd == -1 || fstat(fd, &st) == -1)
+    {
+        int saved_errno = errno;
+
+        if (fd != -1)
+            close(fd);
+
+        g_set_error(
+            error, G_FILE_ERROR, g_file_error_from_errno(saved_errno),
+            "Failed opening segment '%s': %s", path, g_strerror(saved_errno)
+        );
+        return FALSE;
+    }
+
+    self->current = segment;
+    self->fd = fd;
+    self->end = st.st_size;
+    self->dir_dirty = TRUE;
+
+    return TRUE;
+}
+
+/*
+ * Create a pack that stores its segments in "dir". Appending continues in the
+ * newest segment that already exists.
+ */
+ClipporPack *
+clippor_pack_new(const char *dir, uint64_t segment_size, GError **error)
+{
+    g_assert(dir != NULL);
+    g_assert(error == NULL || *error == NULL);
+
+    if (g_mkdir_with_parents(dir, 0755) == -1)
+    {
+        int saved_errno = errno;
+
+        g_set_error(
+            error, G_FILE_ERROR, g_file_error_from_errno(saved_errno),
+            "Failed creating directory '%s': %s", dir, g_strerror(saved_errno)
+        );
+        return NULL;
+    }
+
+    g_autoptr(GDir) d = g_dir_open(dir, 0, error);
+
+    if (d == NULL)
+        return NULL;
+
+    const char *name;
+    int64_t newest = 0;
+
+    while ((name = g_dir_read_name(d)) != NULL)
+    {
+        char *end;
+        int64_t segment = g_ascii_strtoll(name, &end, 10);
+
+        if (*end == '\0' && segment > newest)
+            newest = segment;
+    }
+
+    ClipporPack *self = g_new0(ClipporPack, 1);
+
+    self->dir = g_strdup(dir);
+    self->segment_size = segment_size;
+    self->fd = -1;
+    self->mappings = g_hash_table_new_full(
+        g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)g_bytes_unref
+    );
+    g_mutex_init(&self->lock);
+
+    if (newest > 0 && !clippor_pack_open_segment(self, newest, error))
+    {
+        clippor_pack_free(self);
+        return NULL;
+    }
+
+    return self;
+}
+
+void
+clippor_pack_free(ClipporPack *self)
+{
+    g_assert(self != NULL);
+
+    if (self->fd != -1)
+        close(self->fd);
+    g_hash_table_unref(self->mappings);
+    g_mutex_clear(&self->lock);
+    g_free(self->dir);
+    g_free(self);
+}
+
+/*
+ * Set the size after which a new segment is started. Segments that are already
+ * larger are left as is.
+ */
+void
+clippor_pack_set_segment_size(ClipporPack *self, uint64_t segment_size)
+{
+    g_assert(self != NULL);
+
+    self->segment_size = segment_size;
+}
+
+/*
+ * Append "bytes" to the current segment, starting a new one if it is full. The
+ * location of the data is returned in "segment" and "offset". Data is not
+ * durable until clippor_pack_sync() is called.
+ */
+gboolean
+clippor_pack_append(
+    ClipporPack *self, GBytes *bytes, int64_t *segment, int64_t *offset,
+    GError **error
+)
+{
+    g_assert(self != NULL);
+    g_assert(bytes != NULL);
+    g_assert(segment != NULL);
+    g_assert(offset != NULL);
+    g_assert(error == NULL || *error == NULL);
+
+    size_t sz;
+    const uint8_t *data = g_bytes_get_data(bytes, &sz);
+
+    // Data larger than a whole segment still gets put in a segment of its own
+    if (self->fd != -1 && self->end > 0 &&
+        (uint64_t)self->end + sz > self->segment_size)
+    {
+        if (!clippor_pack_sync(self, error))
+            return FALSE;
+
+        close(self->fd);
+        self->fd = -1;
+    }
+
+    if (self->fd == -1 &&
+        !clippor_pack_open_segment(self, self->current + 1, error))
+        return FALSE;
+
+    size_t written = 0;
+
+    while (written < sz)
+    {
+        ssize_t r = pwrite(
+            self->fd, data + written, sz - written, self->end + written
+        );
+
+        if (r == -1 && errno == EINTR)
+            continue;
+        else if (r == -1)
+        {
+            int saved_errno = errno;
+
+            g_set_error(
+                error, G_FILE_ERROR, g_file_error_from_errno(saved_errno),
+                "Failed writing to segment %" PRId64 ": %s", self->current,
+                g_strerror(saved_errno)
+            );
+            return FALSE;
+        }
+        written += r;
+    }
+
+    *segment = self->current;
+    *offset = self->end;
+
+    self->end += sz;
+    self->dirty = TRUE;
+
+    return TRUE;
+}
+
+/*
+ * Make everything appended so far durable.
+ */
+gboolean
+clippor_pack_sync(ClipporPack *self, GError **error)
+{
+    g_assert(self != NULL);
+    g_assert(error == NULL || *error == NULL);
+
+    if (self->dirty && fdatasync(self->fd) == -1)
+    {
+        int saved_errno = errno;
+
+        g_set_error(
+            error, G_FILE_ERROR, g_file_error_from_errno(saved_errno),
+            "Failed syncing segment %" PRId64 ": %s", self->current,
+            g_strerror(saved_errno)
+        );
+        return FALSE;
+    }
+    self->dirty = FALSE;
+
+    if (self->dir_dirty)
+    {
+        int dir_fd = open(self->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+        if (dir_fd == -1 || fsync(dir_fd) == -1)
+        {
+            int saved_errno = errno;
+
+            if (dir_fd != -1)
+                close(dir_fd);
+
+            g_set_error(
+                error, G_FILE_ERROR, g_file_error_from_errno(saved_errno),
+                "Failed syncing directory '%s': %s", self->dir,
+                g_strerror(saved_errno)
+            );
+            return FALSE;
+        }
+        close(dir_fd);
+        self->dir_dirty = FALSE;
+    }
+
+    return TRUE;
+}
+
+/*
+ * Returns "size" bytes at "offset" in "segment", as a slice of the mapped
+ * segment.
+ */
+GBytes *
+clippor_pack_read(
+    ClipporPack *self, int64_t segment, int64_t offset, int64_t size,
+    GError **error
+)
+{
+    g_assert(self != NULL);
+    g_assert(segment > 0);
+    g_assert(offset >= 0);
+    g_assert(size >= 0);
+    g_assert(error == NULL || *error == NULL);
+
+    g_autoptr(GMutexLocker) locker = g_mutex_locker_new(&self->lock);
+    void *key = GSIZE_TO_POINTER((gsize)segment);
+    GBytes *mapping = g_hash_table_lookup(self->mappings, key);
+
+    // The current segment may have grown since it was mapped
+    if (mapping == NULL ||
+        (uint64_t)(offset + size) > g_bytes_get_size(mapping))
+    {
+        g_autofree char *path = clippor_pack_get_path(self, segment);
+        GMappedFile *file = g_mapped_file_new(path, FALSE, error);
+
+        if (file == NULL)
+        {
+            g_prefix_error(error, "Failed mapping segment '%s': ", path);
+            return NULL;
+        }
+
+        mapping = g_mapped_file_get_bytes(file);
+        g_mapped_file_unref(file);
+
+        g_hash_table_replace(self->mappings, key, mapping);
+    }
+
+    if ((uint64_t)(offset + size) > g_bytes_get_size(mapping))
+    {
+        g_set_error(
+            error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+            "Data at %" PRId64 " in segment %" PRId64 " is past its end",
+            offset, segment
+        );
+        return NULL;
+    }
+
+    return g_bytes_new_from_bytes(mapping, offset, size);
+}
+
+/*
+ * Remove a segment that no data lives in anymore. Data that was already read
+ * from it stays valid.
+ */
+void
+clippor_pack_remove_segment(ClipporPack *self, int64_t segment)
+{
+    g_assert(self != NULL);
+    g_assert(segment != self->current);
+
+    g_autofree char *path = clippor_pack_get_path(self, segment);
+
+    g_mutex_lock(&self->lock);
+    g_hash_table_remove(self->mappings, GSIZE_TO_POINTER((gsize)segment));
+    g_mutex_unlock(&self->lock);
+
+    g_unlink(path);
+}
+
+/*
+ * Returns the segment that data is appended to, which should not be compacted.
+ * Returns zero if there is none yet.
+ */
+int64_t
+clippor_pack_get_current_segment(ClipporPack *self)
+{
+    g_assert(self != NULL);
+
+    return self->current;
+}
@@ -9,6 +9,7 @@
 #include <glib-unix.h>
 #include <glib.h>
 #include <gmodule.h>
+#include <inttypes.h>
 
 G_DEFINE_QUARK(SERVER_ERROR, server_error)
 
@@ -97,19 +98,37 @@ clippor_server_new(ClipporConfig *cfg, ClipporDatabase *db)
     return server;
 }
 
+static void
+database_gc_callback(
+    ClipporDatabase *db, GAsyncResult *result, void *user_data G_GNUC_UNUSED
+)
+{
+    g_autoptr(GError) error = NULL;
+    int64_t reclaimed =
+        clippor_database_collect_garbage_finish(db, result, &error);
+
+    if (reclaimed == -1)
+        g_warning("%s", error->message);
+    else
+        g_debug("Garbage collection reclaimed %" PRId64 " bytes", reclaimed);
+}
+
 static gboolean
-clippor_server_prepare(ClipporServer *self, GError **error)
+clippor_server_prepare(ClipporServer *self, GError **error G_GNUC_UNUSED)
 {
     if (self->db != NULL)
     {
-        // Prepare clipboards
+        // Prepare clipboards. Their entries are restored in the background,
+        // and are offered once the main loop runs.
         for (uint i = 0; i < self->cfg->clipboards->len; i++)
-        {
-            ClipporClipboard *cb = self->cfg->clipboards->pdata[i];
+            clippor_clipboard_set_database(
+                self->cfg->clipboards->pdata[i], self->db
+            );
 
-            if (!clippor_clipboard_set_database(cb, self->db, error))
-                return FALSE;
-        }
+        // Clean up anything left behind by a previous run, in the background
+        clippor_database_collect_garbage_async(
+            self->db, NULL, (GAsyncReadyCallback)database_gc_callback, NULL
+        );
     }
     if (WAYLAND_FUNCS.available)
     {
@@ -132,6 +151,10 @@ clippor_server_handle_signal(ClipporServer *self)
 
     g_message("Exiting...");
 
+    // Don't lose entries that are still waiting for their write delay
+    for (uint i = 0; i < self->cfg->clipboards->len; i++)
+        clippor_clipboard_flush(self->cfg->clipboards->pdata[i]);
+
     for (uint i = 0; i < G_N_ELEMENTS(self->signals); i++)
         g_source_remove(self->signals[i]);
 
@@ -180,6 +203,10 @@ clippor_server_start(ClipporServer *self, GError **error)
     g_main_loop_unref(self->loop);
     clippor_server_stop_dbus(self);
 
+    // Make sure everything has been written to the database before exiting
+    if (self->db != NULL)
+        clippor_database_flush(self->db);
+
     return TRUE;
 }
 
@@ -228,6 +255,112 @@ on_name_lost(
         g_main_loop_quit(server->loop);
 }
 
+// Pending search method call
+typedef struct
+{
+    DBusClipporClipboard *object;
+    GDBusMethodInvocation *invocation;
+} SearchCall;
+
+static void
+search_callback(GObject *object, GAsyncResult *result, SearchCall *call)
+{
+    g_autoptr(GError) error = NULL;
+    g_autoptr(GPtrArray) results = clippor_database_search_finish(
+        CLIPPOR_DATABASE(object), result, &error
+    );
+
+    if (results == NULL)
+        g_dbus_method_invocation_return_gerror(call->invocation, error);
+    else
+    {
+        GVariantBuilder builder;
+
+        g_variant_builder_init(&builder, G_VARIANT_TYPE("a(ss)"));
+
+        for (uint i = 0; i < results->len; i++)
+        {
+            ClipporSearchResult *result = results->pdata[i];
+
+            g_variant_builder_add(
+                &builder, "(ss)", result->id, result->snippet
+            );
+        }
+
+        dbus_clippor_clipboard_complete_search(
+            call->object, call->invocation, g_variant_builder_end(&builder)
+        );
+    }
+
+    g_object_unref(call->object);
+    g_free(call);
+}
+
+static gboolean
+on_handle_search(
+    DBusClipporClipboard *object, GDBusMethodInvocation *invocation,
+    const char *query, int64_t number, ClipporClipboard *cb
+)
+{
+    ClipporDatabase *db = clippor_clipboard_get_database(cb);
+
+    if (db == NULL || number <= 0)
+    {
+        // Nothing to search through
+        GVariant *empty =
+            g_variant_new_array(G_VARIANT_TYPE("(ss)"), NULL, 0);
+
+        dbus_clippor_clipboard_complete_search(object, invocation, empty);
+        return TRUE;
+    }
+
+    // Searching is done in a worker thread, so that clients don't hold up the
+    // main context.
+    SearchCall *call = g_new(SearchCall, 1);
+
+    call->object = g_object_ref(object);
+    call->invocation = invocation;
+
+    clippor_database_search_async(
+        db, clippor_clipboard_get_label(cb), query, number, NULL,
+        (GAsyncReadyCallback)search_callback, call
+    );
+
+    return TRUE;
+}
+
+/*
+ * Export a DBus object for each clipboard under
+ * "/com/github/Clippor/Clipboards".
+ */
+static void
+clippor_server_export_clipboards(ClipporServer *self)
+{
+    g_assert(CLIPPOR_IS_SERVER(self));
+
+    for (uint i = 0; i < self->cfg->clipboards->len; i++)
+    {
+        ClipporClipboard *cb = self->cfg->clipboards->pdata[i];
+        g_autofree char *label =
+            g_dbus_escape_object_path(clippor_clipboard_get_label(cb));
+        g_autofree char *path =
+            g_strdup_printf("/com/github/Clippor/Clipboards/%s", label);
+
+        g_autoptr(DBusObjectSkeleton) object = dbus_object_skeleton_new(path);
+        g_autoptr(DBusClipporClipboard) iface =
+            dbus_clippor_clipboard_skeleton_new();
+
+        g_signal_connect_object(
+            iface, "handle-search", G_CALLBACK(on_handle_search), cb, 0
+        );
+
+        dbus_object_skeleton_set_clippor_clipboard(object, iface);
+        g_dbus_object_manager_server_export(
+            self->dbus.clipboards_manager, G_DBUS_OBJECT_SKELETON(object)
+        );
+    }
+}
+
 /*
  * Own the DBus name and start the service. Returns FALSE on error.
  */
@@ -279,6 +412,7 @@ clippor_server_start_dbus(ClipporServer *self)
             g_dbus_object_manager_server_set_connection(
                 self->dbus.clipboards_manager, self->dbus.connection
             );
+            clippor_server_export_clipboards(self);
         }
 
         return;
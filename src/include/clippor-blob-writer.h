@@ -0,0 +1,18 @@
+#pragma once
+
+#include <glib.h>
+
+typedef struct _ClipporBlobWriter ClipporBlobWriter;
+
+ClipporBlobWriter *clippor_blob_writer_new(const char *dir);
+void clippor_blob_writer_free(ClipporBlobWriter *self);
+
+gboolean clippor_blob_writer_stage(
+    ClipporBlobWriter *self, const char *name, GBytes *bytes, GError **error
+);
+gboolean clippor_blob_writer_commit(ClipporBlobWriter *self, GError **error);
+void clippor_blob_writer_discard(ClipporBlobWriter *self);
+
+uint clippor_blob_writer_get_pending(ClipporBlobWriter *self);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(ClipporBlobWriter, clippor_blob_writer_free)
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <glib.h>
+#include <stdint.h>
+
+typedef enum
+{
+    CLIPPOR_CHECKSUM_SHA1 = 0,
+    CLIPPOR_CHECKSUM_XXH64 = 1
+} ClipporChecksumType;
+
+typedef struct _ClipporChecksum ClipporChecksum;
+
+ClipporChecksum *clippor_checksum_new(ClipporChecksumType type);
+void clippor_checksum_free(ClipporChecksum *self);
+void clippor_checksum_reset(ClipporChecksum *self);
+
+void clippor_checksum_update(
+    ClipporChecksum *self, const uint8_t *data, size_t len
+);
+char *clippor_checksum_get_string(ClipporChecksum *self);
+
+char *
+clippor_checksum_compute_for_bytes(ClipporChecksumType type, GBytes *bytes);
+ClipporChecksumType clippor_checksum_type_from_string(const char *checksum);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(ClipporChecksum, clippor_checksum_free)
@@ -17,9 +17,8 @@ typedef enum
 
 ClipporClipboard *clippor_clipboard_new(const char *label);
 
-gboolean clippor_clipboard_set_database(
-    ClipporClipboard *self, ClipporDatabase *db, GError **error
-);
+void
+clippor_clipboard_set_database(ClipporClipboard *self, ClipporDatabase *db);
 
 void
 clippor_clipboard_add_selection(ClipporClipboard *self, ClipporSelection *sel);
@@ -27,6 +26,9 @@ void clippor_clipboard_connect_selection(
     ClipporClipboard *self, ClipporSelection *sel
 );
 
+void clippor_clipboard_flush(ClipporClipboard *self);
+
 const char *clippor_clipboard_get_label(ClipporClipboard *self);
+ClipporDatabase *clippor_clipboard_get_database(ClipporClipboard *self);
 
 ClipporEntry *clippor_clipboard_get_entry(ClipporClipboard *self);
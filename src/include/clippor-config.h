@@ -1,9 +1,19 @@
 #pragma once
 
+#include "clippor-database.h"
 #include <glib.h>
 
 typedef struct
 {
+    struct
+    {
+        ClipporDatabaseFlags flags; // Flags to open the database with
+        int64_t inline_threshold;   // -1 if not set
+        int64_t memory_budget;      // -1 if not set
+        int64_t entry_cache_size;   // -1 if not set
+        int64_t segment_size;       // -1 if not set
+    } database;
+
     // Don't use a hash table since clipboard labels can be changed by the user
     // when the program is running.
     GPtrArray *clipboards;
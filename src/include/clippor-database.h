@@ -1,6 +1,9 @@
 #pragma once
 
+#include "clippor-checksum.h"
 #include "clippor-entry.h"
+#include "clippor-memory-store.h"
+#include <gio/gio.h>
 #include <glib-object.h>
 #include <glib.h>
 
@@ -26,14 +29,61 @@ GQuark clippor_database_error_quark(void);
 typedef enum
 {
     CLIPPOR_DATABASE_DEFAULT = 0,
-    CLIPPOR_DATABASE_IN_MEMORY = 1 << 0
+    CLIPPOR_DATABASE_IN_MEMORY = 1 << 0,
+    // Use XXH64 instead of SHA1 for data ids
+    CLIPPOR_DATABASE_FAST_CHECKSUM = 1 << 1,
+    // Append data to segment files instead of creating a file for each
+    CLIPPOR_DATABASE_PACKED = 1 << 2
 } ClipporDatabaseBitFlags;
 
 typedef uint32_t ClipporDatabaseFlags;
 
+// Statistics for a single kind of maintenance step
+typedef struct
+{
+    uint64_t runs; // Number of times the step was run
+    int64_t time; // Total time spent running it, in microseconds
+    uint64_t pages; // Number of pages checkpointed or freed, or bytes moved
+                    // out of segments
+} ClipporDatabaseMaintenanceStats;
+
+typedef struct
+{
+    uint64_t statements_prepared; // Number of times a statement was compiled
+    uint64_t statement_cache_hits; // Number of times a cached statement was
+                                   // reused
+
+    uint64_t entry_cache_hits; // Number of entries loaded from the cache
+    uint64_t entry_cache_misses; // Number of entries not found in the cache
+    uint64_t entry_cache_used; // Estimated size of cached entries in bytes
+
+    uint64_t blob_batches; // Number of batches of data files made durable
+    uint64_t blobs_written; // Number of data files written in those batches
+
+    uint64_t readers_opened; // Number of read-only connections opened
+
+    ClipporDatabaseMaintenanceStats checkpoint;
+    ClipporDatabaseMaintenanceStats pack;
+    ClipporDatabaseMaintenanceStats vacuum;
+    ClipporDatabaseMaintenanceStats optimize;
+
+    ClipporMemoryStoreStats store; // Only used for in-memory databases
+} ClipporDatabaseStats;
+
+typedef struct
+{
+    char *id; // Id of entry
+    char *snippet; // Part of the text of the entry that matched
+} ClipporSearchResult;
+
+void clippor_search_result_free(ClipporSearchResult *result);
+
 ClipporDatabase *
 clippor_database_new(const char *data_directory, uint flags, GError **error);
 
+ClipporChecksumType
+clippor_database_get_checksum_type(ClipporDatabase *self);
+
 int clippor_database_entry_exists(
     ClipporDatabase *self, ClipporEntry *entry, GError **error
 );
@@ -41,6 +91,13 @@ int clippor_database_entry_exists(
 gboolean clippor_database_serialize_entry(
     ClipporDatabase *self, ClipporEntry *entry, GError **error
 );
+int clippor_database_promote_entry(
+    ClipporDatabase *self, ClipporEntry *entry, GError **error
+);
+gboolean clippor_database_add_entry(
+    ClipporDatabase *self, ClipporEntry *entry, int64_t max_entries,
+    int64_t max_bytes, GError **error
+);
 
 ClipporEntry *clippor_database_deserialize_entry_at_index(
     ClipporDatabase *self, const char *cb, int64_t index, GError **error
@@ -48,9 +105,113 @@ ClipporEntry *clippor_database_deserialize_entry_at_index(
 ClipporEntry *clippor_database_deserialize_entry_with_id(
     ClipporDatabase *self, const char *id, GError **error
 );
+GBytes *clippor_database_load_data(
+    ClipporDatabase *self, const char *data_id, GError **error
+);
+void clippor_database_load_data_async(
+    ClipporDatabase *self, const char *data_id, GCancellable *cancellable,
+    GAsyncReadyCallback callback, void *user_data
+);
+GBytes *clippor_database_load_data_finish(
+    ClipporDatabase *self, GAsyncResult *result, GError **error
+);
 GPtrArray *clippor_database_deserialize_entries(
-    ClipporDatabase *self, int64_t start, int64_t end, GError **error
+    ClipporDatabase *self, const char *cb, int64_t n, int64_t *cursor,
+    GError **error
+);
+GPtrArray *clippor_database_search(
+    ClipporDatabase *self, const char *cb, const char *query, int64_t n,
+    GError **error
 );
 gboolean clippor_database_trim_entries(
     ClipporDatabase *self, const char *cb, int64_t n, GError **error
 );
+gboolean clippor_database_delete_entry(
+    ClipporDatabase *self, const char *id, GError **error
+);
+int64_t clippor_database_expire_entries(
+    ClipporDatabase *self, const char *cb, int64_t max_age,
+    int64_t sensitive_age, GError **error
+);
+int64_t
+clippor_database_collect_garbage(ClipporDatabase *self, GError **error);
+gboolean
+clippor_database_run_maintenance(ClipporDatabase *self, GError **error);
+
+void clippor_database_serialize_entry_async(
+    ClipporDatabase *self, ClipporEntry *entry, GCancellable *cancellable,
+    GAsyncReadyCallback callback, void *user_data
+);
+gboolean clippor_database_serialize_entry_finish(
+    ClipporDatabase *self, GAsyncResult *result, GError **error
+);
+void clippor_database_add_entry_async(
+    ClipporDatabase *self, ClipporEntry *entry, int64_t max_entries,
+    int64_t max_bytes, GCancellable *cancellable, GAsyncReadyCallback callback,
+    void *user_data
+);
+gboolean clippor_database_add_entry_finish(
+    ClipporDatabase *self, GAsyncResult *result, GError **error
+);
+void clippor_database_expire_entries_async(
+    ClipporDatabase *self, const char *cb, int64_t max_age,
+    int64_t sensitive_age, GCancellable *cancellable,
+    GAsyncReadyCallback callback, void *user_data
+);
+int64_t clippor_database_expire_entries_finish(
+    ClipporDatabase *self, GAsyncResult *result, GError **error
+);
+void clippor_database_trim_entries_async(
+    ClipporDatabase *self, const char *cb, int64_t n, GCancellable *cancellable,
+    GAsyncReadyCallback callback, void *user_data
+);
+int64_t clippor_database_trim_entries_finish(
+    ClipporDatabase *self, GAsyncResult *result, GError **error
+);
+void clippor_database_delete_entry_async(
+    ClipporDatabase *self, const char *id, GCancellable *cancellable,
+    GAsyncReadyCallback callback, void *user_data
+);
+gboolean clippor_database_delete_entry_finish(
+    ClipporDatabase *self, GAsyncResult *result, GError **error
+);
+void clippor_database_search_async(
+    ClipporDatabase *self, const char *cb, const char *query, int64_t n,
+    GCancellable *cancellable, GAsyncReadyCallback callback, void *user_data
+);
+GPtrArray *clippor_database_search_finish(
+    ClipporDatabase *self, GAsyncResult *result, GError **error
+);
+void clippor_database_deserialize_entries_async(
+    ClipporDatabase *self, const char *cb, int64_t n, int64_t cursor,
+    GCancellable *cancellable, GAsyncReadyCallback callback, void *user_data
+);
+GPtrArray *clippor_database_deserialize_entries_finish(
+    ClipporDatabase *self, GAsyncResult *result, int64_t *cursor,
+    GError **error
+);
+void clippor_database_deserialize_entry_with_id_async(
+    ClipporDatabase *self, const char *id, GCancellable *cancellable,
+    GAsyncReadyCallback callback, void *user_data
+);
+ClipporEntry *clippor_database_deserialize_entry_with_id_finish(
+    ClipporDatabase *self, GAsyncResult *result, GError **error
+);
+void clippor_database_deserialize_entry_at_index_async(
+    ClipporDatabase *self, const char *cb, int64_t index,
+    GCancellable *cancellable, GAsyncReadyCallback callback, void *user_data
+);
+ClipporEntry *clippor_database_deserialize_entry_at_index_finish(
+    ClipporDatabase *self, GAsyncResult *result, GError **error
+);
+void clippor_database_collect_garbage_async(
+    ClipporDatabase *self, GCancellable *cancellable,
+    GAsyncReadyCallback callback, void *user_data
+);
+int64_t clippor_database_collect_garbage_finish(
+    ClipporDatabase *self, GAsyncResult *result, GError **error
+);
+void clippor_database_flush(ClipporDatabase *self);
+
+void
+clippor_database_get_stats(ClipporDatabase *self, ClipporDatabaseStats *stats);
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <gio/gio.h>
 #include <glib-object.h>
 #include <glib.h>
 #include <stdint.h>
@@ -13,23 +14,63 @@ typedef enum
 
 typedef uint32_t ClipporEntryFlags;
 
+// Kind of contents an entry has, decided from its mime types
+typedef enum
+{
+    CLIPPOR_ENTRY_CONTENT_OTHER = 0,
+    CLIPPOR_ENTRY_CONTENT_TEXT = 1,
+    CLIPPOR_ENTRY_CONTENT_IMAGE = 2,
+    CLIPPOR_ENTRY_CONTENT_URI_LIST = 3
+} ClipporEntryContent;
+
 G_DECLARE_FINAL_TYPE(ClipporEntry, clippor_entry, CLIPPOR, ENTRY, GObject)
 #define CLIPPOR_TYPE_ENTRY (clippor_entry_get_type())
 
 typedef struct _ClipporClipboard ClipporClipboard;
+typedef struct _ClipporDatabase ClipporDatabase;
 
 ClipporEntry *clippor_entry_new_full(
     const char *cb_label, const char *id, int64_t creation_time,
     int64_t last_used_time, ClipporEntryFlags flags
 );
 ClipporEntry *clippor_entry_new(ClipporClipboard *cb);
+ClipporEntry *clippor_entry_copy(ClipporEntry *self);
 
 void clippor_entry_add_mime_type(
     ClipporEntry *self, const char *mime_type, GBytes *data
 );
+void clippor_entry_add_mime_type_with_id(
+    ClipporEntry *self, const char *mime_type, GBytes *data,
+    const char *data_id
+);
+void clippor_entry_add_mime_type_lazy(
+    ClipporEntry *self, const char *mime_type, const char *data_id,
+    int64_t size
+);
+
+void clippor_entry_set_database(ClipporEntry *self, ClipporDatabase *db);
+void clippor_entry_set_preview(ClipporEntry *self, const char *preview);
+uint64_t clippor_entry_release_data(ClipporEntry *self);
 
 GHashTable *clippor_entry_get_mime_types(ClipporEntry *self);
 GBytes *clippor_entry_get_data(ClipporEntry *self, const char *mime_type);
+void clippor_entry_get_data_async(
+    ClipporEntry *self, const char *mime_type, GCancellable *cancellable,
+    GAsyncReadyCallback callback, void *user_data
+);
+GBytes *clippor_entry_get_data_finish(
+    ClipporEntry *self, GAsyncResult *result, GError **error
+);
+GBytes *clippor_entry_peek_data(ClipporEntry *self, const char *mime_type);
+const char *
+clippor_entry_get_data_id(ClipporEntry *self, const char *mime_type);
+int64_t
+clippor_entry_get_data_size(ClipporEntry *self, const char *mime_type);
+const char *clippor_entry_get_text_mime_type(ClipporEntry *self);
+ClipporEntryContent clippor_entry_get_content(ClipporEntry *self);
+const char *clippor_entry_get_preview(ClipporEntry *self);
+char *clippor_entry_make_preview(GBytes *bytes);
+int64_t clippor_entry_get_size(ClipporEntry *self);
 const char *clippor_entry_get_clipboard(ClipporEntry *self);
 int64_t clippor_entry_get_creation_time(ClipporEntry *self);
 int64_t clippor_entry_get_last_used_time(ClipporEntry *self);
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <glib.h>
+#include <stdint.h>
+
+typedef struct _ClipporMemoryStore ClipporMemoryStore;
+
+typedef struct
+{
+    uint64_t resident; // Bytes of data kept in memory
+    uint64_t spilled; // Bytes of data only stored in the spill file
+    uint64_t spills; // Number of times data was written to the spill file
+    uint64_t reloads; // Number of times data was read from the spill file
+} ClipporMemoryStoreStats;
+
+ClipporMemoryStore *
+clippor_memory_store_new(uint64_t budget, const char *spill_dir);
+void clippor_memory_store_free(ClipporMemoryStore *self);
+
+void clippor_memory_store_set_budget(ClipporMemoryStore *self, uint64_t budget);
+
+void clippor_memory_store_insert(
+    ClipporMemoryStore *self, const char *id, GBytes *bytes
+);
+GBytes *clippor_memory_store_lookup(
+    ClipporMemoryStore *self, const char *id, GError **error
+);
+int64_t clippor_memory_store_get_size(ClipporMemoryStore *self, const char *id);
+void clippor_memory_store_remove(ClipporMemoryStore *self, const char *id);
+
+void clippor_memory_store_get_stats(
+    ClipporMemoryStore *self, ClipporMemoryStoreStats *stats
+);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(ClipporMemoryStore, clippor_memory_store_free)
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <glib.h>
+#include <stdint.h>
+
+typedef struct _ClipporPack ClipporPack;
+
+ClipporPack *
+clippor_pack_new(const char *dir, uint64_t segment_size, GError **error);
+void clippor_pack_free(ClipporPack *self);
+
+void clippor_pack_set_segment_size(ClipporPack *self, uint64_t segment_size);
+
+gboolean clippor_pack_append(
+    ClipporPack *self, GBytes *bytes, int64_t *segment, int64_t *offset,
+    GError **error
+);
+gboolean clippor_pack_sync(ClipporPack *self, GError **error);
+GBytes *clippor_pack_read(
+    ClipporPack *self, int64_t segment, int64_t offset, int64_t size,
+    GError **error
+);
+void clippor_pack_remove_segment(ClipporPack *self, int64_t segment);
+
+int64_t clippor_pack_get_current_segment(ClipporPack *self);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC(ClipporPack, clippor_pack_free)
@@ -56,7 +56,7 @@ main(int argc, char **argv)
         return EXIT_FAILURE;
     }
 
-    db = clippor_database_new(opt_data_dir, CLIPPOR_DATABASE_DEFAULT, &error);
+    db = clippor_database_new(opt_data_dir, cfg->database.flags, &error);
 
     if (db == NULL)
     {
@@ -65,6 +65,19 @@ main(int argc, char **argv)
         return EXIT_FAILURE;
     }
 
+    if (cfg->database.inline_threshold >= 0)
+        g_object_set(
+            db, "inline-threshold", cfg->database.inline_threshold, NULL
+        );
+    if (cfg->database.memory_budget >= 0)
+        g_object_set(db, "memory-budget", cfg->database.memory_budget, NULL);
+    if (cfg->database.entry_cache_size >= 0)
+        g_object_set(
+            db, "entry-cache-size", cfg->database.entry_cache_size, NULL
+        );
+    if (cfg->database.segment_size >= 0)
+        g_object_set(db, "segment-size", cfg->database.segment_size, NULL);
+
     g_autoptr(ClipporServer) server = clippor_server_new(cfg, db);
 
     if (!clippor_server_start(server, &error))
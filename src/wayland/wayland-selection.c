@@ -163,28 +163,46 @@ send_data_async_callback(GObject *object, GAsyncResult *result, void *user_data)
 }
 
 static void
-data_source_listener_event_send(
-    void *data, WaylandDataSource *source G_GNUC_UNUSED, const char *mime_type,
-    int fd
-)
+send_data_load_callback(GObject *object, GAsyncResult *result, void *user_data)
 {
-    WaylandSelection *wsel = data;
-    ClipporEntry *entry = clippor_selection_get_entry(CLIPPOR_SELECTION(wsel));
-    GBytes *bytes = clippor_entry_get_data(entry, mime_type);
+    ClipporEntry *entry = CLIPPOR_ENTRY(object);
+    int fd = GPOINTER_TO_INT(user_data);
 
-    // No such mime type
+    GError *error = NULL;
+    GBytes *bytes = clippor_entry_get_data_finish(entry, result, &error);
+
+    // No such mime type or the data could not be loaded
     if (bytes == NULL)
     {
+        if (error != NULL)
+        {
+            g_warning("Failed loading data: %s", error->message);
+            g_error_free(error);
+        }
         close(fd);
         return;
     }
 
-    // Send data asynchronously
+    // Send data asynchronously, callback takes ownership of "bytes"
     GOutputStream *stream = g_unix_output_stream_new(fd, TRUE);
 
     g_output_stream_write_bytes_async(
-        stream, bytes, G_PRIORITY_HIGH, NULL, send_data_async_callback,
-        g_bytes_ref(bytes)
+        stream, bytes, G_PRIORITY_HIGH, NULL, send_data_async_callback, bytes
+    );
+}
+
+static void
+data_source_listener_event_send(
+    void *data, WaylandDataSource *source G_GNUC_UNUSED, const char *mime_type,
+    int fd
+)
+{
+    WaylandSelection *wsel = data;
+    ClipporEntry *entry = clippor_selection_get_entry(CLIPPOR_SELECTION(wsel));
+
+    // Data is loaded without blocking if it isn't in memory
+    clippor_entry_get_data_async(
+        entry, mime_type, NULL, send_data_load_callback, GINT_TO_POINTER(fd)
     );
 }
 
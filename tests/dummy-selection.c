@@ -125,18 +125,17 @@ dummy_selection_own(DummySelection *self)
 
     GHashTableIter iter;
     const char *mime_type;
-    GBytes *bytes;
 
     g_hash_table_iter_init(&iter, clippor_entry_get_mime_types(entry));
 
-    while (g_hash_table_iter_next(&iter, (void **)&mime_type, (void **)&bytes))
+    while (g_hash_table_iter_next(&iter, (void **)&mime_type, NULL))
     {
+        GBytes *bytes = clippor_entry_get_data(entry, mime_type);
+
         g_assert_nonnull(mime_type);
         g_assert_nonnull(bytes);
 
-        g_hash_table_insert(
-            self->mime_types, g_strdup(mime_type), g_bytes_ref(bytes)
-        );
+        g_hash_table_insert(self->mime_types, g_strdup(mime_type), bytes);
     }
     self->has_offer = FALSE;
     self->has_source = TRUE;
@@ -1,4 +1,5 @@
 #include "clippor-clipboard.h"
+#include "clippor-database.h"
 #include "dummy-selection.h"
 #include "test.h"
 #include <glib.h>
@@ -72,6 +73,155 @@ test_clipboard_update(TEST_ARGS)
     g_assert_true(clippor_selection_is_owned(CLIPPOR_SELECTION(psel)));
 }
 
+/*
+ * Test if only the last entry is written to the database when the selection
+ * changes again before the write delay passes.
+ */
+static void
+test_clipboard_write_delay(TEST_ARGS)
+{
+    ClipporClipboard *cb = fixture->cb;
+    g_autoptr(GError) error = NULL;
+    g_autoptr(ClipporDatabase) db =
+        clippor_database_new(NULL, CLIPPOR_DATABASE_IN_MEMORY, &error);
+
+    g_assert_no_error(error);
+
+    clippor_clipboard_set_database(cb, db);
+
+    g_object_set(cb, "write-delay", G_MAXUINT, NULL);
+
+    g_autoptr(DummySelection) sel =
+        dummy_selection_new(CLIPPOR_SELECTION_TYPE_REGULAR);
+
+    clippor_clipboard_add_selection(cb, CLIPPOR_SELECTION(sel));
+    dummy_selection_install_source(sel, fixture->context);
+
+    dummy_selection_copy(sel, "First", "text/plain", NULL);
+    main_context_dispatch(fixture->context);
+    dummy_selection_copy(sel, "Second", "text/plain", NULL);
+    main_context_dispatch(fixture->context);
+
+    // Nothing should be written until the delay passes
+    clippor_database_flush(db);
+
+    g_autoptr(ClipporEntry) entry =
+        clippor_database_deserialize_entry_at_index(db, "TEST", 0, &error);
+
+    g_assert_error(
+        error, CLIPPOR_DATABASE_ERROR, CLIPPOR_DATABASE_ERROR_ROW_NOT_EXIST
+    );
+    g_clear_error(&error);
+
+    clippor_clipboard_flush(cb);
+    clippor_database_flush(db);
+
+    entry = clippor_database_deserialize_entry_at_index(db, "TEST", 0, &error);
+    g_assert_no_error(error);
+
+    g_autoptr(GBytes) bytes = clippor_entry_get_data(entry, "text/plain");
+
+    g_assert_cmpmem(
+        g_bytes_get_data(bytes, NULL), g_bytes_get_size(bytes), "Second", 6
+    );
+
+    g_autoptr(ClipporEntry) old =
+        clippor_database_deserialize_entry_at_index(db, "TEST", 1, &error);
+
+    g_assert_error(
+        error, CLIPPOR_DATABASE_ERROR, CLIPPOR_DATABASE_ERROR_ROW_NOT_EXIST
+    );
+    g_assert_null(old);
+}
+
+/*
+ * Test if the entry waiting for the write delay is written when the clipboard
+ * is disposed, without anything left behind that refers to the clipboard.
+ */
+static void
+test_clipboard_dispose(TEST_ARGS)
+{
+    ClipporClipboard *cb = fixture->cb;
+    g_autoptr(GError) error = NULL;
+    g_autoptr(ClipporDatabase) db =
+        clippor_database_new(NULL, CLIPPOR_DATABASE_IN_MEMORY, &error);
+
+    g_assert_no_error(error);
+
+    g_object_set(cb, "write-delay", G_MAXUINT, "max-age", 60, NULL);
+    clippor_clipboard_set_database(cb, db);
+
+    g_autoptr(DummySelection) sel =
+        dummy_selection_new(CLIPPOR_SELECTION_TYPE_REGULAR);
+
+    clippor_clipboard_add_selection(cb, CLIPPOR_SELECTION(sel));
+    dummy_selection_install_source(sel, fixture->context);
+
+    dummy_selection_copy(sel, "Pending", "text/plain", NULL);
+    main_context_dispatch(fixture->context);
+
+    g_object_run_dispose(G_OBJECT(cb));
+
+    clippor_database_flush(db);
+    main_context_dispatch(fixture->context);
+
+    g_assert_null(
+        g_main_context_find_source_by_user_data(fixture->context, cb)
+    );
+
+    g_autoptr(ClipporEntry) entry =
+        clippor_database_deserialize_entry_at_index(db, "TEST", 0, &error);
+
+    g_assert_no_error(error);
+
+    g_autoptr(GBytes) bytes = clippor_entry_get_data(entry, "text/plain");
+
+    g_assert_cmpmem(
+        g_bytes_get_data(bytes, NULL), g_bytes_get_size(bytes), "Pending", 7
+    );
+}
+
+/*
+ * Test if the most recent entry in the database is restored and offered once
+ * the clipboard is given the database.
+ */
+static void
+test_clipboard_restore(TEST_ARGS)
+{
+    ClipporClipboard *cb = fixture->cb;
+    g_autoptr(GError) error = NULL;
+    g_autoptr(ClipporDatabase) db =
+        clippor_database_new(NULL, CLIPPOR_DATABASE_IN_MEMORY, &error);
+
+    g_assert_no_error(error);
+
+    g_autoptr(ClipporEntry) entry = clippor_entry_new(cb);
+    g_autoptr(GBytes) bytes = g_bytes_new_static("Restored", 8);
+
+    clippor_entry_add_mime_type(entry, "text/plain", bytes);
+
+    g_assert_true(clippor_database_add_entry(db, entry, 10, 0, &error));
+    g_assert_no_error(error);
+
+    g_autoptr(DummySelection) sel =
+        dummy_selection_new(CLIPPOR_SELECTION_TYPE_REGULAR);
+
+    clippor_clipboard_add_selection(cb, CLIPPOR_SELECTION(sel));
+    dummy_selection_install_source(sel, fixture->context);
+
+    clippor_clipboard_set_database(cb, db);
+
+    // Entry is loaded in a worker thread
+    while (clippor_clipboard_get_entry(cb) == NULL)
+        g_main_context_iteration(fixture->context, TRUE);
+
+    g_assert_cmpstr(
+        clippor_entry_get_id(clippor_clipboard_get_entry(cb)), ==,
+        clippor_entry_get_id(entry)
+    );
+    g_assert_cmpstr(dummy_selection_paste(sel, "text/plain"), ==, "Restored");
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -82,6 +232,9 @@ main(int argc, char *argv[])
     test_setup();
 
     TEST("/clipboard/update", test_clipboard_update);
+    TEST("/clipboard/write-delay", test_clipboard_write_delay);
+    TEST("/clipboard/dispose", test_clipboard_dispose);
+    TEST("/clipboard/restore", test_clipboard_restore);
 
     return g_test_run();
 }
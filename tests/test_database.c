@@ -0,0 +1,1746 @@
+#include "clippor-checksum.h"
+#include "clippor-database.h"
+#include "clippor-entry.h"
+#include "test.h"
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <locale.h>
+#include <sqlite3.h>
+
+typedef struct
+{
+    GMainContext *context;
+    ClipporDatabase *db;
+} TestFixture;
+
+static void
+test_fixture_setup(TEST_ARGS)
+{
+    g_autoptr(GError) error = NULL;
+
+    fixture->context = g_main_context_new();
+    fixture->db =
+        clippor_database_new(NULL, CLIPPOR_DATABASE_IN_MEMORY, &error);
+
+    g_assert_no_error(error);
+
+    g_main_context_push_thread_default(fixture->context);
+}
+
+static void
+test_fixture_teardown(TEST_ARGS)
+{
+    g_main_context_pop_thread_default(fixture->context);
+
+    g_main_context_unref(fixture->context);
+    g_object_unref(fixture->db);
+}
+
+/*
+ * Create a new entry for clipboard "cb" with the given text.
+ */
+static ClipporEntry *
+new_text_entry_for(const char *cb, const char *id, const char *text)
+{
+    int64_t time = g_get_real_time();
+    ClipporEntry *entry =
+        clippor_entry_new_full(cb, id, time, time, CLIPPOR_ENTRY_FLAG_NONE);
+    g_autoptr(GBytes) bytes = g_bytes_new(text, strlen(text));
+
+    clippor_entry_add_mime_type(entry, "text/plain", bytes);
+    clippor_entry_add_mime_type(entry, "TEXT", bytes);
+
+    return entry;
+}
+
+#define new_text_entry(id, text) new_text_entry_for("TEST", id, text)
+
+/*
+ * Test if statements are only compiled once and then reused.
+ */
+static void
+test_database_statement_cache(TEST_ARGS)
+{
+    g_autoptr(GError) error = NULL;
+    ClipporDatabaseStats stats;
+    uint64_t prepared;
+
+    g_autoptr(ClipporEntry) entry = new_text_entry("1", "Hello");
+
+    g_assert_true(clippor_database_serialize_entry(fixture->db, entry, &error));
+    g_assert_no_error(error);
+
+    clippor_database_get_stats(fixture->db, &stats);
+    prepared = stats.statements_prepared;
+
+    g_assert_cmpuint(prepared, >, 0);
+
+    // Doing the same thing again should not prepare any new statements
+    for (int i = 0; i < 10; i++)
+    {
+        g_autofree char *id = g_strdup_printf("%d", i + 2);
+        g_autoptr(ClipporEntry) other = new_text_entry(id, "World");
+
+        g_assert_true(
+            clippor_database_serialize_entry(fixture->db, other, &error)
+        );
+        g_assert_no_error(error);
+    }
+
+    clippor_database_get_stats(fixture->db, &stats);
+
+    g_assert_cmpuint(stats.statements_prepared, ==, prepared);
+    g_assert_cmpuint(stats.statement_cache_hits, >=, 10 * prepared);
+}
+
+/*
+ * Test if trimming only removes the oldest entries of the given clipboard.
+ */
+static void
+test_database_trim(TEST_ARGS)
+{
+    g_autoptr(GError) error = NULL;
+    g_autoptr(GPtrArray) entries =
+        g_ptr_array_new_with_free_func(g_object_unref);
+
+    for (int i = 0; i < 8; i++)
+    {
+        g_autofree char *id = g_strdup_printf("%d", i);
+        ClipporEntry *entry =
+            new_text_entry_for(i % 2 ? "OTHER" : "TEST", id, i < 4 ? "A" : id);
+
+        g_assert_true(
+            clippor_database_serialize_entry(fixture->db, entry, &error)
+        );
+        g_assert_no_error(error);
+        g_ptr_array_add(entries, entry);
+    }
+
+    g_assert_true(
+        clippor_database_trim_entries(fixture->db, "TEST", 2, &error)
+    );
+    g_assert_no_error(error);
+
+    // Only the two most recent entries for "TEST" should be left, and "OTHER"
+    // should be untouched.
+    for (int i = 0; i < 8; i++)
+    {
+        int ret = clippor_database_entry_exists(
+            fixture->db, entries->pdata[i], &error
+        );
+
+        g_assert_no_error(error);
+
+        if (i % 2 == 0 && i < 4)
+            g_assert_cmpint(ret, ==, 1);
+        else
+            g_assert_cmpint(ret, ==, 0);
+    }
+}
+
+static void
+trim_callback(ClipporDatabase *db, GAsyncResult *result, int64_t *removed)
+{
+    g_autoptr(GError) error = NULL;
+
+    *removed = clippor_database_trim_entries_finish(db, result, &error);
+    g_assert_no_error(error);
+}
+
+/*
+ * Test if trimming goes by the number of entries that are actually left after
+ * some were deleted, and if it does nothing when there are few enough.
+ */
+static void
+test_database_trim_after_delete(TEST_ARGS)
+{
+    g_autoptr(GError) error = NULL;
+    g_autoptr(GPtrArray) entries =
+        g_ptr_array_new_with_free_func(g_object_unref);
+
+    for (int i = 0; i < 5; i++)
+    {
+        g_autofree char *id = g_strdup_printf("%d", i);
+        ClipporEntry *entry = new_text_entry_for("TEST", id, id);
+
+        g_assert_true(
+            clippor_database_serialize_entry(fixture->db, entry, &error)
+        );
+        g_assert_no_error(error);
+        g_ptr_array_add(entries, entry);
+    }
+
+    g_assert_true(clippor_database_delete_entry(fixture->db, "3", &error));
+    g_assert_no_error(error);
+
+    // Four entries are left, so only the oldest one should go
+    g_assert_true(
+        clippor_database_trim_entries(fixture->db, "TEST", 3, &error)
+    );
+    g_assert_no_error(error);
+    g_assert_true(
+        clippor_database_trim_entries(fixture->db, "TEST", 3, &error)
+    );
+    g_assert_no_error(error);
+
+    for (int i = 0; i < 5; i++)
+    {
+        int ret = clippor_database_entry_exists(
+            fixture->db, entries->pdata[i], &error
+        );
+
+        g_assert_no_error(error);
+        g_assert_cmpint(ret, ==, i == 0 || i == 3 ? 1 : 0);
+    }
+
+    g_autoptr(ClipporEntry) entry = clippor_database_deserialize_entry_at_index(
+        fixture->db, "TEST", 2, &error
+    );
+
+    g_assert_no_error(error);
+    g_assert_cmpstr(clippor_entry_get_id(entry), ==, "1");
+}
+
+/*
+ * Test if trimming in the writer thread keeps removing entries in batches until
+ * the clipboard is trimmed.
+ */
+static void
+test_database_trim_incremental(TEST_ARGS)
+{
+    g_autoptr(GError) error = NULL;
+
+    for (int i = 0; i < 1000; i++)
+    {
+        g_autofree char *id = g_strdup_printf("%d", i);
+        g_autoptr(ClipporEntry) entry = new_text_entry(id, id);
+
+        g_assert_true(
+            clippor_database_serialize_entry(fixture->db, entry, &error)
+        );
+        g_assert_no_error(error);
+    }
+
+    int64_t removed = -1;
+
+    clippor_database_trim_entries_async(
+        fixture->db, "TEST", 10, NULL, (GAsyncReadyCallback)trim_callback,
+        &removed
+    );
+
+    // Flushing should wait for every batch, even though the trim is put back
+    // behind the flush after each one.
+    clippor_database_flush(fixture->db);
+
+    int64_t cursor = -1;
+    g_autoptr(GPtrArray) entries = clippor_database_deserialize_entries(
+        fixture->db, "TEST", 100, &cursor, &error
+    );
+
+    while (removed == -1)
+        g_main_context_iteration(fixture->context, TRUE);
+
+    g_assert_no_error(error);
+    g_assert_cmpint(removed, ==, 990);
+    g_assert_cmpuint(entries->len, ==, 10);
+    g_assert_cmpstr(clippor_entry_get_id(entries->pdata[0]), ==, "999");
+}
+
+static void
+async_callback(ClipporDatabase *db, GAsyncResult *result, void *user_data)
+{
+    int *count = user_data;
+    g_autoptr(GError) error = NULL;
+
+    if (g_async_result_is_tagged(
+            result, clippor_database_serialize_entry_async
+        ))
+        clippor_database_serialize_entry_finish(db, result, &error);
+    else if (g_async_result_is_tagged(
+                 result, clippor_database_trim_entries_async
+             ))
+        clippor_database_trim_entries_finish(db, result, &error);
+    else
+    {
+        // Entry was already trimmed
+        gboolean ret =
+            clippor_database_delete_entry_finish(db, result, &error);
+
+        g_assert_false(ret);
+        g_assert_error(
+            error, CLIPPOR_DATABASE_ERROR, CLIPPOR_DATABASE_ERROR_ROW_NOT_EXIST
+        );
+        g_clear_error(&error);
+    }
+
+    g_assert_no_error(error);
+    (*count)++;
+}
+
+/*
+ * Test if jobs done by the writer thread are done in order and complete in the
+ * main context.
+ */
+static void
+test_database_async(TEST_ARGS)
+{
+    g_autoptr(ClipporEntry) entry = new_text_entry("1", "Hello");
+    g_autoptr(ClipporEntry) entry2 = new_text_entry("2", "World");
+    int count = 0;
+
+    clippor_database_serialize_entry_async(
+        fixture->db, entry, NULL, (GAsyncReadyCallback)async_callback, &count
+    );
+    clippor_database_serialize_entry_async(
+        fixture->db, entry2, NULL, (GAsyncReadyCallback)async_callback, &count
+    );
+    clippor_database_trim_entries_async(
+        fixture->db, "TEST", 1, NULL, (GAsyncReadyCallback)async_callback,
+        &count
+    );
+    clippor_database_delete_entry_async(
+        fixture->db, "1", NULL, (GAsyncReadyCallback)async_callback, &count
+    );
+
+    clippor_database_flush(fixture->db);
+
+    // Callbacks should only be called in the main context
+    g_assert_cmpint(count, ==, 0);
+
+    while (count < 4)
+        g_main_context_iteration(fixture->context, TRUE);
+
+    g_assert_cmpint(
+        clippor_database_entry_exists(fixture->db, entry, NULL), ==, 1
+    );
+    g_assert_cmpint(
+        clippor_database_entry_exists(fixture->db, entry2, NULL), ==, 0
+    );
+}
+
+/*
+ * Test if data ids are the same when computed in chunks, and if the database
+ * uses the data ids that are carried by an entry.
+ */
+static void
+test_database_checksum(TEST_ARGS)
+{
+    g_autoptr(GError) error = NULL;
+    g_autoptr(ClipporDatabase) db = clippor_database_new(
+        NULL, CLIPPOR_DATABASE_IN_MEMORY | CLIPPOR_DATABASE_FAST_CHECKSUM,
+        &error
+    );
+
+    g_assert_no_error(error);
+
+    // XXH64 of "Hello" followed by its size
+    const char *hello_id = "0a75a91375b27d440000000000000005";
+    g_autoptr(ClipporChecksum) checksum =
+        clippor_checksum_new(CLIPPOR_CHECKSUM_XXH64);
+
+    clippor_checksum_update(checksum, (uint8_t *)"Hel", 3);
+    clippor_checksum_update(checksum, (uint8_t *)"lo", 2);
+
+    g_autofree char *streamed = clippor_checksum_get_string(checksum);
+
+    g_assert_cmpstr(streamed, ==, hello_id);
+
+    // Entry without any data ids
+    g_autoptr(ClipporEntry) entry = new_text_entry("1", "Hello");
+
+    g_assert_true(clippor_database_serialize_entry(db, entry, &error));
+    g_assert_no_error(error);
+
+    // Entry that already has a data id should keep it
+    int64_t time = g_get_real_time();
+    g_autoptr(ClipporEntry) entry2 =
+        clippor_entry_new_full("TEST", "2", time, time, 0);
+    g_autoptr(GBytes) bytes = g_bytes_new_static("World", 5);
+
+    clippor_entry_add_mime_type_with_id(entry2, "text/plain", bytes, "world");
+
+    g_assert_true(clippor_database_serialize_entry(db, entry2, &error));
+    g_assert_no_error(error);
+
+    g_autoptr(ClipporEntry) loaded =
+        clippor_database_deserialize_entry_with_id(db, "1", &error);
+
+    g_assert_no_error(error);
+    g_assert_cmpstr(
+        clippor_entry_get_data_id(loaded, "text/plain"), ==, hello_id
+    );
+    g_assert_cmpstr(clippor_entry_get_data_id(loaded, "TEXT"), ==, hello_id);
+
+    g_autoptr(ClipporEntry) loaded2 =
+        clippor_database_deserialize_entry_with_id(db, "2", &error);
+
+    g_assert_no_error(error);
+    g_assert_cmpstr(
+        clippor_entry_get_data_id(loaded2, "text/plain"), ==, "world"
+    );
+}
+
+/*
+ * Test if small data stored inside the database and large data stored outside
+ * of it are both loaded and removed the same way.
+ */
+static void
+test_database_inline(TEST_ARGS)
+{
+    g_autoptr(GError) error = NULL;
+    const char *texts[] = {"Hello", "This text is too big to be stored inline"};
+
+    g_object_set(fixture->db, "inline-threshold", (int64_t)8, NULL);
+
+    for (uint i = 0; i < G_N_ELEMENTS(texts); i++)
+    {
+        g_autofree char *id = g_strdup_printf("%u", i);
+        g_autoptr(ClipporEntry) entry = new_text_entry(id, texts[i]);
+
+        g_assert_true(
+            clippor_database_serialize_entry(fixture->db, entry, &error)
+        );
+        g_assert_no_error(error);
+
+        g_autoptr(ClipporEntry) loaded =
+            clippor_database_deserialize_entry_with_id(fixture->db, id, &error);
+
+        g_assert_no_error(error);
+
+        g_autoptr(GBytes) bytes =
+            clippor_entry_get_data(loaded, "text/plain");
+        size_t sz;
+        const char *data = g_bytes_get_data(bytes, &sz);
+
+        g_assert_cmpmem(data, sz, texts[i], strlen(texts[i]));
+
+        g_assert_true(clippor_database_delete_entry(fixture->db, id, &error));
+        g_assert_no_error(error);
+        g_assert_cmpint(
+            clippor_database_entry_exists(fixture->db, entry, NULL), ==, 1
+        );
+    }
+}
+
+/*
+ * Test if data of deserialized entries is only loaded when it is needed, and
+ * can be released and loaded again.
+ */
+static void
+test_database_lazy(TEST_ARGS)
+{
+    g_autoptr(GError) error = NULL;
+
+    g_object_set(fixture->db, "inline-threshold", (int64_t)0, NULL);
+
+    g_autoptr(ClipporEntry) entry = new_text_entry("1", "Hello");
+
+    g_assert_true(clippor_database_serialize_entry(fixture->db, entry, &error));
+    g_assert_no_error(error);
+
+    g_autoptr(ClipporEntry) loaded =
+        clippor_database_deserialize_entry_with_id(fixture->db, "1", &error);
+
+    g_assert_no_error(error);
+
+    g_assert_null(clippor_entry_peek_data(loaded, "text/plain"));
+    g_assert_cmpint(clippor_entry_get_data_size(loaded, "text/plain"), ==, 5);
+    g_assert_cmpint(clippor_entry_get_data_size(loaded, "none"), ==, -1);
+
+    for (int i = 0; i < 2; i++)
+    {
+        g_autoptr(GBytes) bytes = clippor_entry_get_data(loaded, "text/plain");
+        g_autoptr(GBytes) peeked = clippor_entry_peek_data(loaded, "TEXT");
+
+        // Mime types with the same data should share it
+        g_assert_true(bytes == peeked);
+        g_assert_cmpmem(
+            g_bytes_get_data(bytes, NULL), g_bytes_get_size(bytes), "Hello", 5
+        );
+
+        g_assert_cmpuint(clippor_entry_release_data(loaded), ==, 5);
+        g_assert_null(clippor_entry_peek_data(loaded, "text/plain"));
+    }
+
+    // Serializing an entry whose data isn't loaded should still work
+    g_assert_true(
+        clippor_database_serialize_entry(fixture->db, loaded, &error)
+    );
+    g_assert_no_error(error);
+}
+
+/*
+ * Test if entries are paged through from most recent to oldest, with their
+ * mime types loaded.
+ */
+static void
+test_database_deserialize_entries(TEST_ARGS)
+{
+    g_autoptr(GError) error = NULL;
+
+    for (int i = 0; i < 10; i++)
+    {
+        g_autofree char *id = g_strdup_printf("%d", i);
+        g_autoptr(ClipporEntry) entry =
+            new_text_entry_for(i % 2 ? "OTHER" : "TEST", id, id);
+
+        g_assert_true(
+            clippor_database_serialize_entry(fixture->db, entry, &error)
+        );
+        g_assert_no_error(error);
+    }
+
+    int64_t cursor = -1;
+    int expected = 8;
+
+    do
+    {
+        g_autoptr(GPtrArray) entries = clippor_database_deserialize_entries(
+            fixture->db, "TEST", 2, &cursor, &error
+        );
+
+        g_assert_no_error(error);
+        g_assert_nonnull(entries);
+
+        for (uint i = 0; i < entries->len; i++, expected -= 2)
+        {
+            ClipporEntry *entry = entries->pdata[i];
+            g_autofree char *id = g_strdup_printf("%d", expected);
+            g_autoptr(GBytes) bytes = clippor_entry_get_data(entry, "TEXT");
+
+            g_assert_cmpstr(clippor_entry_get_id(entry), ==, id);
+            g_assert_cmpstr(clippor_entry_get_clipboard(entry), ==, "TEST");
+            g_assert_cmpmem(
+                g_bytes_get_data(bytes, NULL), g_bytes_get_size(bytes), id,
+                strlen(id)
+            );
+        }
+    } while (cursor != -1);
+
+    g_assert_cmpint(expected, ==, -2);
+}
+
+/*
+ * Remove directory and everything inside it.
+ */
+static void
+remove_dir(const char *path)
+{
+    g_autoptr(GDir) dir = g_dir_open(path, 0, NULL);
+    const char *name;
+
+    g_assert_nonnull(dir);
+
+    while ((name = g_dir_read_name(dir)) != NULL)
+    {
+        g_autofree char *child = g_build_filename(path, name, NULL);
+
+        if (g_file_test(child, G_FILE_TEST_IS_DIR))
+            remove_dir(child);
+        else
+            g_unlink(child);
+    }
+
+    g_rmdir(path);
+}
+
+/*
+ * Test if data stored in files is loaded correctly, and still usable after its
+ * file is removed.
+ */
+static void
+test_database_file(TEST_UARGS)
+{
+    g_autoptr(GError) error = NULL;
+    g_autofree char *dir = g_dir_make_tmp("clippor-XXXXXX", &error);
+
+    g_assert_no_error(error);
+
+    g_autoptr(ClipporDatabase) db =
+        clippor_database_new(dir, CLIPPOR_DATABASE_DEFAULT, &error);
+
+    g_assert_no_error(error);
+
+    // Don't store anything inline
+    g_object_set(db, "inline-threshold", (int64_t)0, NULL);
+
+    g_autoptr(ClipporEntry) entry = new_text_entry("1", "Hello");
+
+    g_assert_true(clippor_database_serialize_entry(db, entry, &error));
+    g_assert_no_error(error);
+
+    g_autoptr(ClipporEntry) loaded =
+        clippor_database_deserialize_entry_with_id(db, "1", &error);
+
+    g_assert_no_error(error);
+
+    g_autoptr(GBytes) bytes = clippor_entry_get_data(loaded, "TEXT");
+
+    g_assert_true(clippor_database_delete_entry(db, "1", &error));
+    g_assert_no_error(error);
+
+    size_t sz;
+    const char *data = g_bytes_get_data(bytes, &sz);
+
+    g_assert_cmpmem(data, sz, "Hello", 5);
+
+    g_clear_object(&db);
+    remove_dir(dir);
+}
+
+/*
+ * Test if files in the data directory that no data refers to are removed by
+ * garbage collection, while ones that are used are kept.
+ */
+static void
+test_database_gc(TEST_UARGS)
+{
+    g_autoptr(GError) error = NULL;
+    g_autofree char *dir = g_dir_make_tmp("clippor-XXXXXX", &error);
+
+    g_assert_no_error(error);
+
+    g_autoptr(ClipporDatabase) db =
+        clippor_database_new(dir, CLIPPOR_DATABASE_DEFAULT, &error);
+
+    g_assert_no_error(error);
+
+    g_object_set(db, "inline-threshold", (int64_t)0, NULL);
+
+    g_autoptr(ClipporEntry) entry = new_text_entry("1", "Hello");
+
+    g_assert_true(clippor_database_serialize_entry(db, entry, &error));
+    g_assert_no_error(error);
+
+    // Pretend we crashed before the file could be removed
+    g_autofree char *orphan = g_strdup_printf("%s/data/orphan", dir);
+
+    g_assert_true(g_file_set_contents(orphan, "0123456789", 10, &error));
+    g_assert_no_error(error);
+
+    int64_t reclaimed = clippor_database_collect_garbage(db, &error);
+
+    g_assert_no_error(error);
+    g_assert_cmpint(reclaimed, ==, 10);
+    g_assert_false(g_file_test(orphan, G_FILE_TEST_EXISTS));
+
+    g_autoptr(ClipporEntry) loaded =
+        clippor_database_deserialize_entry_with_id(db, "1", &error);
+
+    g_assert_no_error(error);
+
+    g_autoptr(GBytes) bytes = clippor_entry_get_data(loaded, "TEXT");
+
+    g_assert_cmpmem(
+        g_bytes_get_data(bytes, NULL), g_bytes_get_size(bytes), "Hello", 5
+    );
+
+    g_clear_object(&db);
+    remove_dir(dir);
+}
+
+/*
+ * Test if the data files of an entry are written as a single batch, and that
+ * no temporary files are left behind.
+ */
+static void
+test_database_blob_batch(TEST_UARGS)
+{
+    g_autoptr(GError) error = NULL;
+    g_autofree char *dir = g_dir_make_tmp("clippor-XXXXXX", &error);
+
+    g_assert_no_error(error);
+
+    g_autoptr(ClipporDatabase) db =
+        clippor_database_new(dir, CLIPPOR_DATABASE_DEFAULT, &error);
+
+    g_assert_no_error(error);
+
+    g_object_set(db, "inline-threshold", (int64_t)0, NULL);
+
+    // Two mime types share the same data, so only two files are written
+    g_autoptr(ClipporEntry) entry = new_text_entry("1", "Hello");
+    g_autoptr(GBytes) bytes = g_bytes_new_static("World", 5);
+
+    clippor_entry_add_mime_type(entry, "text/html", bytes);
+
+    g_assert_true(clippor_database_serialize_entry(db, entry, &error));
+    g_assert_no_error(error);
+
+    // Data files already exist, so nothing should be written again
+    g_autoptr(ClipporEntry) other = new_text_entry("2", "Hello");
+
+    g_assert_true(clippor_database_serialize_entry(db, other, &error));
+    g_assert_no_error(error);
+
+    ClipporDatabaseStats stats;
+
+    clippor_database_get_stats(db, &stats);
+
+    g_assert_cmpuint(stats.blob_batches, ==, 1);
+    g_assert_cmpuint(stats.blobs_written, ==, 2);
+
+    g_autofree char *data_dir_path = g_build_filename(dir, "data", NULL);
+    g_autoptr(GDir) data_dir = g_dir_open(data_dir_path, 0, &error);
+    const char *name;
+    uint files = 0;
+
+    g_assert_no_error(error);
+
+    while ((name = g_dir_read_name(data_dir)) != NULL)
+    {
+        g_assert_false(g_str_has_prefix(name, "."));
+        files++;
+    }
+    g_assert_cmpuint(files, ==, 2);
+
+    g_clear_object(&db);
+    remove_dir(dir);
+}
+
+/*
+ * Test if data is appended to segments when packing, and if the live data of
+ * mostly dead segments is moved so that they can be removed.
+ */
+static void
+test_database_pack(TEST_UARGS)
+{
+    g_autoptr(GError) error = NULL;
+    g_autofree char *dir = g_dir_make_tmp("clippor-XXXXXX", &error);
+
+    g_assert_no_error(error);
+
+    ClipporDatabase *db =
+        clippor_database_new(dir, CLIPPOR_DATABASE_PACKED, &error);
+
+    g_assert_no_error(error);
+
+    // Three pieces of data fit in each segment
+    g_object_set(
+        db, "inline-threshold", (int64_t)0, "segment-size", (int64_t)21, NULL
+    );
+
+    for (int i = 0; i < 8; i++)
+    {
+        g_autofree char *id = g_strdup_printf("%d", i);
+        g_autofree char *text = g_strdup_printf("Entry %d", i);
+        g_autoptr(ClipporEntry) entry = new_text_entry(id, text);
+
+        g_assert_true(clippor_database_serialize_entry(db, entry, &error));
+        g_assert_no_error(error);
+    }
+
+    // Leave the first segment without any live data, and the second one with
+    // only a third of it.
+    for (int i = 0; i < 5; i++)
+    {
+        g_autofree char *id = g_strdup_printf("%d", i);
+
+        g_assert_true(clippor_database_delete_entry(db, id, &error));
+        g_assert_no_error(error);
+    }
+
+    g_assert_true(clippor_database_run_maintenance(db, &error));
+    g_assert_no_error(error);
+
+    ClipporDatabaseStats stats;
+
+    clippor_database_get_stats(db, &stats);
+    g_assert_cmpuint(stats.pack.pages, ==, 7);
+
+    g_object_unref(db);
+
+    g_autofree char *segment1 = g_strdup_printf("%s/packs/1", dir);
+    g_autofree char *segment2 = g_strdup_printf("%s/packs/2", dir);
+    g_autofree char *segment3 = g_strdup_printf("%s/packs/3", dir);
+
+    g_assert_false(g_file_test(segment1, G_FILE_TEST_EXISTS));
+    g_assert_false(g_file_test(segment2, G_FILE_TEST_EXISTS));
+    g_assert_true(g_file_test(segment3, G_FILE_TEST_EXISTS));
+
+    // Segments are still read when packing isn't used anymore
+    db = clippor_database_new(dir, CLIPPOR_DATABASE_DEFAULT, &error);
+
+    g_assert_no_error(error);
+
+    for (int i = 5; i < 8; i++)
+    {
+        g_autofree char *id = g_strdup_printf("%d", i);
+        g_autofree char *text = g_strdup_printf("Entry %d", i);
+        g_autoptr(ClipporEntry) loaded =
+            clippor_database_deserialize_entry_with_id(db, id, &error);
+
+        g_assert_no_error(error);
+
+        g_autoptr(GBytes) bytes = clippor_entry_get_data(loaded, "TEXT");
+
+        g_assert_cmpmem(
+            g_bytes_get_data(bytes, NULL), g_bytes_get_size(bytes), text,
+            strlen(text)
+        );
+    }
+
+    // Nothing should have been written to files of their own
+    g_autofree char *data_dir_path = g_build_filename(dir, "data", NULL);
+    g_autoptr(GDir) data_dir = g_dir_open(data_dir_path, 0, NULL);
+
+    if (data_dir != NULL)
+        g_assert_null(g_dir_read_name(data_dir));
+
+    g_object_unref(db);
+    remove_dir(dir);
+}
+
+static void
+load_data_callback(GObject *object, GAsyncResult *result, void *user_data)
+{
+    GBytes **bytes = user_data;
+    g_autoptr(GError) error = NULL;
+
+    *bytes =
+        clippor_entry_get_data_finish(CLIPPOR_ENTRY(object), result, &error);
+
+    g_assert_no_error(error);
+    g_assert_nonnull(*bytes);
+}
+
+/*
+ * Test if data stored in files can be loaded asynchronously, and is then kept
+ * in memory.
+ */
+static void
+test_database_load_async(TEST_UARGS)
+{
+    g_autoptr(GError) error = NULL;
+    g_autofree char *dir = g_dir_make_tmp("clippor-XXXXXX", &error);
+
+    g_assert_no_error(error);
+
+    g_autoptr(ClipporDatabase) db =
+        clippor_database_new(dir, CLIPPOR_DATABASE_DEFAULT, &error);
+
+    g_assert_no_error(error);
+
+    g_object_set(db, "inline-threshold", (int64_t)0, NULL);
+
+    g_autoptr(ClipporEntry) entry = new_text_entry("1", "Hello");
+
+    g_assert_true(clippor_database_serialize_entry(db, entry, &error));
+    g_assert_no_error(error);
+
+    g_autoptr(ClipporEntry) loaded =
+        clippor_database_deserialize_entry_with_id(db, "1", &error);
+
+    g_assert_no_error(error);
+    g_assert_null(clippor_entry_peek_data(loaded, "TEXT"));
+
+    g_autoptr(GBytes) bytes = NULL;
+
+    clippor_entry_get_data_async(
+        loaded, "TEXT", NULL, load_data_callback, &bytes
+    );
+
+    while (bytes == NULL)
+        g_main_context_iteration(NULL, TRUE);
+
+    g_assert_cmpmem(
+        g_bytes_get_data(bytes, NULL), g_bytes_get_size(bytes), "Hello", 5
+    );
+
+    g_autoptr(GBytes) peeked = clippor_entry_peek_data(loaded, "text/plain");
+
+    g_assert_true(peeked == bytes);
+
+    g_clear_object(&loaded);
+    g_clear_object(&db);
+    remove_dir(dir);
+}
+
+static void
+read_callback(GObject *object, GAsyncResult *result, void *user_data)
+{
+    GAsyncResult **ret = user_data;
+
+    *ret = g_object_ref(result);
+}
+
+/*
+ * Test if entries can be listed, searched and looked up in worker threads
+ * using the read-only connections.
+ */
+static void
+test_database_readers(TEST_UARGS)
+{
+    g_autoptr(GError) error = NULL;
+    g_autofree char *dir = g_dir_make_tmp("clippor-XXXXXX", &error);
+
+    g_assert_no_error(error);
+
+    g_autoptr(ClipporDatabase) db =
+        clippor_database_new(dir, CLIPPOR_DATABASE_DEFAULT, &error);
+
+    g_assert_no_error(error);
+
+    for (int i = 0; i < 3; i++)
+    {
+        g_autofree char *id = g_strdup_printf("%d", i);
+        g_autofree char *text = g_strdup_printf("Hello %d", i);
+        g_autoptr(ClipporEntry) entry = new_text_entry(id, text);
+
+        g_assert_true(clippor_database_serialize_entry(db, entry, &error));
+        g_assert_no_error(error);
+    }
+
+    GAsyncResult *entries_result = NULL, *search_result = NULL,
+                 *entry_result = NULL;
+
+    // Start them all at once, so that more than one reader may be used
+    clippor_database_deserialize_entries_async(
+        db, "TEST", 2, -1, NULL, read_callback, &entries_result
+    );
+    clippor_database_search_async(
+        db, "TEST", "hello", 10, NULL, read_callback, &search_result
+    );
+    clippor_database_deserialize_entry_with_id_async(
+        db, "1", NULL, read_callback, &entry_result
+    );
+
+    while (entries_result == NULL || search_result == NULL ||
+           entry_result == NULL)
+        g_main_context_iteration(NULL, TRUE);
+
+    int64_t cursor;
+    g_autoptr(GPtrArray) entries = clippor_database_deserialize_entries_finish(
+        db, entries_result, &cursor, &error
+    );
+
+    g_assert_no_error(error);
+    g_assert_cmpuint(entries->len, ==, 2);
+    g_assert_cmpstr(clippor_entry_get_id(entries->pdata[0]), ==, "2");
+    g_assert_cmpint(cursor, !=, -1);
+
+    g_autoptr(GPtrArray) results =
+        clippor_database_search_finish(db, search_result, &error);
+
+    g_assert_no_error(error);
+    g_assert_cmpuint(results->len, ==, 3);
+
+    g_autoptr(ClipporEntry) entry =
+        clippor_database_deserialize_entry_with_id_finish(
+            db, entry_result, &error
+        );
+
+    g_assert_no_error(error);
+    g_assert_cmpstr(clippor_entry_get_id(entry), ==, "1");
+
+    g_object_unref(entries_result);
+    g_object_unref(search_result);
+    g_object_unref(entry_result);
+
+    // Readers are reused instead of opening one for every read
+    ClipporDatabaseStats stats;
+
+    g_clear_pointer(&entries, g_ptr_array_unref);
+    entries =
+        clippor_database_deserialize_entries(db, "TEST", 2, &cursor, &error);
+
+    g_assert_no_error(error);
+    g_assert_cmpuint(entries->len, ==, 1);
+
+    clippor_database_get_stats(db, &stats);
+    g_assert_cmpuint(stats.readers_opened, >=, 1);
+    g_assert_cmpuint(stats.readers_opened, <=, 3);
+
+    g_clear_pointer(&entries, g_ptr_array_unref);
+    g_clear_pointer(&results, g_ptr_array_unref);
+    g_clear_object(&entry);
+    g_clear_object(&db);
+    remove_dir(dir);
+}
+
+/*
+ * Test if a database that uses the old schema is moved to the compact schema,
+ * keeping its entries, mime types and data, and if its entries get a preview.
+ */
+static void
+test_database_compact(TEST_UARGS)
+{
+    g_autoptr(GError) error = NULL;
+    g_autofree char *dir = g_dir_make_tmp("clippor-XXXXXX", &error);
+
+    g_assert_no_error(error);
+
+    g_autofree char *path = g_build_filename(dir, "history.sqlite3", NULL);
+    sqlite3 *handle;
+
+    // Schema at version 6
+    g_assert_cmpint(sqlite3_open(path, &handle), ==, SQLITE_OK);
+    g_assert_cmpint(
+        sqlite3_exec(
+            handle,
+            "CREATE TABLE Entries ("
+            "   Position INTEGER PRIMARY KEY AUTOINCREMENT,"
+            "   Id CHAR(40) NOT NULL UNIQUE,"
+            "   Creation_time INTEGER NOT NULL,"
+            "   Last_used_time INTEGER NOT NULL,"
+            "   Flags INTEGER NOT NULL,"
+            "   Clipboard TEXT NOT NULL,"
+            "   Fingerprint CHAR(40)"
+            ");"
+            "CREATE TABLE Mime_types ("
+            "   Id CHAR(40), Mime_type TEXT, Data_id CHAR(40),"
+            "   PRIMARY KEY (Id, Mime_type)"
+            ");"
+            "CREATE TABLE Data ("
+            "   Data_id CHAR(40) PRIMARY KEY,"
+            "   Ref_count INTEGER DEFAULT 1,"
+            "   Checksum INTEGER NOT NULL DEFAULT 0,"
+            "   Contents BLOB,"
+            "   Size INTEGER"
+            ");"
+            "CREATE VIRTUAL TABLE Search USING fts5 (Text);"
+            "CREATE TABLE Version (Db_version INTEGER UNIQUE NOT NULL);"
+            "INSERT INTO Version VALUES (6);"
+            "INSERT INTO Entries "
+            "(Id, Creation_time, Last_used_time, Flags, Clipboard) "
+            "VALUES ('1', 1, 1, 0, 'TEST'), ('2', 2, 2, 0, 'TEST');"
+            "INSERT INTO Data VALUES "
+            "('0123456789abcdef0123456789abcdef', 2, 1, 'Hello', 5),"
+            "('world', 1, 0, 'World', 5);"
+            "INSERT INTO Mime_types VALUES "
+            "('1', 'text/plain', '0123456789abcdef0123456789abcdef'),"
+            "('1', 'TEXT', '0123456789abcdef0123456789abcdef'),"
+            "('2', 'text/plain', 'world');"
+            "INSERT INTO Search (rowid, Text) "
+            "VALUES (1, ' Hello' || char(10, 10, 9) || 'there ');",
+            NULL, NULL, NULL
+        ),
+        ==, SQLITE_OK
+    );
+    sqlite3_close(handle);
+
+    // Open it twice, to check that it stays usable after being migrated
+    for (int i = 0; i < 2; i++)
+    {
+        g_autoptr(ClipporDatabase) db =
+            clippor_database_new(dir, CLIPPOR_DATABASE_DEFAULT, &error);
+
+        g_assert_no_error(error);
+
+        g_autoptr(ClipporEntry) first =
+            clippor_database_deserialize_entry_with_id(db, "1", &error);
+
+        g_assert_no_error(error);
+        g_assert_cmpstr(
+            clippor_entry_get_data_id(first, "TEXT"), ==,
+            "0123456789abcdef0123456789abcdef"
+        );
+
+        g_autoptr(GBytes) bytes = clippor_entry_get_data(first, "text/plain");
+
+        g_assert_cmpmem(
+            g_bytes_get_data(bytes, NULL), g_bytes_get_size(bytes), "Hello", 5
+        );
+
+        // Preview is made from the indexed text, like for new entries
+        g_assert_cmpstr(clippor_entry_get_preview(first), ==, "Hello there");
+
+        g_autoptr(ClipporEntry) second =
+            clippor_database_deserialize_entry_at_index(db, "TEST", 0, &error);
+
+        g_assert_no_error(error);
+        g_assert_cmpstr(clippor_entry_get_id(second), ==, "2");
+        g_assert_cmpstr(
+            clippor_entry_get_data_id(second, "text/plain"), ==, "world"
+        );
+
+        // Reference counts should have been moved as well
+        g_assert_cmpint(clippor_database_collect_garbage(db, &error), ==, 0);
+        g_assert_no_error(error);
+    }
+
+    remove_dir(dir);
+}
+
+/*
+ * Test if the least recently used data is moved out of memory once the memory
+ * budget is exceeded, and read back when it is used again.
+ */
+static void
+test_database_memory_budget(TEST_ARGS)
+{
+    g_autoptr(GError) error = NULL;
+    const char *texts[] = {"Hello", "World", "Third"};
+
+    g_object_set(
+        fixture->db, "inline-threshold", (int64_t)0, "memory-budget",
+        (int64_t)10, NULL
+    );
+
+    for (uint i = 0; i < G_N_ELEMENTS(texts); i++)
+    {
+        g_autofree char *id = g_strdup_printf("%u", i);
+        g_autoptr(ClipporEntry) entry = new_text_entry(id, texts[i]);
+
+        g_assert_true(
+            clippor_database_serialize_entry(fixture->db, entry, &error)
+        );
+        g_assert_no_error(error);
+    }
+
+    ClipporDatabaseStats stats;
+
+    clippor_database_get_stats(fixture->db, &stats);
+
+    g_assert_cmpuint(stats.store.resident, ==, 10);
+    g_assert_cmpuint(stats.store.spilled, ==, 5);
+    g_assert_cmpuint(stats.store.spills, ==, 1);
+
+    g_autoptr(ClipporEntry) entry =
+        clippor_database_deserialize_entry_with_id(fixture->db, "0", &error);
+
+    g_assert_no_error(error);
+
+    g_autoptr(GBytes) bytes = clippor_entry_get_data(entry, "TEXT");
+
+    g_assert_cmpmem(
+        g_bytes_get_data(bytes, NULL), g_bytes_get_size(bytes), "Hello", 5
+    );
+
+    // "World" should now be the least recently used
+    clippor_database_get_stats(fixture->db, &stats);
+
+    g_assert_cmpuint(stats.store.reloads, ==, 1);
+    g_assert_cmpuint(stats.store.resident, ==, 10);
+    g_assert_cmpuint(stats.store.spilled, ==, 5);
+    g_assert_cmpuint(stats.store.spills, ==, 2);
+}
+
+/*
+ * Test if data over the memory budget is spilled to a file in the data
+ * directory, which is never left behind in it.
+ */
+static void
+test_database_spill_directory(TEST_UARGS)
+{
+    g_autoptr(GError) error = NULL;
+    g_autofree char *dir = g_dir_make_tmp("clippor-XXXXXX", &error);
+
+    g_assert_no_error(error);
+
+    g_autoptr(ClipporDatabase) db =
+        clippor_database_new(dir, CLIPPOR_DATABASE_IN_MEMORY, &error);
+
+    g_assert_no_error(error);
+
+    g_object_set(
+        db, "inline-threshold", (int64_t)0, "memory-budget", (int64_t)5, NULL
+    );
+
+    for (int i = 0; i < 2; i++)
+    {
+        g_autofree char *id = g_strdup_printf("%d", i);
+        g_autoptr(ClipporEntry) entry = new_text_entry(id, i ? "World" : "Hi");
+
+        g_assert_true(clippor_database_serialize_entry(db, entry, &error));
+        g_assert_no_error(error);
+    }
+
+    ClipporDatabaseStats stats;
+
+    clippor_database_get_stats(db, &stats);
+
+    g_assert_cmpuint(stats.store.spills, ==, 1);
+
+    g_autoptr(GDir) d = g_dir_open(dir, 0, &error);
+
+    g_assert_no_error(error);
+    g_assert_null(g_dir_read_name(d));
+
+    g_clear_object(&db);
+    remove_dir(dir);
+}
+
+/*
+ * Test if maintenance gives the pages of removed entries back and records
+ * statistics for each step.
+ */
+static void
+test_database_maintenance(TEST_ARGS)
+{
+    g_autoptr(GError) error = NULL;
+    g_autofree char *text = g_strnfill(64 * 1024, 'a');
+
+    // Store the data inside the database so it takes up pages
+    g_object_set(fixture->db, "inline-threshold", (int64_t)G_MAXINT32, NULL);
+
+    for (int i = 0; i < 8; i++)
+    {
+        g_autofree char *id = g_strdup_printf("%d", i);
+        g_autoptr(ClipporEntry) entry = new_text_entry(id, text);
+
+        text[0]++;
+
+        g_assert_true(
+            clippor_database_serialize_entry(fixture->db, entry, &error)
+        );
+        g_assert_no_error(error);
+    }
+
+    g_assert_true(
+        clippor_database_trim_entries(fixture->db, "TEST", 0, &error)
+    );
+    g_assert_no_error(error);
+
+    g_assert_true(clippor_database_run_maintenance(fixture->db, &error));
+    g_assert_no_error(error);
+
+    ClipporDatabaseStats stats;
+
+    clippor_database_get_stats(fixture->db, &stats);
+
+    g_assert_cmpuint(stats.checkpoint.runs, ==, 1);
+    g_assert_cmpuint(stats.vacuum.runs, >=, 1);
+    g_assert_cmpuint(stats.vacuum.pages, >, 0);
+    g_assert_cmpuint(stats.optimize.runs, ==, 1);
+}
+
+/*
+ * Test if entries can be found by their text, and stop being found once they
+ * are trimmed.
+ */
+static void
+test_database_search(TEST_ARGS)
+{
+    g_autoptr(GError) error = NULL;
+    const char *texts[] = {
+        "The quick brown fox", "Lazy dog", "Quick \"quoted\" text", "Other"
+    };
+
+    for (uint i = 0; i < G_N_ELEMENTS(texts); i++)
+    {
+        g_autofree char *id = g_strdup_printf("%u", i);
+        g_autoptr(ClipporEntry) entry = new_text_entry(id, texts[i]);
+
+        g_assert_true(
+            clippor_database_serialize_entry(fixture->db, entry, &error)
+        );
+        g_assert_no_error(error);
+    }
+
+    g_autoptr(GPtrArray) results =
+        clippor_database_search(fixture->db, "TEST", "quick", 10, &error);
+
+    g_assert_no_error(error);
+    g_assert_cmpuint(results->len, ==, 2);
+
+    g_clear_pointer(&results, g_ptr_array_unref);
+
+    // Last word is matched as a prefix, and quotes are not FTS5 syntax
+    results = clippor_database_search(
+        fixture->db, "TEST", "\"quoted\" te", 10, &error
+    );
+    g_assert_no_error(error);
+    g_assert_cmpuint(results->len, ==, 1);
+
+    ClipporSearchResult *result = results->pdata[0];
+
+    g_assert_cmpstr(result->id, ==, "2");
+    g_assert_nonnull(strstr(result->snippet, "quoted"));
+
+    g_clear_pointer(&results, g_ptr_array_unref);
+
+    // Clipboard must match
+    results = clippor_database_search(fixture->db, "OTHER", "fox", 10, &error);
+    g_assert_no_error(error);
+    g_assert_cmpuint(results->len, ==, 0);
+
+    g_clear_pointer(&results, g_ptr_array_unref);
+
+    // Trimmed entries are removed from the index
+    g_assert_true(
+        clippor_database_trim_entries(fixture->db, "TEST", 2, &error)
+    );
+    g_assert_no_error(error);
+
+    results = clippor_database_search(fixture->db, "TEST", "quick", 10, &error);
+    g_assert_no_error(error);
+    g_assert_cmpuint(results->len, ==, 1);
+    g_assert_cmpstr(
+        ((ClipporSearchResult *)results->pdata[0])->id, ==, "2"
+    );
+}
+
+/*
+ * Test if the oldest unstarred entries are removed once a clipboard is over its
+ * size, and that the most recent entry is kept even if it is over on its own.
+ */
+static void
+test_database_max_bytes(TEST_ARGS)
+{
+    g_autoptr(GError) error = NULL;
+    int64_t time = g_get_real_time();
+
+    // Each entry is ten bytes, since both mime types share the same data
+    g_autoptr(ClipporEntry) starred = clippor_entry_new_full(
+        "TEST", "0", time, time, CLIPPOR_ENTRY_FLAG_STARRED
+    );
+    g_autoptr(GBytes) bytes = g_bytes_new_static("Starred 0!", 10);
+
+    clippor_entry_add_mime_type(starred, "text/plain", bytes);
+
+    g_assert_true(
+        clippor_database_add_entry(fixture->db, starred, 10, 25, &error)
+    );
+    g_assert_no_error(error);
+
+    for (int i = 1; i < 4; i++)
+    {
+        g_autofree char *id = g_strdup_printf("%d", i);
+        g_autofree char *text = g_strdup_printf("Entry %03d", i);
+        g_autoptr(ClipporEntry) entry = new_text_entry(id, text);
+
+        g_assert_true(
+            clippor_database_add_entry(fixture->db, entry, 10, 25, &error)
+        );
+        g_assert_no_error(error);
+    }
+
+    g_autoptr(GString) large = g_string_new(NULL);
+
+    for (int i = 0; i < 100; i++)
+        g_string_append_c(large, 'a' + i % 26);
+
+    g_autoptr(ClipporEntry) entry = new_text_entry("4", large->str);
+
+    g_assert_true(
+        clippor_database_add_entry(fixture->db, entry, 10, 25, &error)
+    );
+    g_assert_no_error(error);
+
+    // Entries "1" and "2" went first, then "3" to make room for "4"
+    const char *kept[] = {"4", "0"};
+    int64_t cursor = -1;
+    g_autoptr(GPtrArray) entries = clippor_database_deserialize_entries(
+        fixture->db, "TEST", 10, &cursor, &error
+    );
+
+    g_assert_no_error(error);
+    g_assert_cmpuint(entries->len, ==, G_N_ELEMENTS(kept));
+
+    for (uint i = 0; i < G_N_ELEMENTS(kept); i++)
+        g_assert_cmpstr(clippor_entry_get_id(entries->pdata[i]), ==, kept[i]);
+}
+
+/*
+ * Test if entries older than the maximum age are removed, except for starred
+ * ones, and if sensitive entries use their own shorter age.
+ */
+static void
+test_database_expire(TEST_ARGS)
+{
+    g_autoptr(GError) error = NULL;
+    int64_t now = g_get_real_time();
+    int64_t max_age = 60 * G_TIME_SPAN_SECOND;
+    int64_t sensitive_age = 10 * G_TIME_SPAN_SECOND;
+    struct
+    {
+        const char *id;
+        int64_t age;
+        ClipporEntryFlags flags;
+    } entries[] = {
+        {"0", 2 * max_age, 0},
+        {"1", 2 * max_age, CLIPPOR_ENTRY_FLAG_STARRED},
+        {"2", 2 * sensitive_age, CLIPPOR_ENTRY_FLAG_SENSITIVE},
+        {"3", sensitive_age / 2, CLIPPOR_ENTRY_FLAG_SENSITIVE},
+        {"4", sensitive_age / 2, 0},
+    };
+
+    for (uint i = 0; i < G_N_ELEMENTS(entries); i++)
+    {
+        int64_t time = now - entries[i].age;
+        g_autoptr(ClipporEntry) entry = clippor_entry_new_full(
+            "TEST", entries[i].id, time, time, entries[i].flags
+        );
+        g_autofree char *text = g_strdup_printf("Entry %s", entries[i].id);
+        g_autoptr(GBytes) bytes = g_bytes_new(text, strlen(text));
+
+        clippor_entry_add_mime_type(entry, "text/plain", bytes);
+
+        g_assert_true(
+            clippor_database_add_entry(fixture->db, entry, 10, 0, &error)
+        );
+        g_assert_no_error(error);
+    }
+
+    int64_t next = clippor_database_expire_entries(
+        fixture->db, "TEST", max_age, sensitive_age, &error
+    );
+
+    g_assert_no_error(error);
+
+    // The sensitive entry "3" is the next one to expire
+    g_assert_cmpint(next, ==, now - sensitive_age / 2 + sensitive_age);
+
+    const char *kept[] = {"4", "3", "1"};
+    int64_t cursor = -1;
+    g_autoptr(GPtrArray) left = clippor_database_deserialize_entries(
+        fixture->db, "TEST", 10, &cursor, &error
+    );
+
+    g_assert_no_error(error);
+    g_assert_cmpuint(left->len, ==, G_N_ELEMENTS(kept));
+
+    for (uint i = 0; i < G_N_ELEMENTS(kept); i++)
+        g_assert_cmpstr(clippor_entry_get_id(left->pdata[i]), ==, kept[i]);
+
+    // Without any limit, nothing expires
+    next = clippor_database_expire_entries(fixture->db, "TEST", 0, 0, &error);
+
+    g_assert_no_error(error);
+    g_assert_cmpint(next, ==, 0);
+}
+
+static void
+add_entry_at(
+    TestFixture *fixture, const char *id, const char *text, int64_t time
+)
+{
+    g_autoptr(GError) error = NULL;
+    g_autoptr(ClipporEntry) entry = clippor_entry_new_full(
+        "TEST", id, time, time, CLIPPOR_ENTRY_FLAG_NONE
+    );
+    g_autoptr(GBytes) bytes = g_bytes_new(text, strlen(text));
+
+    clippor_entry_add_mime_type(entry, "text/plain", bytes);
+
+    g_assert_true(
+        clippor_database_add_entry(fixture->db, entry, 10, 0, &error)
+    );
+    g_assert_no_error(error);
+}
+
+/*
+ * Test if the most recent entry is never expired, since it may still be the
+ * selection, and if promoting an entry starts its age over.
+ */
+static void
+test_database_expire_newest(TEST_ARGS)
+{
+    g_autoptr(GError) error = NULL;
+    int64_t now = g_get_real_time();
+    int64_t max_age = 60 * G_TIME_SPAN_SECOND;
+
+    add_entry_at(fixture, "0", "Old", now - 3 * max_age);
+    add_entry_at(fixture, "1", "Newest", now - 2 * max_age);
+
+    int64_t next = clippor_database_expire_entries(
+        fixture->db, "TEST", max_age, 0, &error
+    );
+
+    g_assert_no_error(error);
+    g_assert_cmpint(next, ==, 0);
+
+    g_autoptr(ClipporEntry) entry = clippor_database_deserialize_entry_at_index(
+        fixture->db, "TEST", 0, &error
+    );
+
+    g_assert_no_error(error);
+    g_assert_cmpstr(clippor_entry_get_id(entry), ==, "1");
+    g_clear_object(&entry);
+
+    entry = clippor_database_deserialize_entry_at_index(
+        fixture->db, "TEST", 1, &error
+    );
+    g_assert_error(
+        error, CLIPPOR_DATABASE_ERROR, CLIPPOR_DATABASE_ERROR_ROW_NOT_EXIST
+    );
+    g_clear_error(&error);
+
+    // Copying "Newest" again promotes it, so it is recent once it is no longer
+    // the most recent entry.
+    add_entry_at(fixture, "2", "Newest", now);
+    add_entry_at(fixture, "3", "Other", now);
+
+    next = clippor_database_expire_entries(
+        fixture->db, "TEST", max_age, 0, &error
+    );
+
+    g_assert_no_error(error);
+    g_assert_cmpint(next, ==, now + max_age);
+
+    entry = clippor_database_deserialize_entry_at_index(
+        fixture->db, "TEST", 1, &error
+    );
+
+    g_assert_no_error(error);
+    g_assert_cmpstr(clippor_entry_get_id(entry), ==, "2");
+}
+
+/*
+ * Test if the kind of contents and the preview of an entry are stored when it
+ * is serialized, and are there when it is loaded again.
+ */
+static void
+test_database_preview(TEST_ARGS)
+{
+    g_autoptr(GError) error = NULL;
+    g_autoptr(GString) long_text = g_string_new(NULL);
+
+    for (int i = 0; i < 200; i++)
+        g_string_append_c(long_text, 'a' + i % 26);
+
+    struct
+    {
+        const char *mime_type;
+        const char *text;
+        ClipporEntryContent content;
+        const char *preview;
+    } entries[] = {
+        {"text/plain", "  Hello\n\n\tWorld \n", CLIPPOR_ENTRY_CONTENT_TEXT,
+         "Hello World"},
+        {"text/plain", long_text->str, CLIPPOR_ENTRY_CONTENT_TEXT, NULL},
+        {"text/uri-list", "file:///tmp/a\r\nfile:///tmp/b\r\n",
+         CLIPPOR_ENTRY_CONTENT_URI_LIST, "file:///tmp/a file:///tmp/b"},
+        {"image/png", "PNG", CLIPPOR_ENTRY_CONTENT_IMAGE, NULL},
+        {"application/octet-stream", "\x01\x02", CLIPPOR_ENTRY_CONTENT_OTHER,
+         NULL},
+    };
+
+    for (uint i = 0; i < G_N_ELEMENTS(entries); i++)
+    {
+        g_autofree char *id = g_strdup_printf("%u", i);
+        int64_t time = g_get_real_time();
+        g_autoptr(ClipporEntry) entry = clippor_entry_new_full(
+            "TEST", id, time, time, CLIPPOR_ENTRY_FLAG_NONE
+        );
+        g_autoptr(GBytes) bytes =
+            g_bytes_new(entries[i].text, strlen(entries[i].text));
+
+        clippor_entry_add_mime_type(entry, entries[i].mime_type, bytes);
+
+        g_assert_true(
+            clippor_database_serialize_entry(fixture->db, entry, &error)
+        );
+        g_assert_no_error(error);
+    }
+
+    int64_t cursor = -1;
+    g_autoptr(GPtrArray) loaded = clippor_database_deserialize_entries(
+        fixture->db, "TEST", 10, &cursor, &error
+    );
+
+    g_assert_no_error(error);
+    g_assert_cmpuint(loaded->len, ==, G_N_ELEMENTS(entries));
+
+    for (uint i = 0; i < G_N_ELEMENTS(entries); i++)
+    {
+        // Most recent entry comes first
+        ClipporEntry *entry = loaded->pdata[loaded->len - 1 - i];
+
+        g_assert_cmpint(
+            clippor_entry_get_content(entry), ==, entries[i].content
+        );
+        g_assert_cmpint(
+            clippor_entry_get_size(entry), ==, strlen(entries[i].text)
+        );
+
+        if (i == 1)
+        {
+            // Long text is cut off
+            const char *preview = clippor_entry_get_preview(entry);
+
+            g_assert_cmpint(g_utf8_strlen(preview, -1), ==, 100);
+            g_assert_true(g_str_has_prefix(long_text->str, preview));
+        }
+        else
+            g_assert_cmpstr(
+                clippor_entry_get_preview(entry), ==, entries[i].preview
+            );
+    }
+}
+
+/*
+ * Test if adding an entry with the same contents as an existing one moves the
+ * existing entry to the top instead of adding a new one.
+ */
+static void
+test_database_promote(TEST_ARGS)
+{
+    g_autoptr(GError) error = NULL;
+    const char *texts[] = {"Hello", "World", "Hello"};
+
+    for (uint i = 0; i < G_N_ELEMENTS(texts); i++)
+    {
+        g_autofree char *id = g_strdup_printf("%u", i);
+        g_autoptr(ClipporEntry) entry = new_text_entry(id, texts[i]);
+
+        g_assert_true(
+            clippor_database_add_entry(fixture->db, entry, 10, 0, &error)
+        );
+        g_assert_no_error(error);
+    }
+
+    // Entry "0" should have been replaced by "2", which is now the most recent
+    g_autoptr(ClipporEntry) first = clippor_database_deserialize_entry_at_index(
+        fixture->db, "TEST", 0, &error
+    );
+    g_assert_no_error(error);
+    g_assert_cmpstr(clippor_entry_get_id(first), ==, "2");
+
+    g_autoptr(ClipporEntry) second =
+        clippor_database_deserialize_entry_at_index(
+            fixture->db, "TEST", 1, &error
+        );
+    g_assert_no_error(error);
+    g_assert_cmpstr(clippor_entry_get_id(second), ==, "1");
+
+    g_autoptr(ClipporEntry) third = clippor_database_deserialize_entry_at_index(
+        fixture->db, "TEST", 2, &error
+    );
+    g_assert_error(
+        error, CLIPPOR_DATABASE_ERROR, CLIPPOR_DATABASE_ERROR_ROW_NOT_EXIST
+    );
+    g_assert_null(third);
+    g_clear_error(&error);
+
+    g_autoptr(GBytes) bytes = clippor_entry_get_data(first, "TEXT");
+
+    g_assert_cmpmem(
+        g_bytes_get_data(bytes, NULL), g_bytes_get_size(bytes), "Hello", 5
+    );
+
+    // Search index should follow the entry
+    g_autoptr(GPtrArray) results =
+        clippor_database_search(fixture->db, "TEST", "hello", 10, &error);
+
+    g_assert_no_error(error);
+    g_assert_cmpuint(results->len, ==, 1);
+    g_assert_cmpstr(
+        ((ClipporSearchResult *)results->pdata[0])->id, ==, "2"
+    );
+}
+
+/*
+ * Test if deserialized entries are reused from the cache, and that the cache
+ * is invalidated when the entry is changed or removed.
+ */
+static void
+test_database_entry_cache(TEST_ARGS)
+{
+    g_autoptr(GError) error = NULL;
+    ClipporDatabaseStats stats;
+
+    g_autoptr(ClipporEntry) entry = new_text_entry("1", "Hello");
+
+    g_assert_true(clippor_database_serialize_entry(fixture->db, entry, &error));
+    g_assert_no_error(error);
+
+    for (int i = 0; i < 2; i++)
+    {
+        g_autoptr(ClipporEntry) loaded =
+            clippor_database_deserialize_entry_with_id(
+                fixture->db, "1", &error
+            );
+
+        g_assert_no_error(error);
+        g_assert_true(loaded != entry);
+        g_assert_cmpstr(clippor_entry_get_id(loaded), ==, "1");
+
+        g_autoptr(GBytes) bytes = clippor_entry_get_data(loaded, "TEXT");
+
+        g_assert_cmpmem(
+            g_bytes_get_data(bytes, NULL), g_bytes_get_size(bytes), "Hello", 5
+        );
+    }
+
+    clippor_database_get_stats(fixture->db, &stats);
+
+    g_assert_cmpuint(stats.entry_cache_misses, ==, 1);
+    g_assert_cmpuint(stats.entry_cache_hits, ==, 1);
+    g_assert_cmpuint(stats.entry_cache_used, >, 0);
+
+    // Changing the entry should not return the old cached one
+    int64_t time = g_get_real_time();
+    g_autoptr(ClipporEntry) starred = clippor_entry_new_full(
+        "TEST", "1", time, time, CLIPPOR_ENTRY_FLAG_STARRED
+    );
+    g_autoptr(GBytes) bytes = g_bytes_new_static("Hello", 5);
+
+    clippor_entry_add_mime_type(starred, "TEXT", bytes);
+
+    g_assert_true(
+        clippor_database_serialize_entry(fixture->db, starred, &error)
+    );
+    g_assert_no_error(error);
+
+    g_autoptr(ClipporEntry) loaded =
+        clippor_database_deserialize_entry_at_index(
+            fixture->db, "TEST", 0, &error
+        );
+
+    g_assert_no_error(error);
+    g_assert_cmpuint(
+        clippor_entry_get_flags(loaded), ==, CLIPPOR_ENTRY_FLAG_STARRED
+    );
+    g_assert_null(clippor_entry_get_data_id(loaded, "text/plain"));
+
+    clippor_database_get_stats(fixture->db, &stats);
+    g_assert_cmpuint(stats.entry_cache_misses, ==, 2);
+
+    // Neither should trimming it
+    g_assert_true(
+        clippor_database_trim_entries(fixture->db, "TEST", 0, &error)
+    );
+    g_assert_no_error(error);
+
+    g_autoptr(ClipporEntry) removed =
+        clippor_database_deserialize_entry_with_id(fixture->db, "1", &error);
+
+    g_assert_error(
+        error, CLIPPOR_DATABASE_ERROR, CLIPPOR_DATABASE_ERROR_ROW_NOT_EXIST
+    );
+    g_assert_null(removed);
+
+    clippor_database_get_stats(fixture->db, &stats);
+    g_assert_cmpuint(stats.entry_cache_used, ==, 0);
+}
+
+int
+main(int argc, char *argv[])
+{
+    setlocale(LC_ALL, "");
+
+    g_test_init(&argc, &argv, NULL);
+
+    test_setup();
+
+    TEST("/database/statement-cache", test_database_statement_cache);
+    TEST("/database/trim", test_database_trim);
+    TEST("/database/trim-after-delete", test_database_trim_after_delete);
+    TEST("/database/trim-incremental", test_database_trim_incremental);
+    TEST("/database/async", test_database_async);
+    TEST("/database/checksum", test_database_checksum);
+    TEST("/database/inline", test_database_inline);
+    TEST("/database/lazy", test_database_lazy);
+    TEST("/database/deserialize-entries", test_database_deserialize_entries);
+    TEST("/database/file", test_database_file);
+    TEST("/database/gc", test_database_gc);
+    TEST("/database/blob-batch", test_database_blob_batch);
+    TEST("/database/pack", test_database_pack);
+    TEST("/database/load-async", test_database_load_async);
+    TEST("/database/readers", test_database_readers);
+    TEST("/database/compact", test_database_compact);
+    TEST("/database/memory-budget", test_database_memory_budget);
+    TEST("/database/spill-directory", test_database_spill_directory);
+    TEST("/database/maintenance", test_database_maintenance);
+    TEST("/database/search", test_database_search);
+    TEST("/database/promote", test_database_promote);
+    TEST("/database/max-bytes", test_database_max_bytes);
+    TEST("/database/expire", test_database_expire);
+    TEST("/database/expire-newest", test_database_expire_newest);
+    TEST("/database/preview", test_database_preview);
+    TEST("/database/entry-cache", test_database_entry_cache);
+
+    return g_test_run();
+}